@@ -0,0 +1,125 @@
+#ifndef ABI_CACHE_HPP
+#define ABI_CACHE_HPP
+
+#include <eosio/chain/abi_serializer.hpp>
+#include <eosio/chain/types.hpp>
+
+#include <fc/optional.hpp>
+#include <fc/time.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+namespace eosio {
+
+// LRU cache of abi_serializers by account, shared by the serialization threads.
+// Accounts without an ABI are cached too, as null entries, and so are failed loads,
+// as null entries that are loaded again once retry_after has passed.
+class abi_cache {
+ public:
+  using abi_ptr = std::shared_ptr<const chain::abi_serializer>;
+  // Returns the account's ABI, an empty optional if it has none, or throws if it cannot tell.
+  using loader = std::function<fc::optional<chain::abi_def>(const chain::account_name&)>;
+
+  abi_cache(size_t capacity, const fc::microseconds& max_time, const fc::microseconds& retry_after, loader load)
+      : m_capacity(std::max<size_t>(1, capacity)), m_maxTime(max_time), m_retryAfter(retry_after),
+        m_load(std::move(load)) {}
+
+  const fc::microseconds& max_time() const { return m_maxTime; }
+
+  // Null if the account has no ABI or loading it failed, now or less than retry_after ago.
+  abi_ptr get(const chain::account_name& account) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      auto itr = m_index.find(account.value);
+      if (itr != m_index.end() &&
+          (itr->second->retry_at == fc::time_point() || fc::time_point::now() < itr->second->retry_at)) {
+        m_entries.splice(m_entries.begin(), m_entries, itr->second);
+        return itr->second->abi;
+      }
+    }
+    abi_ptr abi;
+    fc::time_point retry_at;
+    try {
+      abi = make(m_load(account));
+    } catch (...) {
+      // e.g. a timeout; remembered so that lookups do not wait on the loader again and again
+      retry_at = fc::time_point::now() + m_retryAfter;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    put(account, abi, retry_at);
+    return abi;
+  }
+
+  // Replaces the account's entry, e.g. after a setabi action.
+  void set(const chain::account_name& account, const fc::optional<chain::abi_def>& abi) {
+    auto serializer = make(abi);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    put(account, std::move(serializer), fc::time_point());
+  }
+
+  // Drops the account's entry, the next lookup loads it again.
+  void erase(const chain::account_name& account) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto itr = m_index.find(account.value);
+    if (itr != m_index.end()) {
+      m_entries.erase(itr->second);
+      m_index.erase(itr);
+    }
+  }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_index.size();
+  }
+
+ private:
+  struct entry {
+    chain::account_name account;
+    abi_ptr abi;
+    // set for failed loads, when to load again
+    fc::time_point retry_at;
+  };
+
+  abi_ptr make(const fc::optional<chain::abi_def>& abi) const {
+    if (!abi) {
+      return abi_ptr();
+    }
+    return std::make_shared<const chain::abi_serializer>(*abi, m_maxTime);
+  }
+
+  void put(const chain::account_name& account, abi_ptr abi, const fc::time_point& retry_at) {
+    auto itr = m_index.find(account.value);
+    if (itr != m_index.end()) {
+      itr->second->abi = std::move(abi);
+      itr->second->retry_at = retry_at;
+      m_entries.splice(m_entries.begin(), m_entries, itr->second);
+      return;
+    }
+    m_entries.push_front(entry{account, std::move(abi), retry_at});
+    m_index[account.value] = m_entries.begin();
+    if (m_index.size() > m_capacity) {
+      m_index.erase(m_entries.back().account.value);
+      m_entries.pop_back();
+    }
+  }
+
+  const size_t m_capacity;
+  const fc::microseconds m_maxTime;
+  const fc::microseconds m_retryAfter;
+  loader m_load;
+
+  mutable std::mutex m_mutex;
+  // most recently used first
+  std::list<entry> m_entries;
+  std::unordered_map<uint64_t, std::list<entry>::iterator> m_index;
+};
+
+}  // namespace eosio
+
+#endif
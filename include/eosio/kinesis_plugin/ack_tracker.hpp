@@ -0,0 +1,48 @@
+#ifndef ACK_TRACKER_HPP
+#define ACK_TRACKER_HPP
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+namespace eosio {
+
+// Turns out-of-order acknowledgements of sequential offsets into a watermark:
+// the first offset that has not been acknowledged yet. Thread safe.
+class ack_tracker {
+ public:
+  explicit ack_tracker(uint64_t watermark = 0) : m_watermark(watermark) {}
+
+  // Returns the watermark after acknowledging offset.
+  uint64_t ack(uint64_t offset) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (offset < m_watermark) {
+      return m_watermark;
+    }
+    const uint64_t index = offset - m_watermark;
+    if (index >= m_window.size()) {
+      m_window.resize(index + 1, false);
+    }
+    m_window[index] = true;
+    while (!m_window.empty() && m_window.front()) {
+      m_window.pop_front();
+      ++m_watermark;
+    }
+    return m_watermark;
+  }
+
+  uint64_t watermark() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_watermark;
+  }
+
+ private:
+  mutable std::mutex m_mutex;
+  uint64_t m_watermark;
+  // m_window[i] is set once m_watermark + i has been acknowledged.
+  std::deque<bool> m_window;
+};
+
+}  // namespace eosio
+
+#endif
@@ -0,0 +1,336 @@
+#ifndef ACTION_COLUMNS_HPP
+#define ACTION_COLUMNS_HPP
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace eosio {
+
+// One row of the flat actions table: an action trace, inline ones included, with its
+// transaction and block. Names are the raw uint64 values of EOSIO names.
+struct action_row {
+  uint32_t block_num = 0;
+  uint64_t block_time = 0;  // milliseconds since epoch
+  std::array<uint8_t, 32> trx_id{};
+  uint64_t global_sequence = 0;
+  uint64_t receiver = 0;
+  uint64_t account = 0;
+  uint64_t name = 0;
+  std::vector<std::pair<uint64_t, uint64_t>> authorization;  // (actor, permission)
+  std::string data;
+};
+
+// Columnar batch of action rows, written by action_batch_writer and read back by
+// action_batch_reader:
+//
+//   batch:  magic u32 "KACB" | version u8 | rows varuint | columns varuint | column...
+//   column: encoding u8 | size varuint | size bytes
+//
+// Columns, in this order: block_num, block_time, trx_id, global_sequence, receiver,
+// account, name, auth_count, auth_actor, auth_permission, data. auth_count holds the
+// number of authorizations of each row, auth_actor and auth_permission one value per
+// authorization. Encodings:
+//
+//   plain:      a varuint per value; data: varuint length | bytes, per row
+//   delta:      zigzag varuint of the difference to the previous value (the first to 0)
+//   dictionary: count varuint | distinct values (u64 little endian, or 32 bytes for
+//               trx_id) | a varuint index into them per value
+//
+// Readers skip columns they do not know by their size.
+enum class column_encoding : uint8_t { plain = 0, delta = 1, dictionary = 2 };
+
+class action_batch_writer {
+ public:
+  static constexpr uint32_t kMAGIC = 0x4243414b;  // "KACB"
+  static constexpr uint8_t kVERSION = 1;
+  static constexpr size_t kCOLUMNS = 11;
+
+  void add(const action_row& row) {
+    put_delta(m_blockNum, m_lastBlockNum, row.block_num);
+    put_delta(m_blockTime, m_lastBlockTime, row.block_time);
+    m_trxIds.add(std::string(reinterpret_cast<const char *>(row.trx_id.data()), row.trx_id.size()));
+    put_delta(m_globalSequence, m_lastGlobalSequence, row.global_sequence);
+    m_receivers.add(row.receiver);
+    m_accounts.add(row.account);
+    m_names.add(row.name);
+    put_varuint(m_authCount, row.authorization.size());
+    for (const auto& auth : row.authorization) {
+      m_authActors.add(auth.first);
+      m_authPermissions.add(auth.second);
+    }
+    put_varuint(m_data, row.data.size());
+    m_data.append(row.data);
+    ++m_rows;
+  }
+
+  size_t rows() const { return m_rows; }
+
+  // Upper bound of the size of the encoded batch.
+  size_t size() const {
+    return 16 + kCOLUMNS * 11 + m_blockNum.size() + m_blockTime.size() + m_trxIds.size() + m_globalSequence.size() +
+           m_receivers.size() + m_accounts.size() + m_names.size() + m_authCount.size() + m_authActors.size() +
+           m_authPermissions.size() + m_data.size();
+  }
+
+  // Appends the encoded batch to out and starts a new one.
+  void finish(std::string& out) {
+    out.reserve(out.size() + size());
+    put_fixed(out, kMAGIC);
+    out.push_back(static_cast<char>(kVERSION));
+    put_varuint(out, m_rows);
+    put_varuint(out, kCOLUMNS);
+    put_column(out, column_encoding::delta, m_blockNum);
+    put_column(out, column_encoding::delta, m_blockTime);
+    put_column(out, column_encoding::dictionary, m_trxIds.encode());
+    put_column(out, column_encoding::delta, m_globalSequence);
+    put_column(out, column_encoding::dictionary, m_receivers.encode());
+    put_column(out, column_encoding::dictionary, m_accounts.encode());
+    put_column(out, column_encoding::dictionary, m_names.encode());
+    put_column(out, column_encoding::plain, m_authCount);
+    put_column(out, column_encoding::dictionary, m_authActors.encode());
+    put_column(out, column_encoding::dictionary, m_authPermissions.encode());
+    put_column(out, column_encoding::plain, m_data);
+    *this = action_batch_writer();
+  }
+
+  static void put_varuint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+      out.push_back(static_cast<char>(v | 0x80));
+      v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+  }
+
+  template<typename T>
+  static void put_fixed(std::string& out, T v) {
+    char buf[sizeof(T)];
+    std::memcpy(buf, &v, sizeof(T));
+    out.append(buf, sizeof(T));
+  }
+
+ private:
+  // Distinct values in order of appearance and the index of each value.
+  template<typename Key, size_t kValueSize>
+  class dictionary {
+   public:
+    void add(const Key& v) {
+      auto itr = m_index.find(v);
+      if (itr == m_index.end()) {
+        itr = m_index.emplace(v, static_cast<uint32_t>(m_values.size())).first;
+        m_values.push_back(v);
+      }
+      put_varuint(m_indexes, itr->second);
+    }
+
+    size_t size() const { return 10 + m_values.size() * kValueSize + m_indexes.size(); }
+
+    std::string encode() const {
+      std::string out;
+      out.reserve(size());
+      put_varuint(out, m_values.size());
+      for (const auto& v : m_values) {
+        put_value(out, v);
+      }
+      out.append(m_indexes);
+      return out;
+    }
+
+   private:
+    static void put_value(std::string& out, uint64_t v) { put_fixed(out, v); }
+    static void put_value(std::string& out, const std::string& v) { out.append(v); }
+
+    std::unordered_map<Key, uint32_t> m_index;
+    std::vector<Key> m_values;
+    std::string m_indexes;
+  };
+
+  static void put_delta(std::string& out, uint64_t& last, uint64_t v) {
+    const int64_t delta = static_cast<int64_t>(v - last);
+    put_varuint(out, (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63));
+    last = v;
+  }
+
+  static void put_column(std::string& out, column_encoding encoding, const std::string& bytes) {
+    out.push_back(static_cast<char>(encoding));
+    put_varuint(out, bytes.size());
+    out.append(bytes);
+  }
+
+  size_t m_rows = 0;
+  uint64_t m_lastBlockNum = 0;
+  uint64_t m_lastBlockTime = 0;
+  uint64_t m_lastGlobalSequence = 0;
+  std::string m_blockNum;
+  std::string m_blockTime;
+  dictionary<std::string, 32> m_trxIds;
+  std::string m_globalSequence;
+  dictionary<uint64_t, sizeof(uint64_t)> m_receivers;
+  dictionary<uint64_t, sizeof(uint64_t)> m_accounts;
+  dictionary<uint64_t, sizeof(uint64_t)> m_names;
+  std::string m_authCount;
+  dictionary<uint64_t, sizeof(uint64_t)> m_authActors;
+  dictionary<uint64_t, sizeof(uint64_t)> m_authPermissions;
+  std::string m_data;
+};
+
+// Decodes batches written by action_batch_writer. Throws std::runtime_error on
+// malformed input.
+class action_batch_reader {
+ public:
+  // Decodes the batch at data, appends its rows and returns its size in bytes.
+  static size_t read(const char *data, size_t size, std::vector<action_row>& rows) {
+    cursor in{data, data + size};
+    if (in.fixed<uint32_t>() != action_batch_writer::kMAGIC) {
+      throw std::runtime_error("not an action batch");
+    }
+    const uint8_t version = in.fixed<uint8_t>();
+    if (version != action_batch_writer::kVERSION) {
+      throw std::runtime_error("unsupported action batch version " + std::to_string(version));
+    }
+    const size_t count = in.count(size);
+    const size_t columns = in.varuint();
+    if (columns < action_batch_writer::kCOLUMNS) {
+      throw std::runtime_error("action batch with " + std::to_string(columns) + " columns");
+    }
+    const size_t first = rows.size();
+    rows.resize(first + count);
+    auto row = [&rows, first](size_t i) -> action_row& { return rows[first + i]; };
+
+    cursor c = in.column(column_encoding::delta);
+    for (uint64_t i = 0, last = 0; i < count; ++i) {
+      row(i).block_num = static_cast<uint32_t>(last = c.delta(last));
+    }
+    c = in.column(column_encoding::delta);
+    for (uint64_t i = 0, last = 0; i < count; ++i) {
+      row(i).block_time = last = c.delta(last);
+    }
+    c = in.column(column_encoding::dictionary);
+    {
+      const size_t n = c.count(c.left() / 32);
+      const char *ids = c.take(n * 32);
+      for (size_t i = 0; i < count; ++i) {
+        std::memcpy(row(i).trx_id.data(), ids + c.index(n) * 32, 32);
+      }
+    }
+    c = in.column(column_encoding::delta);
+    for (uint64_t i = 0, last = 0; i < count; ++i) {
+      row(i).global_sequence = last = c.delta(last);
+    }
+    for (uint64_t action_row::*field : {&action_row::receiver, &action_row::account, &action_row::name}) {
+      c = in.column(column_encoding::dictionary);
+      const auto values = c.dictionary();
+      for (size_t i = 0; i < count; ++i) {
+        row(i).*field = values[c.index(values.size())];
+      }
+    }
+    c = in.column(column_encoding::plain);
+    for (size_t i = 0; i < count; ++i) {
+      row(i).authorization.resize(c.count(size));
+    }
+    cursor actors = in.column(column_encoding::dictionary);
+    cursor permissions = in.column(column_encoding::dictionary);
+    const auto actor_values = actors.dictionary();
+    const auto permission_values = permissions.dictionary();
+    for (size_t i = 0; i < count; ++i) {
+      for (auto& auth : row(i).authorization) {
+        auth.first = actor_values[actors.index(actor_values.size())];
+        auth.second = permission_values[permissions.index(permission_values.size())];
+      }
+    }
+    c = in.column(column_encoding::plain);
+    for (size_t i = 0; i < count; ++i) {
+      const size_t n = c.count(c.left());
+      row(i).data.assign(c.take(n), n);
+    }
+    // columns added by later writers
+    for (size_t i = action_batch_writer::kCOLUMNS; i < columns; ++i) {
+      in.fixed<uint8_t>();
+      in.take(in.count(in.left()));
+    }
+    return in.p - data;
+  }
+
+ private:
+  struct cursor {
+    const char *p;
+    const char *end;
+
+    size_t left() const { return end - p; }
+
+    const char *take(size_t n) {
+      if (n > left()) {
+        throw std::runtime_error("truncated action batch");
+      }
+      const char *r = p;
+      p += n;
+      return r;
+    }
+
+    template<typename T>
+    T fixed() {
+      T v;
+      std::memcpy(&v, take(sizeof(T)), sizeof(T));
+      return v;
+    }
+
+    uint64_t varuint() {
+      uint64_t v = 0;
+      for (int shift = 0; shift < 64; shift += 7) {
+        const uint8_t b = fixed<uint8_t>();
+        v |= uint64_t(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+          return v;
+        }
+      }
+      throw std::runtime_error("malformed varuint in action batch");
+    }
+
+    // a varuint that must not exceed max, e.g. an index or a length
+    size_t count(size_t max) {
+      const uint64_t v = varuint();
+      if (v > max) {
+        throw std::runtime_error("malformed action batch");
+      }
+      return static_cast<size_t>(v);
+    }
+
+    size_t index(size_t size) {
+      const uint64_t v = varuint();
+      if (v >= size) {
+        throw std::runtime_error("dictionary index out of range in action batch");
+      }
+      return static_cast<size_t>(v);
+    }
+
+    uint64_t delta(uint64_t last) {
+      const uint64_t z = varuint();
+      return last + ((z >> 1) ^ (~(z & 1) + 1));
+    }
+
+    std::vector<uint64_t> dictionary() {
+      std::vector<uint64_t> values(count(left() / sizeof(uint64_t)));
+      for (auto& v : values) {
+        v = fixed<uint64_t>();
+      }
+      return values;
+    }
+
+    cursor column(column_encoding expected) {
+      if (fixed<uint8_t>() != static_cast<uint8_t>(expected)) {
+        throw std::runtime_error("unexpected column encoding in action batch");
+      }
+      const size_t n = count(left());
+      return cursor{take(n), p};
+    }
+  };
+};
+
+}  // namespace eosio
+
+#endif
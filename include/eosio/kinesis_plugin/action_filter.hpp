@@ -0,0 +1,193 @@
+#ifndef ACTION_FILTER_HPP
+#define ACTION_FILTER_HPP
+
+#include <eosio/chain/trace.hpp>
+#include <eosio/chain/types.hpp>
+
+#include <boost/algorithm/string.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace eosio {
+
+// Include/exclude rules on the actions of a transaction trace, compiled into one hash set per
+// combination of wildcards actually used, so matching an action costs a handful of lookups
+// regardless of the number of rules.
+//
+// A rule is `receiver:account:action:actor`, or `receiver:action:actor` for any account; blank
+// fields match anything, e.g. `eosio.token:::` or `:eosio.token:transfer:`. An action is kept if it
+// matches an include rule (or there are none) and no exclude rule. The actor field matches any of
+// the action's authorizers.
+class action_filter {
+ public:
+  void include(const std::string& rule) { add(m_include, rule); }
+  void exclude(const std::string& rule) { add(m_exclude, rule); }
+
+  bool empty() const { return m_include.empty() && m_exclude.empty(); }
+
+  bool keep(const chain::action_trace& at) const {
+    return (m_include.empty() || m_include.matches(at)) && !m_exclude.matches(at);
+  }
+
+  // True if any action of t, inline ones included, is kept.
+  bool matches(const chain::transaction_trace& t) const {
+    bool all = true;
+    bool any = false;
+    for (const auto& at : t.action_traces) {
+      scan(at, all, any);
+    }
+    return any;
+  }
+
+  // Returns the trace to send: t itself if all actions are kept, a copy without the dropped
+  // actions if only some are, or null if none are. Dropped actions stay in the copy as long
+  // as one of their inline actions is kept.
+  chain::transaction_trace_ptr apply(const chain::transaction_trace_ptr& t) const {
+    if (empty()) {
+      return t;
+    }
+    bool all = true;
+    bool any = false;
+    for (const auto& at : t->action_traces) {
+      scan(at, all, any);
+    }
+    if (all) {
+      return t;
+    }
+    if (!any) {
+      return chain::transaction_trace_ptr();
+    }
+    auto pruned = std::make_shared<chain::transaction_trace>(*t);
+    prune(pruned->action_traces);
+    return pruned;
+  }
+
+ private:
+  enum wildcard : uint8_t {
+    any_receiver = 1,
+    any_account = 2,
+    any_action = 4,
+    any_actor = 8
+  };
+
+  struct rule_key {
+    uint64_t receiver;
+    uint64_t account;
+    uint64_t action;
+    uint64_t actor;
+    uint8_t mask;
+
+    bool operator==(const rule_key& o) const {
+      return receiver == o.receiver && account == o.account && action == o.action && actor == o.actor &&
+             mask == o.mask;
+    }
+  };
+
+  struct rule_key_hash {
+    size_t operator()(const rule_key& k) const {
+      uint64_t h = k.mask;
+      for (uint64_t v : {k.receiver, k.account, k.action, k.actor}) {
+        h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+      }
+      return static_cast<size_t>(h);
+    }
+  };
+
+  class rule_set {
+   public:
+    bool empty() const { return m_rules.empty(); }
+
+    void insert(rule_key key) {
+      if (m_rules.insert(key).second && std::find(m_masks.begin(), m_masks.end(), key.mask) == m_masks.end()) {
+        m_masks.push_back(key.mask);
+      }
+    }
+
+    bool matches(const chain::action_trace& at) const {
+      const uint64_t receiver = at.receipt.receiver.value;
+      const uint64_t account = at.act.account.value;
+      const uint64_t action = at.act.name.value;
+      for (uint8_t mask : m_masks) {
+        rule_key key{mask & any_receiver ? 0 : receiver, mask & any_account ? 0 : account,
+                     mask & any_action ? 0 : action, 0, mask};
+        if (mask & any_actor) {
+          if (m_rules.count(key) != 0) {
+            return true;
+          }
+          continue;
+        }
+        for (const auto& auth : at.act.authorization) {
+          key.actor = auth.actor.value;
+          if (m_rules.count(key) != 0) {
+            return true;
+          }
+        }
+      }
+      return false;
+    }
+
+   private:
+    std::unordered_set<rule_key, rule_key_hash> m_rules;
+    // Wildcard combinations present in m_rules, each needs one lookup.
+    std::vector<uint8_t> m_masks;
+  };
+
+  static void add(rule_set& set, const std::string& rule) {
+    std::vector<std::string> fields;
+    boost::split(fields, rule, boost::is_any_of(":"));
+    if (fields.size() == 3) {
+      fields.insert(fields.begin() + 1, std::string());
+    }
+    if (fields.size() != 4) {
+      throw std::invalid_argument("invalid kinesis filter '" + rule + "', expected receiver:account:action:actor");
+    }
+    rule_key key{0, 0, 0, 0, 0};
+    uint64_t *values[] = {&key.receiver, &key.account, &key.action, &key.actor};
+    for (size_t i = 0; i < fields.size(); ++i) {
+      if (fields[i].empty()) {
+        key.mask |= static_cast<uint8_t>(1 << i);
+      } else {
+        *values[i] = chain::name(fields[i]).value;
+      }
+    }
+    set.insert(key);
+  }
+
+  void scan(const chain::action_trace& at, bool& all, bool& any) const {
+    if (keep(at)) {
+      any = true;
+    } else {
+      all = false;
+    }
+    for (const auto& inline_trace : at.inline_traces) {
+      scan(inline_trace, all, any);
+    }
+  }
+
+  // Returns true if anything in traces was kept.
+  bool prune(std::vector<chain::action_trace>& traces) const {
+    std::vector<chain::action_trace> kept;
+    for (auto& at : traces) {
+      const bool inlines_kept = prune(at.inline_traces);
+      if (inlines_kept || keep(at)) {
+        kept.push_back(std::move(at));
+      }
+    }
+    traces.swap(kept);
+    return !traces.empty();
+  }
+
+  rule_set m_include;
+  rule_set m_exclude;
+};
+
+}  // namespace eosio
+
+#endif
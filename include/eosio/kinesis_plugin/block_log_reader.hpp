@@ -0,0 +1,149 @@
+#ifndef BLOCK_LOG_READER_HPP
+#define BLOCK_LOG_READER_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace eosio {
+
+// Read-only view of nodeos' blocks.log and blocks.index, safe to use while nodeos
+// keeps appending to them and from any number of threads.
+//
+//   blocks.log:   version u32 | [first block num u32, version >= 2] | ... | block...
+//   block:        packed signed_block | position of the block u64
+//   blocks.index: position u64 of each block, starting with the first block
+//
+// Both files are mapped once; blocks appended afterwards are not visible, and the
+// last indexed block is skipped unless it is complete.
+class block_log_reader {
+ public:
+  struct block_view {
+    const char *data;
+    size_t size;
+  };
+
+  explicit block_log_reader(const boost::filesystem::path& blocks_dir) {
+    // index first, so that every indexed block was written before the log was mapped
+    m_index = map(blocks_dir / "blocks.index");
+    m_log = map(blocks_dir / "blocks.log");
+    if (m_log.size < sizeof(uint32_t)) {
+      throw std::runtime_error("empty block log in " + blocks_dir.string());
+    }
+    const uint32_t version = get<uint32_t>(m_log.data);
+    if (version == 0 || version > 3) {
+      throw std::runtime_error("unsupported block log version " + std::to_string(version));
+    }
+    if (version >= 2 && m_log.size >= 2 * sizeof(uint32_t)) {
+      m_first = get<uint32_t>(m_log.data + sizeof(uint32_t));
+    }
+
+    m_indexed = m_index.size / sizeof(uint64_t);
+    size_t count = m_indexed;
+    while (count > 0 && position(count - 1) >= m_log.size) {
+      --count;
+    }
+    // the trailer of the last visible block must end the log, else a block is half written
+    if (count > 0 && (m_log.size < sizeof(uint64_t) ||
+                      get<uint64_t>(m_log.data + m_log.size - sizeof(uint64_t)) != position(count - 1))) {
+      --count;
+    }
+    m_count = static_cast<uint32_t>(count);
+    ::madvise(const_cast<char *>(m_log.data), m_log.size, MADV_SEQUENTIAL);
+  }
+
+  block_log_reader(const block_log_reader&) = delete;
+  block_log_reader& operator=(const block_log_reader&) = delete;
+
+  ~block_log_reader() {
+    unmap(m_log);
+    unmap(m_index);
+  }
+
+  uint32_t first_block_num() const { return m_first; }
+
+  // first_block_num() - 1 if the log holds no complete block
+  uint32_t last_block_num() const { return m_first + m_count - 1; }
+
+  // The packed signed_block; throws std::out_of_range for blocks not in the log.
+  block_view read(uint32_t block_num) const {
+    if (block_num < m_first || block_num - m_first >= m_count) {
+      throw std::out_of_range("block " + std::to_string(block_num) + " is not in the block log");
+    }
+    const uint32_t i = block_num - m_first;
+    const uint64_t begin = position(i);
+    // a block ends where the next one starts, even if the next one is not complete yet
+    const uint64_t next = i + 1 < m_indexed ? std::min<uint64_t>(position(i + 1), m_log.size) : m_log.size;
+    const uint64_t end = next - sizeof(uint64_t);
+    if (begin >= end || end > m_log.size - sizeof(uint64_t) || get<uint64_t>(m_log.data + end) != begin) {
+      throw std::runtime_error("corrupt block log at block " + std::to_string(block_num));
+    }
+    return block_view{m_log.data + begin, static_cast<size_t>(end - begin)};
+  }
+
+ private:
+  struct mapping {
+    const char *data = nullptr;
+    size_t size = 0;
+  };
+
+  static mapping map(const boost::filesystem::path& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("unable to open " + path.string());
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("unable to stat " + path.string());
+    }
+    mapping m;
+    m.size = static_cast<size_t>(st.st_size);
+    if (m.size > 0) {
+      void *p = ::mmap(nullptr, m.size, PROT_READ, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("unable to map " + path.string());
+      }
+      m.data = static_cast<const char *>(p);
+    }
+    ::close(fd);
+    return m;
+  }
+
+  static void unmap(mapping& m) {
+    if (m.data != nullptr) {
+      ::munmap(const_cast<char *>(m.data), m.size);
+      m.data = nullptr;
+    }
+  }
+
+  template<typename T>
+  static T get(const char *p) {
+    T v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  uint64_t position(size_t i) const { return get<uint64_t>(m_index.data + i * sizeof(uint64_t)); }
+
+  mapping m_log;
+  mapping m_index;
+  uint32_t m_first = 1;
+  uint32_t m_count = 0;
+  // entries in the index, including blocks not visible in the log
+  size_t m_indexed = 0;
+};
+
+}  // namespace eosio
+
+#endif
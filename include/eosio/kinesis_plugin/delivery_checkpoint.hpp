@@ -0,0 +1,104 @@
+#ifndef DELIVERY_CHECKPOINT_HPP
+#define DELIVERY_CHECKPOINT_HPP
+
+#include <eosio/kinesis_plugin/file_io.hpp>
+
+#include <boost/filesystem.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace eosio {
+
+// The highest block whose records have all been acknowledged by Kinesis, and the sequence
+// number Kinesis gave the last of them, kept in a small state file.
+//
+//   file: magic u32 | version u32 | block num u32 | sequence number size u16 | sequence number | fnv1a u32
+//
+// update() only records the new state; flush() persists it with file_io::write_durably, so
+// the file always holds a complete state and the cost of syncing is paid once per flush
+// rather than once per block.
+class delivery_checkpoint {
+ public:
+  explicit delivery_checkpoint(const boost::filesystem::path& path) : m_path(path) {
+    load();
+  }
+
+  uint32_t block_num() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_blockNum;
+  }
+
+  std::string sequence_number() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_sequenceNumber;
+  }
+
+  void update(uint32_t block_num, const std::string& sequence_number) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (block_num <= m_blockNum) {
+      return;
+    }
+    m_blockNum = block_num;
+    m_sequenceNumber = sequence_number.substr(0, UINT16_MAX);
+    m_dirty = true;
+  }
+
+  // Persists the latest update, if any. Throws std::runtime_error if the file cannot be written.
+  void flush() {
+    std::vector<char> buf;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!m_dirty) {
+        return;
+      }
+      file_io::append(buf, kMAGIC);
+      file_io::append(buf, kVERSION);
+      file_io::append(buf, m_blockNum);
+      file_io::append(buf, static_cast<uint16_t>(m_sequenceNumber.size()));
+      buf.insert(buf.end(), m_sequenceNumber.begin(), m_sequenceNumber.end());
+      m_dirty = false;
+    }
+    file_io::append(buf, file_io::fnv1a(buf.data(), buf.size()));
+    file_io::write_durably(m_path, buf.data(), buf.size());
+  }
+
+ private:
+  static constexpr uint32_t kMAGIC = 0x504b434b;  // "KCKP"
+  static constexpr uint32_t kVERSION = 1;
+
+  void load() {
+    std::ifstream in(m_path.string(), std::ios::binary);
+    if (!in) {
+      return;
+    }
+    const std::vector<char> buf((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    const size_t fixed = 3 * sizeof(uint32_t) + sizeof(uint16_t);
+    if (buf.size() < fixed + sizeof(uint32_t) || file_io::get<uint32_t>(buf.data()) != kMAGIC ||
+        file_io::get<uint32_t>(buf.data() + 4) != kVERSION) {
+      throw std::runtime_error("invalid kinesis checkpoint " + m_path.string());
+    }
+    const uint16_t size = file_io::get<uint16_t>(buf.data() + 12);
+    if (buf.size() != fixed + size + sizeof(uint32_t) ||
+        file_io::get<uint32_t>(buf.data() + fixed + size) != file_io::fnv1a(buf.data(), fixed + size)) {
+      throw std::runtime_error("corrupt kinesis checkpoint " + m_path.string());
+    }
+    m_blockNum = file_io::get<uint32_t>(buf.data() + 8);
+    m_sequenceNumber.assign(buf.data() + fixed, size);
+  }
+
+  const boost::filesystem::path m_path;
+  mutable std::mutex m_mutex;
+  uint32_t m_blockNum = 0;
+  std::string m_sequenceNumber;
+  bool m_dirty = false;
+};
+
+}  // namespace eosio
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef FILE_IO_HPP
+#define FILE_IO_HPP
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace eosio {
+
+// Helpers shared by the plugin's on-disk formats (spill log, checkpoints). Integers are
+// stored in host byte order; the files are not meant to move between machines.
+namespace file_io {
+
+template<typename T>
+void put(char *p, T v) {
+  std::memcpy(p, &v, sizeof(v));
+}
+
+template<typename T>
+void append(std::vector<char>& buf, T v) {
+  const char *p = reinterpret_cast<const char *>(&v);
+  buf.insert(buf.end(), p, p + sizeof(v));
+}
+
+template<typename T>
+T get(const char *p) {
+  T v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// Checksum of records and state files.
+inline uint32_t fnv1a(const char *p, size_t n) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < n; ++i) {
+    h = (h ^ static_cast<unsigned char>(p[i])) * 16777619u;
+  }
+  return h;
+}
+
+// Replaces the file at path with data by writing a temporary file, syncing it and renaming
+// it over the old one, so that after a crash the file holds either the old or the new
+// contents. Throws std::runtime_error if the file cannot be written.
+inline void write_durably(const boost::filesystem::path& path, const char *data, size_t size) {
+  const auto tmp = path.string() + ".tmp";
+  const int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("unable to open " + tmp);
+  }
+  const bool ok = ::write(fd, data, size) == static_cast<ssize_t>(size) && ::fdatasync(fd) == 0;
+  ::close(fd);
+  if (!ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+    throw std::runtime_error("unable to write " + path.string());
+  }
+  // make the rename itself durable
+  const int dir = ::open(path.parent_path().empty() ? "." : path.parent_path().c_str(), O_RDONLY);
+  if (dir >= 0) {
+    ::fsync(dir);
+    ::close(dir);
+  }
+}
+
+}  // namespace file_io
+
+}  // namespace eosio
+
+#endif
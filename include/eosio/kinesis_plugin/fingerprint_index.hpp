@@ -0,0 +1,93 @@
+#ifndef FINGERPRINT_INDEX_HPP
+#define FINGERPRINT_INDEX_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace eosio {
+
+// Open addressing (linear probing) map from 64 bit fingerprints to positions, e.g. of
+// transactions in a buffer. The table is allocated once, kept at most half full and
+// cleared in O(1) by starting a new generation: a slot only counts if it was written in
+// the current one. Entries cannot be removed individually. Not thread safe.
+class fingerprint_index {
+ public:
+  static constexpr uint32_t npos = UINT32_MAX;
+
+  // capacity is the number of entries; the table is at least twice that size
+  explicit fingerprint_index(size_t capacity) : m_capacity(capacity) {
+    size_t size = 16;
+    while (size < 2 * capacity) {
+      size <<= 1;
+    }
+    m_slots.resize(size);
+    m_mask = size - 1;
+  }
+
+  size_t size() const { return m_size; }
+
+  size_t capacity() const { return m_capacity; }
+
+  uint32_t find(uint64_t fingerprint) const {
+    for (size_t i = mix(fingerprint) & m_mask;; i = (i + 1) & m_mask) {
+      const slot& s = m_slots[i];
+      if (s.generation != m_generation) {
+        return npos;
+      }
+      if (s.fingerprint == fingerprint) {
+        return s.position;
+      }
+    }
+  }
+
+  // Adds a fingerprint that is not in the index yet; false if the index is full.
+  bool insert(uint64_t fingerprint, uint32_t position) {
+    if (m_size >= m_capacity) {
+      return false;
+    }
+    size_t i = mix(fingerprint) & m_mask;
+    while (m_slots[i].generation == m_generation) {
+      i = (i + 1) & m_mask;
+    }
+    m_slots[i] = slot{fingerprint, position, m_generation};
+    ++m_size;
+    return true;
+  }
+
+  void clear() {
+    m_size = 0;
+    if (++m_generation == 0) {
+      // after a wrap around, slots written 2^32 generations ago would look current
+      for (auto& s : m_slots) {
+        s.generation = 0;
+      }
+      m_generation = 1;
+    }
+  }
+
+ private:
+  struct slot {
+    uint64_t fingerprint = 0;
+    uint32_t position = 0;
+    uint32_t generation = 0;
+  };
+
+  // fingerprints may be hashes already, but their low bits pick the slot
+  static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
+  }
+
+  std::vector<slot> m_slots;
+  size_t m_mask = 0;
+  size_t m_size = 0;
+  const size_t m_capacity;
+  uint32_t m_generation = 1;
+};
+
+}  // namespace eosio
+
+#endif
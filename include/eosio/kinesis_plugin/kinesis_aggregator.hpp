@@ -0,0 +1,200 @@
+#ifndef KINESIS_AGGREGATOR_HPP
+#define KINESIS_AGGREGATOR_HPP
+
+#include <aws/core/utils/HashingUtils.h>
+#include <aws/core/utils/memory/stl/AWSString.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+
+namespace eosio {
+
+// Packs many user records into one Kinesis record using the KPL aggregated
+// record format, so that standard KCL consumers can de-aggregate them:
+//
+//   magic (f3 89 9a c2) | protobuf AggregatedRecord | md5(AggregatedRecord)
+//
+//   message AggregatedRecord {
+//     repeated string partition_key_table     = 1;
+//     repeated string explicit_hash_key_table = 2;
+//     repeated Record records                 = 3;
+//   }
+//   message Record {
+//     required uint64 partition_key_index     = 1;
+//     optional uint64 explicit_hash_key_index = 2;
+//     required bytes  data                    = 3;
+//   }
+//
+// The protobuf body is encoded by hand; repeated fields may be interleaved on
+// the wire, so the key tables and the records are kept in separate buffers and
+// concatenated when the record is built.
+//
+// KCL drops sub-records whose hash key (explicit, or the MD5 of the partition
+// key) falls outside the shard the aggregated record was read from, so all user
+// records of an aggregate must map to the same shard; the caller makes sure of it.
+class kinesis_aggregator {
+ public:
+  static constexpr size_t kMAGIC_SIZE = 4;
+  static constexpr size_t kDIGEST_SIZE = 16;
+
+  explicit kinesis_aggregator(size_t max_bytes) : m_maxBytes(max_bytes) {}
+
+  bool empty() const { return m_count == 0; }
+  size_t count() const { return m_count; }
+
+  // The aggregated record is routed with the partition key (and explicit hash key) of its first user record.
+  const std::string& partition_key() const { return m_partitionKey; }
+  const std::string& explicit_hash_key() const { return m_explicitHashKey; }
+
+  // Size of the aggregated record (plus its partition key) if this user record was added.
+  size_t size_with(const std::string& partition_key, const std::string& explicit_hash_key, size_t length) const {
+    size_t keys_bytes = m_keysBuffer.size() + m_hashKeysBuffer.size();
+    const uint64_t key_index = index_of(m_keys, partition_key, keys_bytes);
+    uint64_t hash_key_index = kNO_INDEX;
+    if (!explicit_hash_key.empty()) {
+      hash_key_index = index_of(m_hashKeys, explicit_hash_key, keys_bytes);
+    }
+    const size_t records_bytes = m_recordsBuffer.size() + record_size(key_index, hash_key_index, length);
+    const std::string& routing_key = empty() ? partition_key : m_partitionKey;
+    return kMAGIC_SIZE + keys_bytes + records_bytes + kDIGEST_SIZE + routing_key.size();
+  }
+
+  bool fits(const std::string& partition_key, const std::string& explicit_hash_key, size_t length) const {
+    return size_with(partition_key, explicit_hash_key, length) <= m_maxBytes;
+  }
+
+  // explicit_hash_key may be empty, the user record is then placed by its partition key.
+  void add(const std::string& partition_key, const std::string& explicit_hash_key, const unsigned char *data,
+           size_t length) {
+    if (empty()) {
+      m_partitionKey = partition_key;
+      m_explicitHashKey = explicit_hash_key;
+    }
+
+    const uint64_t key_index = insert(m_keys, m_keysBuffer, 1, partition_key);
+    uint64_t hash_key_index = kNO_INDEX;
+    if (!explicit_hash_key.empty()) {
+      hash_key_index = insert(m_hashKeys, m_hashKeysBuffer, 2, explicit_hash_key);
+    }
+
+    put_tag(m_recordsBuffer, 3, kLENGTH_DELIMITED);
+    put_varint(m_recordsBuffer, record_body_size(key_index, hash_key_index, length));
+    put_tag(m_recordsBuffer, 1, kVARINT);
+    put_varint(m_recordsBuffer, key_index);
+    if (hash_key_index != kNO_INDEX) {
+      put_tag(m_recordsBuffer, 2, kVARINT);
+      put_varint(m_recordsBuffer, hash_key_index);
+    }
+    put_tag(m_recordsBuffer, 3, kLENGTH_DELIMITED);
+    put_bytes(m_recordsBuffer, data, length);
+    ++m_count;
+  }
+
+  // Serializes the aggregated record and resets the aggregator.
+  Aws::Utils::ByteBuffer build() {
+    Aws::String body;
+    body.reserve(m_keysBuffer.size() + m_hashKeysBuffer.size() + m_recordsBuffer.size());
+    body.append(m_keysBuffer).append(m_hashKeysBuffer).append(m_recordsBuffer);
+    Aws::Utils::ByteBuffer digest = Aws::Utils::HashingUtils::CalculateMD5(body);
+
+    Aws::Utils::ByteBuffer record(kMAGIC_SIZE + body.size() + digest.GetLength());
+    unsigned char *out = record.GetUnderlyingData();
+    const unsigned char magic[kMAGIC_SIZE] = {0xf3, 0x89, 0x9a, 0xc2};
+    std::copy(magic, magic + kMAGIC_SIZE, out);
+    std::copy(body.begin(), body.end(), out + kMAGIC_SIZE);
+    std::copy(digest.GetUnderlyingData(), digest.GetUnderlyingData() + digest.GetLength(),
+              out + kMAGIC_SIZE + body.size());
+
+    reset();
+    return record;
+  }
+
+  void reset() {
+    m_keys.clear();
+    m_keysBuffer.clear();
+    m_hashKeys.clear();
+    m_hashKeysBuffer.clear();
+    m_recordsBuffer.clear();
+    m_partitionKey.clear();
+    m_explicitHashKey.clear();
+    m_count = 0;
+  }
+
+ private:
+  enum wire_type { kVARINT = 0, kLENGTH_DELIMITED = 2 };
+  static constexpr uint64_t kNO_INDEX = ~uint64_t(0);
+  using key_table = std::unordered_map<std::string, uint64_t>;
+
+  // Index of key in table, or the index it would get, adding its table entry to bytes.
+  static uint64_t index_of(const key_table& table, const std::string& key, size_t& bytes) {
+    auto itr = table.find(key);
+    if (itr != table.end()) {
+      return itr->second;
+    }
+    bytes += 1 + varint_size(key.size()) + key.size();
+    return table.size();
+  }
+
+  static uint64_t insert(key_table& table, Aws::String& buffer, uint32_t field, const std::string& key) {
+    auto itr = table.find(key);
+    if (itr != table.end()) {
+      return itr->second;
+    }
+    const uint64_t index = table.size();
+    table.emplace(key, index);
+    put_tag(buffer, field, kLENGTH_DELIMITED);
+    put_bytes(buffer, reinterpret_cast<const unsigned char *>(key.data()), key.size());
+    return index;
+  }
+
+  static size_t varint_size(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+      value >>= 7;
+      ++size;
+    }
+    return size;
+  }
+
+  static size_t record_body_size(uint64_t key_index, uint64_t hash_key_index, size_t length) {
+    const size_t hash_key_bytes = hash_key_index == kNO_INDEX ? 0 : 1 + varint_size(hash_key_index);
+    return 1 + varint_size(key_index) + hash_key_bytes + 1 + varint_size(length) + length;
+  }
+
+  static size_t record_size(uint64_t key_index, uint64_t hash_key_index, size_t length) {
+    const size_t body = record_body_size(key_index, hash_key_index, length);
+    return 1 + varint_size(body) + body;
+  }
+
+  static void put_varint(Aws::String& out, uint64_t value) {
+    while (value >= 0x80) {
+      out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+      value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+  }
+
+  static void put_tag(Aws::String& out, uint32_t field, wire_type type) {
+    put_varint(out, (field << 3) | type);
+  }
+
+  static void put_bytes(Aws::String& out, const unsigned char *data, size_t length) {
+    put_varint(out, length);
+    out.append(reinterpret_cast<const char *>(data), length);
+  }
+
+  size_t m_maxBytes;
+  size_t m_count = 0;
+  std::string m_partitionKey;
+  std::string m_explicitHashKey;
+  key_table m_keys;
+  Aws::String m_keysBuffer;
+  key_table m_hashKeys;
+  Aws::String m_hashKeysBuffer;
+  Aws::String m_recordsBuffer;
+};
+
+}  // namespace eosio
+
+#endif
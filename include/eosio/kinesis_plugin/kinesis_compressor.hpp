@@ -0,0 +1,183 @@
+#ifndef KINESIS_COMPRESSOR_HPP
+#define KINESIS_COMPRESSOR_HPP
+
+#include <aws/core/Aws.h>
+
+#ifdef KINESIS_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef KINESIS_WITH_LZ4
+#include <lz4.h>
+#endif
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace eosio {
+
+// First byte of every record when compression is configured.
+enum class compression_codec : uint8_t {
+  none = 0,
+  zstd = 1,  // followed by a zstd frame (content size and dictionary id in the frame header)
+  lz4 = 2    // followed by the uncompressed size (uint32 little endian) and an lz4 block
+};
+
+// Compresses Kinesis record payloads and prefixes them with the codec byte.
+// Not thread safe; the producer only calls it from the thread feeding it.
+class kinesis_compressor {
+ public:
+  // Worst case number of bytes compress() adds in front of the payload.
+  static constexpr size_t kMAX_HEADER_SIZE = 1 + sizeof(uint32_t);
+
+  static bool supported(compression_codec codec) {
+    switch (codec) {
+      case compression_codec::none:
+        return true;
+      case compression_codec::zstd:
+#ifdef KINESIS_WITH_ZSTD
+        return true;
+#else
+        return false;
+#endif
+      case compression_codec::lz4:
+#ifdef KINESIS_WITH_LZ4
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+  }
+
+  // For zstd, level is the compression level; for lz4 it is the acceleration factor.
+  // dictionary_path optionally names a dictionary trained with `zstd --train`, or any
+  // sample data for lz4 (only its last 64 KiB are used).
+  kinesis_compressor(compression_codec codec, int level, const std::string& dictionary_path)
+      : m_codec(codec), m_level(level) {
+    if (!supported(codec)) {
+      throw std::runtime_error("kinesis_plugin was built without support for the requested compression codec");
+    }
+    if (!dictionary_path.empty()) {
+      std::ifstream in(dictionary_path, std::ios::binary);
+      if (!in) {
+        throw std::runtime_error("unable to read compression dictionary " + dictionary_path);
+      }
+      m_dictionary.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+#ifdef KINESIS_WITH_ZSTD
+    if (codec == compression_codec::zstd) {
+      m_zstd = ZSTD_createCCtx();
+      if (!m_dictionary.empty()) {
+        m_zstdDict = ZSTD_createCDict(m_dictionary.data(), m_dictionary.size(), m_level);
+        if (m_zstdDict == nullptr) {
+          throw std::runtime_error("invalid zstd dictionary " + dictionary_path);
+        }
+      }
+    }
+#endif
+#ifdef KINESIS_WITH_LZ4
+    if (codec == compression_codec::lz4 && m_dictionary.size() > 64 * 1024) {
+      m_dictionary.erase(m_dictionary.begin(), m_dictionary.end() - 64 * 1024);
+    }
+#endif
+  }
+
+  kinesis_compressor(const kinesis_compressor&) = delete;
+  kinesis_compressor& operator=(const kinesis_compressor&) = delete;
+
+  ~kinesis_compressor() {
+#ifdef KINESIS_WITH_ZSTD
+    ZSTD_freeCDict(m_zstdDict);
+    ZSTD_freeCCtx(m_zstd);
+#endif
+  }
+
+  compression_codec codec() const { return m_codec; }
+
+  Aws::Utils::ByteBuffer compress(const unsigned char *data, size_t length) {
+    size_t size = 0;
+    switch (m_codec) {
+      case compression_codec::none:
+        break;
+      case compression_codec::zstd:
+        size = compress_zstd(data, length);
+        break;
+      case compression_codec::lz4:
+        size = compress_lz4(data, length);
+        break;
+    }
+    if (size == 0) {
+      // Not compressible or codec failure, send the payload as is.
+      Aws::Utils::ByteBuffer out(1 + length);
+      out[0] = static_cast<unsigned char>(compression_codec::none);
+      std::copy(data, data + length, out.GetUnderlyingData() + 1);
+      return out;
+    }
+    return Aws::Utils::ByteBuffer(m_scratch.data(), size);
+  }
+
+ private:
+  // Each returns the size of the header plus compressed payload in m_scratch, or 0.
+  size_t compress_zstd(const unsigned char *data, size_t length) {
+#ifdef KINESIS_WITH_ZSTD
+    m_scratch.resize(1 + ZSTD_compressBound(length));
+    m_scratch[0] = static_cast<unsigned char>(compression_codec::zstd);
+    const size_t size = m_zstdDict != nullptr
+        ? ZSTD_compress_usingCDict(m_zstd, m_scratch.data() + 1, m_scratch.size() - 1, data, length, m_zstdDict)
+        : ZSTD_compressCCtx(m_zstd, m_scratch.data() + 1, m_scratch.size() - 1, data, length, m_level);
+    if (ZSTD_isError(size) || size >= length) {
+      return 0;
+    }
+    return 1 + size;
+#else
+    return 0;
+#endif
+  }
+
+  size_t compress_lz4(const unsigned char *data, size_t length) {
+#ifdef KINESIS_WITH_LZ4
+    const int bound = LZ4_compressBound(static_cast<int>(length));
+    m_scratch.resize(kMAX_HEADER_SIZE + bound);
+    m_scratch[0] = static_cast<unsigned char>(compression_codec::lz4);
+    for (size_t i = 0; i < sizeof(uint32_t); ++i) {
+      m_scratch[1 + i] = static_cast<unsigned char>(length >> (8 * i));
+    }
+    char *dst = reinterpret_cast<char *>(m_scratch.data() + kMAX_HEADER_SIZE);
+    const char *src = reinterpret_cast<const char *>(data);
+    const int acceleration = std::max(1, m_level);
+    int size;
+    if (!m_dictionary.empty()) {
+      LZ4_stream_t stream;
+      LZ4_initStream(&stream, sizeof(stream));
+      LZ4_loadDict(&stream, m_dictionary.data(), static_cast<int>(m_dictionary.size()));
+      size = LZ4_compress_fast_continue(&stream, src, dst, static_cast<int>(length), bound, acceleration);
+    } else {
+      size = LZ4_compress_fast(src, dst, static_cast<int>(length), bound, acceleration);
+    }
+    if (size <= 0 || static_cast<size_t>(size) >= length) {
+      return 0;
+    }
+    return kMAX_HEADER_SIZE + size;
+#else
+    return 0;
+#endif
+  }
+
+  compression_codec m_codec;
+  int m_level;
+  std::vector<char> m_dictionary;
+  std::vector<unsigned char> m_scratch;
+#ifdef KINESIS_WITH_ZSTD
+  ZSTD_CCtx *m_zstd = nullptr;
+  ZSTD_CDict *m_zstdDict = nullptr;
+#endif
+};
+
+}  // namespace eosio
+
+#endif
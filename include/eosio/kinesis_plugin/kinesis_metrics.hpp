@@ -0,0 +1,191 @@
+#ifndef KINESIS_METRICS_HPP
+#define KINESIS_METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <sstream>
+#include <string>
+
+namespace eosio {
+
+// Monotonic counter, safe to bump from any thread.
+class metrics_counter {
+ public:
+  void add(uint64_t n = 1) { m_value.fetch_add(n, std::memory_order_relaxed); }
+  uint64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> m_value{0};
+};
+
+// Lock free latency histogram in microseconds. Buckets are log-linear, HDR style: every
+// power of two is split into 8 buckets, so quantiles are accurate to about 12%.
+class latency_histogram {
+ public:
+  static constexpr size_t kSUB_BITS = 3;
+  static constexpr size_t kSUB_BUCKETS = size_t(1) << kSUB_BITS;
+  static constexpr size_t kBUCKETS = (64 - kSUB_BITS + 1) * kSUB_BUCKETS;
+
+  void record(uint64_t micros) {
+    m_counts[index(micros)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(micros, std::memory_order_relaxed);
+  }
+
+  template<typename Rep, typename Period>
+  void record(std::chrono::duration<Rep, Period> d) {
+    const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    record(micros > 0 ? static_cast<uint64_t>(micros) : 0);
+  }
+
+  uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+  uint64_t sum() const { return m_sum.load(std::memory_order_relaxed); }
+
+  // Upper bound of the bucket holding quantile q (0..1), 0 when empty.
+  uint64_t quantile(double q) const {
+    const uint64_t total = count();
+    if (total == 0) {
+      return 0;
+    }
+    const uint64_t rank = static_cast<uint64_t>(q * (total - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBUCKETS; ++i) {
+      seen += m_counts[i].load(std::memory_order_relaxed);
+      if (seen >= rank) {
+        return upper_bound(i);
+      }
+    }
+    return upper_bound(kBUCKETS - 1);
+  }
+
+  // Prometheus histogram with a bucket per power of two up to 2^39 us, in seconds. The
+  // same buckets are written every time, and the counts are read once so they add up.
+  void write_prometheus(std::ostream& os, const std::string& name, const std::string& help) const {
+    os << "# HELP " << name << ' ' << help << "\n# TYPE " << name << " histogram\n";
+    uint64_t cumulative = 0;
+    size_t i = 0;
+    for (size_t bit = 0; bit < 40; ++bit) {
+      // every value below 2^bit lives in a bucket below index(2^bit)
+      const size_t end = index(uint64_t(1) << bit);
+      for (; i < end; ++i) {
+        cumulative += m_counts[i].load(std::memory_order_relaxed);
+      }
+      char le[32];
+      std::snprintf(le, sizeof(le), "%.9g", ((uint64_t(1) << bit) - 1) / 1e6);
+      os << name << "_bucket{le=\"" << le << "\"} " << cumulative << '\n';
+    }
+    for (; i < kBUCKETS; ++i) {
+      cumulative += m_counts[i].load(std::memory_order_relaxed);
+    }
+    const uint64_t total = cumulative;
+    os << name << "_bucket{le=\"+Inf\"} " << total << '\n';
+    os << name << "_sum " << sum() / 1e6 << '\n';
+    os << name << "_count " << total << '\n';
+  }
+
+ private:
+  static size_t index(uint64_t v) {
+    if (v < kSUB_BUCKETS) {
+      return static_cast<size_t>(v);
+    }
+    const size_t exponent = 63 - __builtin_clzll(v);
+    const size_t shift = exponent - kSUB_BITS;
+    return (shift + 1) * kSUB_BUCKETS + static_cast<size_t>((v >> shift) & (kSUB_BUCKETS - 1));
+  }
+
+  static uint64_t upper_bound(size_t i) {
+    if (i < kSUB_BUCKETS) {
+      return i;
+    }
+    const size_t shift = i / kSUB_BUCKETS - 1;
+    const uint64_t lower = (kSUB_BUCKETS + i % kSUB_BUCKETS) << shift;
+    return lower + ((uint64_t(1) << shift) - 1);
+  }
+
+  std::array<std::atomic<uint64_t>, kBUCKETS> m_counts{};
+  std::atomic<uint64_t> m_count{0};
+  std::atomic<uint64_t> m_sum{0};
+};
+
+// Pipeline instrumentation shared by the plugin and the producer.
+struct kinesis_metrics {
+  latency_histogram signal_to_enqueue;  // chain thread, applied_transaction signal until queued
+  latency_histogram queue_wait;         // queued until picked up by the kinesis thread
+  latency_histogram serialization;      // serializing one trace
+  latency_histogram batch_build;        // first record of a batch until the batch is sent
+  latency_histogram put_records;        // PutRecords round trip
+  latency_histogram block_lag;          // block time until the record is handed to the producer
+
+  metrics_counter traces_filtered;
+  metrics_counter traces_superseded;
+  metrics_counter records_sent;
+  metrics_counter records_failed;
+  metrics_counter bytes_sent;
+  metrics_counter put_records_calls;
+  metrics_counter put_records_errors;
+  metrics_counter throttles;
+  metrics_counter retries;
+  metrics_counter backfilled_blocks;
+  metrics_counter action_batches;
+  metrics_counter route_dropped;
+
+  void write_prometheus(std::ostream& os) const {
+    signal_to_enqueue.write_prometheus(os, "kinesis_signal_to_enqueue_seconds",
+                                       "Time spent queueing a trace on the chain thread.");
+    queue_wait.write_prometheus(os, "kinesis_queue_wait_seconds", "Time a trace waits in its queue.");
+    serialization.write_prometheus(os, "kinesis_serialization_seconds", "Time spent serializing a trace.");
+    batch_build.write_prometheus(os, "kinesis_batch_build_seconds",
+                                 "Time from the first record of a batch until it is sent.");
+    put_records.write_prometheus(os, "kinesis_put_records_seconds", "PutRecords round trip time.");
+    block_lag.write_prometheus(os, "kinesis_block_lag_seconds",
+                               "Time from block time until a record is handed to the producer.");
+    write_counter(os, "kinesis_traces_filtered_total", "Traces skipped by the action filter.", traces_filtered);
+    write_counter(os, "kinesis_traces_superseded_total",
+                  "Speculative traces dropped because the transaction was applied again.", traces_superseded);
+    write_counter(os, "kinesis_records_sent_total", "Records acknowledged by Kinesis.", records_sent);
+    write_counter(os, "kinesis_records_failed_total", "Records rejected by Kinesis.", records_failed);
+    write_counter(os, "kinesis_bytes_sent_total", "Bytes sent with PutRecords.", bytes_sent);
+    write_counter(os, "kinesis_put_records_calls_total", "PutRecords calls.", put_records_calls);
+    write_counter(os, "kinesis_put_records_errors_total", "PutRecords calls that failed as a whole.",
+                  put_records_errors);
+    write_counter(os, "kinesis_throttles_total", "Records rejected for exceeding shard throughput.", throttles);
+    write_counter(os, "kinesis_retries_total", "Records sent again after a failure.", retries);
+    write_counter(os, "kinesis_backfilled_blocks_total", "Blocks read from blocks.log by the backfill.",
+                  backfilled_blocks);
+    write_counter(os, "kinesis_action_batches_total", "Columnar action batches written.", action_batches);
+    write_counter(os, "kinesis_route_dropped_total",
+                  "Routed records dropped because the route was over its memory share or its queue was full.",
+                  route_dropped);
+  }
+
+  std::string summary() const {
+    std::ostringstream os;
+    os << "sent " << records_sent.value() << " failed " << records_failed.value() << " throttled "
+       << throttles.value() << " retried " << retries.value() << " filtered " << traces_filtered.value()
+       << " superseded " << traces_superseded.value()
+       << "; p50/p99 us: enqueue " << signal_to_enqueue.quantile(0.5) << '/' << signal_to_enqueue.quantile(0.99)
+       << " queue " << queue_wait.quantile(0.5) << '/' << queue_wait.quantile(0.99)
+       << " serialize " << serialization.quantile(0.5) << '/' << serialization.quantile(0.99)
+       << " batch " << batch_build.quantile(0.5) << '/' << batch_build.quantile(0.99)
+       << " put " << put_records.quantile(0.5) << '/' << put_records.quantile(0.99)
+       << " block lag " << block_lag.quantile(0.5) << '/' << block_lag.quantile(0.99);
+    return os.str();
+  }
+
+  static void write_counter(std::ostream& os, const std::string& name, const std::string& help,
+                            const metrics_counter& c) {
+    os << "# HELP " << name << ' ' << help << "\n# TYPE " << name << " counter\n" << name << ' ' << c.value()
+       << '\n';
+  }
+
+  static void write_gauge(std::ostream& os, const std::string& name, const std::string& help, double value) {
+    os << "# HELP " << name << ' ' << help << "\n# TYPE " << name << " gauge\n" << name << ' ' << value << '\n';
+  }
+};
+
+}  // namespace eosio
+
+#endif
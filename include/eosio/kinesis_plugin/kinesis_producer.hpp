@@ -2,58 +2,787 @@
 #define KINESIS_PRODUCER_HPP
 
 #include <aws/core/Aws.h>
-#include <aws/core/utils/HashingUtils.h>
-#include <aws/kinesis/KinesisClient.h>
-#include <aws/kinesis/model/PutRecordRequest.h>
-#include <aws/kinesis/model/PutRecordRequest.h>
+#include <aws/core/http/Scheme.h>
 #include <aws/core/utils/Outcome.h>
+#include <aws/core/utils/threading/Executor.h>
+#include <aws/kinesis/KinesisClient.h>
+#include <aws/kinesis/model/PutRecordsRequest.h>
+#include <aws/kinesis/model/PutRecordsRequestEntry.h>
+
+#include <eosio/kinesis_plugin/kinesis_aggregator.hpp>
+#include <eosio/kinesis_plugin/kinesis_compressor.hpp>
+#include <eosio/kinesis_plugin/kinesis_metrics.hpp>
+#include <eosio/kinesis_plugin/kinesis_rate_limiter.hpp>
+#include <eosio/kinesis_plugin/kinesis_shard_map.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
 #include <string>
+#include <unordered_set>
+#include <vector>
 
 namespace eosio {
-const char *kSTREAM_NAME = "EOS_Asia_Kinesis";
-const char *kREGION_NAME = "ap-northeast-1";
+const char *const kSTREAM_NAME = "EOS_Asia_Kinesis";
+const char *const kREGION_NAME = "ap-northeast-1";
+
+// PutRecords service limits.
+const size_t kMAX_RECORDS_PER_REQUEST = 500;
+const size_t kMAX_BYTES_PER_REQUEST = 5 * 1024 * 1024;
+const size_t kMAX_BYTES_PER_RECORD = 1024 * 1024;
+
+// Outcome of a single user record, reported through the completion callback.
+struct kinesis_ack {
+  uint64_t tag;
+  bool ok;
+  Aws::String sequence_number;
+  Aws::String error_code;
+  // failed with an error worth retrying later, after the producer's own retries ran out
+  bool retriable = false;
+};
 
 class kinesis_producer {
  public:
+  // Invoked on an SDK executor thread with the final outcome of the records of a
+  // PutRecords call, i.e. without the records that will be retried. Calls for the
+  // same lane are serialized, calls for different lanes may run concurrently.
+  using completion_callback = std::function<void(const std::vector<kinesis_ack>&)>;
+
   kinesis_producer() {}
 
+  // All kinesis_set_* calls must happen before kinesis_init().
   int kinesis_init(const std::string& stream_name, const std::string& region_name) {
     // m_options.loggingOptions.logLevel = Aws::Utils::Logging::LogLevel::Info; // Turn on log.
-    Aws::InitAPI(m_options);
+    init_api(m_options);
 
     Aws::Client::ClientConfiguration clientConfig;
     // set your region
-    clientConfig.region = Aws::Utils::HashingUtils::HashString(region_name);
-    m_regionName = stream_name;
+    clientConfig.region = region_name.c_str();
+    if (!m_endpoint.empty()) {
+      std::string endpoint = m_endpoint;
+      if (endpoint.compare(0, 7, "http://") == 0) {
+        clientConfig.scheme = Aws::Http::Scheme::HTTP;
+        endpoint.erase(0, 7);
+      } else if (endpoint.compare(0, 8, "https://") == 0) {
+        endpoint.erase(0, 8);
+      }
+      clientConfig.endpointOverride = endpoint.c_str();
+    }
+    clientConfig.maxConnections = m_maxInFlight + 1;
+    // One extra thread for shard map refreshes.
+    m_executor = Aws::MakeShared<Aws::Utils::Threading::PooledThreadExecutor>("kinesis_producer", m_maxInFlight + 1);
+    clientConfig.executor = m_executor;
+    m_streamName = stream_name.c_str();
     m_client = new Aws::Kinesis::KinesisClient(clientConfig);
+
+    if (!m_shardSource && m_shardRefresh.count() > 0) {
+      m_shardSource = std::make_shared<kinesis_shard_source>(m_client, m_streamName);
+    }
+    if (m_shardSource) {
+      m_shardMap.refresh(*m_shardSource);
+      m_lastShardRefresh = std::chrono::steady_clock::now();
+    }
+
+    // Leave room for the compression header in front of aggregated records.
+    const size_t aggregate_max_bytes = m_compressor ? m_aggregateMaxBytes - kinesis_compressor::kMAX_HEADER_SIZE
+                                                    : m_aggregateMaxBytes;
+    m_lanes.clear();
+    for (size_t i = 0; i < m_maxInFlight; ++i) {
+      m_lanes.emplace_back(new lane(aggregate_max_bytes, m_maxRecords));
+    }
     return 0;
   }
 
-  int kinesis_sendmsg(int trxtype, unsigned char *msgstr, size_t length) {
-    // trxtype => to different stream.
-    Aws::Kinesis::Model::PutRecordRequest request;
-    request.SetStreamName(m_streamName);
-    Aws::Utils::ByteBuffer data(msgstr, length);
-    request.SetData(data);
+  // Talks to endpoint ("host:port", optionally prefixed with http:// or https://)
+  // instead of the region's Kinesis endpoint, e.g. a local stand-in or localstack.
+  void kinesis_set_endpoint(const std::string& endpoint) {
+    m_endpoint = endpoint;
+  }
 
-    auto result = m_client->PutRecord(request);
-    if (!result.IsSuccess()) {
-      return 1;
+  // Records are buffered and sent with PutRecords once max_records or
+  // max_bytes is reached, or once the oldest buffered record is linger_ms old.
+  void kinesis_set_batch_limits(size_t max_records, size_t max_bytes, uint32_t linger_ms) {
+    m_maxRecords = std::max<size_t>(1, std::min(max_records, kMAX_RECORDS_PER_REQUEST));
+    m_maxBytes = std::max(kMAX_BYTES_PER_RECORD, std::min(max_bytes, kMAX_BYTES_PER_REQUEST));
+    m_linger = std::chrono::milliseconds(linger_ms);
+  }
+
+  std::chrono::milliseconds kinesis_linger() const {
+    return m_linger;
+  }
+
+  // When enabled, user records are packed into KPL aggregated records of at most max_bytes.
+  // Only records of the same shard share an aggregated record, so aggregation needs the
+  // shard map; records are sent one by one while there is none.
+  void kinesis_set_aggregation(bool enabled, size_t max_bytes) {
+    m_aggregate = enabled;
+    m_aggregateMaxBytes = std::min(max_bytes, kMAX_BYTES_PER_RECORD);
+  }
+
+  // Compresses every record, or every aggregated record, and prefixes it with a
+  // codec byte. Throws std::runtime_error if the codec is unavailable.
+  void kinesis_set_compression(compression_codec codec, int level, const std::string& dictionary_path) {
+    if (codec == compression_codec::none) {
+      m_compressor.reset();
+    } else {
+      m_compressor.reset(new kinesis_compressor(codec, level, dictionary_path));
+    }
+  }
+
+  // Refreshes the stream's shard map every refresh_seconds (0 disables it). With a
+  // shard map, lanes are assigned per shard instead of per partition key hash.
+  void kinesis_set_shard_refresh(uint32_t refresh_seconds) {
+    m_shardRefresh = std::chrono::seconds(refresh_seconds);
+  }
+
+  // Replaces ListShards as the source of the shard map, e.g. with a mock_shard_source.
+  void kinesis_set_shard_source(std::shared_ptr<shard_map_source> source) {
+    m_shardSource = std::move(source);
+  }
+
+  // When enabled, records are spread evenly over the open shards by hashing their
+  // partition key onto a shard and targeting it with an explicit hash key.
+  void kinesis_set_explicit_hash_spread(bool enabled) {
+    m_spreadExplicitHash = enabled;
+  }
+
+  // Partition keys are hashed onto max_in_flight lanes. Each lane has at most
+  // one PutRecords call in flight, which keeps records of a partition key in order;
+  // a retried entry is resent together with the later entries of its partition key.
+  void kinesis_set_max_in_flight(size_t max_in_flight) {
+    m_maxInFlight = std::max<size_t>(1, max_in_flight);
+  }
+
+  void kinesis_set_completion_callback(completion_callback callback) {
+    m_callback = std::move(callback);
+  }
+
+  // Entries rejected with a retriable error (throttling, internal failure) are resent
+  // up to max_retries times, ahead of the lane's newer records, after a backoff drawn
+  // uniformly from [0, min(max_backoff, base_backoff * 2^retry)). Entries of the same
+  // call that follow a resent entry with the same partition key are resent after it
+  // even if they were written, so a key's records arrive in order (possibly twice).
+  void kinesis_set_retry(uint32_t max_retries, uint32_t base_backoff_ms, uint32_t max_backoff_ms) {
+    m_maxRetries = max_retries;
+    m_baseBackoff = std::chrono::milliseconds(std::max<uint32_t>(1, base_backoff_ms));
+    m_maxBackoff = std::chrono::milliseconds(std::max(base_backoff_ms, max_backoff_ms));
+  }
+
+  // Limits the records of each shard to its write limits, adapting the shard's rate to
+  // throttling. Needs the shard map; records are not limited without it.
+  void kinesis_set_shard_rate_limit(bool enabled) {
+    m_rateLimit = enabled;
+  }
+
+  // Optional; batch and PutRecords latencies and outcomes are recorded into it.
+  void kinesis_set_metrics(std::shared_ptr<kinesis_metrics> metrics) {
+    m_metrics = std::move(metrics);
+  }
+
+  int kinesis_sendmsg(int trxtype, const std::string& partition_key, unsigned char *msgstr, size_t length,
+                      uint64_t tag = 0) {
+    return send(partition_key, msgstr, length, nullptr, tag);
+  }
+
+  // Takes ownership of data; unless it gets aggregated or compressed, data becomes
+  // the record as is and is released by the SDK once its PutRecords call completes.
+  int kinesis_sendmsg(int trxtype, const std::string& partition_key, Aws::Utils::ByteBuffer&& data,
+                      uint64_t tag = 0) {
+    return send(partition_key, data.GetUnderlyingData(), data.GetLength(), &data, tag);
+  }
+
+  // Index of the lane records of partition_key are sent on, and the explicit hash key they
+  // are sent with (empty if none). Must be called on the thread that sends records.
+  size_t kinesis_lane(const std::string& partition_key, std::string& explicit_hash_key) {
+    size_t shard;
+    const lane& l = lane_for(partition_key, explicit_hash_key, shard);
+    for (size_t i = 0; i < m_lanes.size(); ++i) {
+      if (m_lanes[i].get() == &l) {
+        return i;
+      }
+    }
+    return m_lanes.size();
+  }
+
+  // Sends the lanes that have been lingering for too long, without waiting for busy lanes.
+  void kinesis_poll() {
+    maybe_refresh_shards();
+    for (auto& l : m_lanes) {
+      poll_lane(*l);
+    }
+  }
+
+  // Sends everything that is buffered, waiting for busy lanes if needed.
+  void kinesis_flush() {
+    for (auto& l : m_lanes) {
+      flush_aggregator(*l);
+      dispatch(*l, true);
     }
-    return 0;
   }
 
   int kinesis_destory() {
+    while (true) {
+      kinesis_flush();
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cv.wait(lock, [this] { return m_inFlight == 0; });
+      // calls that completed during the flush may have left entries to retry
+      if (std::none_of(m_lanes.begin(), m_lanes.end(), [](const std::unique_ptr<lane>& l) { return l->has_retry(); })) {
+        break;
+      }
+    }
     delete m_client;
-    Aws::ShutdownAPI(m_options);
+    m_client = nullptr;
+    shutdown_api(m_options);
     return 0;
   }
-  
+
  private:
+  // The SDK is process wide: the first producer initializes it, the last one shuts it down.
+  static std::mutex& api_mutex() {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  static size_t& api_users() {
+    static size_t users = 0;
+    return users;
+  }
+
+  static void init_api(const Aws::SDKOptions& options) {
+    std::lock_guard<std::mutex> lock(api_mutex());
+    if (api_users()++ == 0) {
+      Aws::InitAPI(options);
+    }
+  }
+
+  static void shutdown_api(const Aws::SDKOptions& options) {
+    std::lock_guard<std::mutex> lock(api_mutex());
+    if (--api_users() == 0) {
+      Aws::ShutdownAPI(options);
+    }
+  }
+
+  struct lane {
+    lane(size_t aggregate_max_bytes, size_t max_records) : aggregator(aggregate_max_bytes) {
+      batch.reserve(max_records);
+    }
+
+    bool empty() const { return batch.empty() && aggregator.empty(); }
+
+    Aws::Vector<Aws::Kinesis::Model::PutRecordsRequestEntry> batch;
+    // Tags of all user records in the batch; entry i owns tags [tag_ends[i-1], tag_ends[i]).
+    std::vector<uint64_t> tags;
+    std::vector<uint32_t> tag_ends;
+    // shard of each entry, kNO_SHARD if unknown
+    std::vector<size_t> shards;
+    size_t batch_bytes = 0;
+    std::chrono::steady_clock::time_point start;
+
+    kinesis_aggregator aggregator;
+    std::vector<uint64_t> aggregator_tags;
+    // index of the shard the aggregated records map to, in the current snapshot
+    size_t aggregator_shard = 0;
+
+    bool has_retry() const { return retry_pending.load(std::memory_order_acquire); }
+
+    // Guarded by kinesis_producer::m_mutex.
+    bool in_flight = false;
+    // Entries to resend once retry_at has passed, ahead of anything in batch.
+    Aws::Vector<Aws::Kinesis::Model::PutRecordsRequestEntry> retry;
+    std::vector<uint64_t> retry_tags;
+    std::vector<uint32_t> retry_tag_ends;
+    std::vector<uint32_t> retry_attempts;
+    std::vector<size_t> retry_shards;
+    std::chrono::steady_clock::time_point retry_at;
+    std::atomic<bool> retry_pending{false};
+  };
+
+  struct batch_context {
+    lane *owner;
+    std::chrono::steady_clock::time_point sent;
+    std::vector<uint64_t> tags;
+    std::vector<uint32_t> tag_ends;
+    // Number of times each entry has been sent before.
+    std::vector<uint32_t> attempts;
+    std::vector<size_t> shards;
+  };
+
+  static constexpr size_t kNO_SHARD = ~size_t(0);
+
+  // shard is set to the record's shard, or kNO_SHARD without a shard map.
+  lane& lane_for(const std::string& partition_key, std::string& explicit_hash_key, size_t& shard) {
+    const uint64_t version = m_shardMap.version();
+    if (version != m_shardsVersion) {
+      // aggregated records were grouped by the old layout
+      for (auto& l : m_lanes) {
+        flush_aggregator(*l);
+      }
+      m_shards = m_shardMap.snapshot();
+      m_shardsVersion = version;
+      update_rate_limits();
+    }
+    if (!m_shards) {
+      shard = kNO_SHARD;
+      return *m_lanes[std::hash<std::string>()(partition_key) % m_lanes.size()];
+    }
+
+    if (m_spreadExplicitHash) {
+      shard = std::hash<std::string>()(partition_key) % m_shards->size();
+      explicit_hash_key = (*m_shards)[shard].target_key;
+    } else {
+      shard = shard_map::shard_for(*m_shards, partition_key_hash(partition_key));
+    }
+    return *m_lanes[shard % m_lanes.size()];
+  }
+
+  // owned, when set, holds msgstr and may be moved from.
+  int send(const std::string& partition_key, const unsigned char *msgstr, size_t length,
+           Aws::Utils::ByteBuffer *owned, uint64_t tag) {
+    // The per-record limit covers the data blob plus the partition key.
+    const size_t header_bytes = m_compressor ? kinesis_compressor::kMAX_HEADER_SIZE : 0;
+    if (header_bytes + length + partition_key.size() > kMAX_BYTES_PER_RECORD) {
+      return 1;
+    }
+
+    std::string explicit_hash_key;
+    size_t shard;
+    lane& l = lane_for(partition_key, explicit_hash_key, shard);
+    if (l.empty()) {
+      l.start = std::chrono::steady_clock::now();
+    }
+
+    if (m_aggregate && shard != kNO_SHARD) {
+      if (!l.aggregator.empty() &&
+          (l.aggregator_shard != shard || !l.aggregator.fits(partition_key, explicit_hash_key, length))) {
+        flush_aggregator(l);
+      }
+      if (l.aggregator.fits(partition_key, explicit_hash_key, length)) {
+        l.aggregator.add(partition_key, explicit_hash_key, msgstr, length);
+        l.aggregator_tags.push_back(tag);
+        l.aggregator_shard = shard;
+        poll_lane(l);
+        return 0;
+      }
+      // Too large to be aggregated at all, send it as a plain record.
+    }
+    Aws::Utils::ByteBuffer record;
+    if (m_compressor) {
+      record = m_compressor->compress(msgstr, length);
+    } else if (owned != nullptr) {
+      record = std::move(*owned);
+    } else {
+      record = Aws::Utils::ByteBuffer(msgstr, length);
+    }
+    add_record(l, shard, partition_key, explicit_hash_key, std::move(record), &tag, &tag + 1);
+    poll_lane(l);
+    return 0;
+  }
+
+  void maybe_refresh_shards() {
+    if (!m_shardSource || m_shardRefresh.count() == 0 ||
+        std::chrono::steady_clock::now() - m_lastShardRefresh < m_shardRefresh) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_refreshingShards) {
+        return;
+      }
+      m_refreshingShards = true;
+      ++m_inFlight;
+    }
+    m_lastShardRefresh = std::chrono::steady_clock::now();
+    m_executor->Submit([this] {
+      m_shardMap.refresh(*m_shardSource);
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_refreshingShards = false;
+        --m_inFlight;
+      }
+      m_cv.notify_all();
+    });
+  }
+
+  void poll_lane(lane& l) {
+    if (!l.empty() && std::chrono::steady_clock::now() - l.start >= m_linger) {
+      flush_aggregator(l);
+      dispatch(l, false);
+    } else if (l.has_retry()) {
+      dispatch(l, false);
+    }
+  }
+
+  // One limiter per shard of the current snapshot. Entries buffered before a reshard
+  // may carry indexes of the old snapshot; they are paced by whatever shard now has
+  // that index, or not at all.
+  void update_rate_limits() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_shardLimiters.clear();
+    if (m_rateLimit && m_shards) {
+      m_shardLimiters.resize(m_shards->size());
+      for (auto& limiter : m_shardLimiters) {
+        limiter.set_max_rate(kSHARD_MAX_RECORDS_PER_SEC, kSHARD_MAX_BYTES_PER_SEC);
+      }
+    }
+  }
+
+  // Limiter of a shard, or null if it is not limited. Requires m_mutex.
+  adaptive_rate_limiter *shard_limiter(size_t shard) {
+    return shard < m_shardLimiters.size() ? &m_shardLimiters[shard] : nullptr;
+  }
+
+  // When the entries may be sent without exceeding the rates of their shards. Requires m_mutex.
+  std::chrono::steady_clock::time_point ready_at(const Aws::Vector<Aws::Kinesis::Model::PutRecordsRequestEntry>& entries,
+                                                 const std::vector<size_t>& shards,
+                                                 std::chrono::steady_clock::time_point now) {
+    auto ready = now;
+    if (m_shardLimiters.empty()) {
+      return ready;
+    }
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (auto *limiter = shard_limiter(shards[i])) {
+        ready = std::max(ready, limiter->ready_at(now));
+      }
+    }
+    return ready;
+  }
+
+  // Draws the entries from the buckets of their shards. Requires m_mutex.
+  void take(const Aws::Vector<Aws::Kinesis::Model::PutRecordsRequestEntry>& entries, const std::vector<size_t>& shards,
+            std::chrono::steady_clock::time_point now) {
+    if (m_shardLimiters.empty()) {
+      return;
+    }
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (auto *limiter = shard_limiter(shards[i])) {
+        limiter->take(1, entries[i].GetData().GetLength() + entries[i].GetPartitionKey().size(), now);
+      }
+    }
+  }
+
+  std::chrono::steady_clock::duration backoff(uint32_t attempt) {
+    const auto ceiling = std::min<std::chrono::steady_clock::duration>(
+        m_maxBackoff, m_baseBackoff * (uint64_t(1) << std::min<uint32_t>(attempt, 20)));
+    std::uniform_int_distribution<int64_t> jitter(0, ceiling.count());
+    return std::chrono::steady_clock::duration(jitter(m_random));
+  }
+
+  void add_record(lane& l, size_t shard, const std::string& partition_key, const std::string& explicit_hash_key,
+                  Aws::Utils::ByteBuffer&& data,
+                  const uint64_t *tags_begin, const uint64_t *tags_end) {
+    const size_t record_bytes = data.GetLength() + partition_key.size();
+    if (l.batch.size() + 1 > m_maxRecords || l.batch_bytes + record_bytes > m_maxBytes) {
+      dispatch(l, true);
+      l.start = std::chrono::steady_clock::now();
+    }
+
+    Aws::Kinesis::Model::PutRecordsRequestEntry entry;
+    entry.SetPartitionKey(partition_key.c_str());
+    if (!explicit_hash_key.empty()) {
+      entry.SetExplicitHashKey(explicit_hash_key.c_str());
+    }
+    entry.SetData(std::move(data));
+    l.batch.push_back(std::move(entry));
+    l.tags.insert(l.tags.end(), tags_begin, tags_end);
+    l.tag_ends.push_back(static_cast<uint32_t>(l.tags.size()));
+    l.shards.push_back(shard);
+    l.batch_bytes += record_bytes;
+
+    if (l.batch.size() >= m_maxRecords || l.batch_bytes >= m_maxBytes) {
+      dispatch(l, true);
+    }
+  }
+
+  void flush_aggregator(lane& l) {
+    if (l.aggregator.empty()) {
+      return;
+    }
+    const std::string partition_key = l.aggregator.partition_key();
+    const std::string explicit_hash_key = l.aggregator.explicit_hash_key();
+    std::vector<uint64_t> tags;
+    tags.swap(l.aggregator_tags);
+    Aws::Utils::ByteBuffer record = l.aggregator.build();
+    if (m_compressor) {
+      record = m_compressor->compress(record.GetUnderlyingData(), record.GetLength());
+    }
+    add_record(l, l.aggregator_shard, partition_key, explicit_hash_key, std::move(record), tags.data(),
+               tags.data() + tags.size());
+  }
+
+  // Starts an asynchronous PutRecords call for the lane, resending its failed entries
+  // before its batch. Returns false if the batch was not sent because the lane is busy
+  // (a call in flight, a retry backoff or the rate limit of one of its shards) and wait is false.
+  bool dispatch(lane& l, bool wait) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+      const bool retrying = !l.retry.empty();
+      if (!retrying && l.batch.empty()) {
+        return true;
+      }
+      if (l.in_flight) {
+        if (!wait) {
+          return false;
+        }
+        m_cv.wait(lock);
+        continue;
+      }
+      const auto now = std::chrono::steady_clock::now();
+      const auto ready = retrying ? std::max(l.retry_at, ready_at(l.retry, l.retry_shards, now))
+                                  : ready_at(l.batch, l.shards, now);
+      if (ready > now) {
+        if (!wait) {
+          return false;
+        }
+        m_cv.wait_until(lock, ready);
+        continue;
+      }
+      l.in_flight = true;
+      ++m_inFlight;
+
+      auto context = std::make_shared<batch_context>();
+      context->owner = &l;
+      context->sent = now;
+      Aws::Vector<Aws::Kinesis::Model::PutRecordsRequestEntry> entries;
+      if (retrying) {
+        take(l.retry, l.retry_shards, now);
+        entries.swap(l.retry);
+        context->tags.swap(l.retry_tags);
+        context->tag_ends.swap(l.retry_tag_ends);
+        context->attempts.swap(l.retry_attempts);
+        context->shards.swap(l.retry_shards);
+        if (m_metrics) {
+          m_metrics->retries.add(context->tags.size());
+        }
+        l.retry_pending.store(false, std::memory_order_release);
+      } else {
+        take(l.batch, l.shards, now);
+      }
+      lock.unlock();
+
+      if (!retrying) {
+        // the batch is only touched by the calling thread
+        if (m_metrics) {
+          m_metrics->batch_build.record(now - l.start);
+        }
+        entries.swap(l.batch);
+        l.batch.reserve(m_maxRecords);
+        context->tags.swap(l.tags);
+        context->tag_ends.swap(l.tag_ends);
+        context->shards.swap(l.shards);
+        context->attempts.assign(entries.size(), 0);
+      }
+      if (m_metrics) {
+        m_metrics->bytes_sent.add(retrying ? 0 : l.batch_bytes);
+        m_metrics->put_records_calls.add();
+      }
+      if (!retrying) {
+        l.batch_bytes = 0;
+      }
+      send(std::move(entries), context);
+      if (!retrying) {
+        return true;
+      }
+      lock.lock();
+    }
+  }
+
+  void send(Aws::Vector<Aws::Kinesis::Model::PutRecordsRequestEntry>&& entries,
+            const std::shared_ptr<batch_context>& context) {
+    Aws::Kinesis::Model::PutRecordsRequest request;
+    request.SetStreamName(m_streamName);
+    request.SetRecords(std::move(entries));
+    m_client->PutRecordsAsync(request,
+        [this, context](const Aws::Kinesis::KinesisClient *, const Aws::Kinesis::Model::PutRecordsRequest& request,
+                        const Aws::Kinesis::Model::PutRecordsOutcome& outcome,
+                        const std::shared_ptr<const Aws::Client::AsyncCallerContext>&) {
+          on_complete(*context, request, outcome);
+        });
+  }
+
+  static bool retriable(const Aws::String& error_code) {
+    return error_code == "ProvisionedThroughputExceededException" || error_code == "InternalFailure";
+  }
+
+  void on_complete(const batch_context& context, const Aws::Kinesis::Model::PutRecordsRequest& request,
+                   const Aws::Kinesis::Model::PutRecordsOutcome& outcome) {
+    if (m_metrics) {
+      record_metrics(context, outcome);
+    }
+
+    // shards that throttled some of their entries, and shards whose entries were all accepted
+    std::unordered_set<size_t> throttled_shards;
+    std::unordered_set<size_t> ok_shards;
+    std::vector<kinesis_ack> acks;
+    acks.reserve(context.tags.size());
+    Aws::Vector<Aws::Kinesis::Model::PutRecordsRequestEntry> retry;
+    std::vector<uint64_t> retry_tags;
+    std::vector<uint32_t> retry_tag_ends;
+    std::vector<uint32_t> retry_attempts;
+    std::vector<size_t> retry_shards;
+    uint32_t max_attempt = 0;
+    // partition keys with an entry being resent, their later entries must follow it
+    std::unordered_set<std::string> held_keys;
+
+    uint32_t begin = 0;
+    for (size_t i = 0; i < context.tag_ends.size(); ++i) {
+      const uint32_t end = context.tag_ends[i];
+      bool ok;
+      bool can_retry;
+      bool throttled;
+      Aws::String sequence_number;
+      Aws::String error_code;
+      if (!outcome.IsSuccess()) {
+        ok = false;
+        error_code = outcome.GetError().GetExceptionName();
+        throttled = outcome.GetError().GetErrorType() == Aws::Kinesis::KinesisErrors::PROVISIONED_THROUGHPUT_EXCEEDED;
+        can_retry = outcome.GetError().ShouldRetry() || throttled;
+      } else {
+        const auto& result = outcome.GetResult().GetRecords()[i];
+        error_code = result.GetErrorCode();
+        ok = error_code.empty();
+        sequence_number = result.GetSequenceNumber();
+        throttled = error_code == "ProvisionedThroughputExceededException";
+        can_retry = retriable(error_code);
+      }
+      if (throttled) {
+        throttled_shards.insert(context.shards[i]);
+      } else if (outcome.IsSuccess()) {
+        ok_shards.insert(context.shards[i]);
+      }
+
+      const auto& entry = request.GetRecords()[i];
+      const bool resend = !ok && can_retry && context.attempts[i] < m_maxRetries;
+      bool follows = false;
+      if (resend || (ok && !held_keys.empty())) {
+        const std::string key(entry.GetPartitionKey().c_str(), entry.GetPartitionKey().size());
+        follows = !resend && held_keys.count(key) != 0;
+        if (resend) {
+          held_keys.insert(key);
+        }
+      }
+
+      if (resend || follows) {
+        retry.push_back(entry);
+        retry_shards.push_back(context.shards[i]);
+        retry_tags.insert(retry_tags.end(), context.tags.begin() + begin, context.tags.begin() + end);
+        retry_tag_ends.push_back(static_cast<uint32_t>(retry_tags.size()));
+        retry_attempts.push_back(context.attempts[i] + 1);
+        max_attempt = std::max(max_attempt, context.attempts[i]);
+      } else {
+        for (uint32_t t = begin; t < end; ++t) {
+          acks.push_back(kinesis_ack{context.tags[t], ok, sequence_number, error_code, !ok && can_retry});
+        }
+        if (m_metrics) {
+          (ok ? m_metrics->records_sent : m_metrics->records_failed).add(end - begin);
+        }
+      }
+      begin = end;
+    }
+
+    if (m_callback && !acks.empty()) {
+      m_callback(acks);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      lane& l = *context.owner;
+      // only the shards that pushed back slow down, the others of the lane keep their rate
+      for (const size_t shard : throttled_shards) {
+        if (auto *limiter = shard_limiter(shard)) {
+          limiter->on_throttled();
+        }
+      }
+      for (const size_t shard : ok_shards) {
+        auto *limiter = shard_limiter(shard);
+        if (limiter && throttled_shards.count(shard) == 0) {
+          limiter->on_success();
+        }
+      }
+      if (!retry.empty()) {
+        // one call per lane is in flight, so nothing else is waiting to be retried
+        l.retry = std::move(retry);
+        l.retry_tags = std::move(retry_tags);
+        l.retry_tag_ends = std::move(retry_tag_ends);
+        l.retry_attempts = std::move(retry_attempts);
+        l.retry_shards = std::move(retry_shards);
+        l.retry_at = std::chrono::steady_clock::now() + backoff(max_attempt);
+        l.retry_pending.store(true, std::memory_order_release);
+      }
+      l.in_flight = false;
+      --m_inFlight;
+    }
+    m_cv.notify_all();
+  }
+
+  // Records the call itself; the outcome of each record is counted once it is final.
+  void record_metrics(const batch_context& context, const Aws::Kinesis::Model::PutRecordsOutcome& outcome) {
+    m_metrics->put_records.record(std::chrono::steady_clock::now() - context.sent);
+    if (!outcome.IsSuccess()) {
+      m_metrics->put_records_errors.add();
+      if (outcome.GetError().GetErrorType() == Aws::Kinesis::KinesisErrors::PROVISIONED_THROUGHPUT_EXCEEDED) {
+        m_metrics->throttles.add(context.tags.size());
+      }
+      return;
+    }
+    // counted per user record, an aggregated entry stands for all of its tags
+    const auto& results = outcome.GetResult().GetRecords();
+    uint32_t begin = 0;
+    for (size_t i = 0; i < context.tag_ends.size() && i < results.size(); ++i) {
+      const uint32_t n = context.tag_ends[i] - begin;
+      begin = context.tag_ends[i];
+      if (results[i].GetErrorCode() == "ProvisionedThroughputExceededException") {
+        m_metrics->throttles.add(n);
+      }
+    }
+  }
+
+
   Aws::SDKOptions m_options;
+  std::shared_ptr<Aws::Utils::Threading::PooledThreadExecutor> m_executor;
   Aws::Kinesis::KinesisClient *m_client;
   Aws::String m_streamName;
+  std::string m_endpoint;
+
+  size_t m_maxRecords = kMAX_RECORDS_PER_REQUEST;
+  size_t m_maxBytes = kMAX_BYTES_PER_REQUEST;
+  std::chrono::milliseconds m_linger{100};
+
+  bool m_aggregate = false;
+  size_t m_aggregateMaxBytes = kMAX_BYTES_PER_RECORD;
+
+  std::unique_ptr<kinesis_compressor> m_compressor;
+
+  shard_map m_shardMap;
+  std::shared_ptr<shard_map_source> m_shardSource;
+  std::chrono::seconds m_shardRefresh{60};
+  std::chrono::steady_clock::time_point m_lastShardRefresh;
+  bool m_spreadExplicitHash = false;
+  // Snapshot used by the calling thread, swapped when m_shardMap's version changes.
+  shard_map::shards_ptr m_shards;
+  uint64_t m_shardsVersion = 0;
+
+  size_t m_maxInFlight = 4;
+  uint32_t m_maxRetries = 8;
+  std::chrono::milliseconds m_baseBackoff{100};
+  std::chrono::milliseconds m_maxBackoff{5000};
+  bool m_rateLimit = true;
+  // Indexed by shard of m_shards, empty when records are not limited. Guarded by m_mutex.
+  std::vector<adaptive_rate_limiter> m_shardLimiters;
+  // Backoff jitter, guarded by m_mutex.
+  std::mt19937_64 m_random{std::random_device()()};
+  std::vector<std::unique_ptr<lane>> m_lanes;
+  completion_callback m_callback;
+  std::shared_ptr<kinesis_metrics> m_metrics;
+
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  size_t m_inFlight = 0;
+  bool m_refreshingShards = false;
 };
 
 }  // namespace eosio
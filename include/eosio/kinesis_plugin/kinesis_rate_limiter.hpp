@@ -0,0 +1,114 @@
+#ifndef KINESIS_RATE_LIMITER_HPP
+#define KINESIS_RATE_LIMITER_HPP
+
+#include <algorithm>
+#include <chrono>
+
+namespace eosio {
+
+// Kinesis write limits of a single shard.
+const double kSHARD_MAX_RECORDS_PER_SEC = 1000;
+const double kSHARD_MAX_BYTES_PER_SEC = 1024 * 1024;
+
+// Token buckets for records and bytes whose rates adapt to throttling (AIMD): halved
+// when a call is throttled, raised by a twentieth of the maximum after a call that is
+// not. A call may overdraw the buckets; the next one waits until they are paid back.
+// Not thread safe.
+class adaptive_rate_limiter {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  // 0 disables limiting.
+  void set_max_rate(double records_per_sec, double bytes_per_sec) {
+    m_records.set_max(records_per_sec);
+    m_bytes.set_max(bytes_per_sec);
+  }
+
+  // When the next call may be made.
+  clock::time_point ready_at(clock::time_point now) {
+    refill(now);
+    return now + std::max(m_records.wait(), m_bytes.wait());
+  }
+
+  void take(double records, double bytes, clock::time_point now) {
+    refill(now);
+    m_records.take(records);
+    m_bytes.take(bytes);
+  }
+
+  void on_throttled() {
+    m_records.decrease();
+    m_bytes.decrease();
+  }
+
+  void on_success() {
+    m_records.increase();
+    m_bytes.increase();
+  }
+
+  double records_rate() const { return m_records.rate; }
+
+ private:
+  struct bucket {
+    double max = 0;
+    double rate = 0;
+    double tokens = 0;
+
+    void set_max(double m) {
+      if (max == 0) {
+        // nothing was counted while unlimited
+        rate = m;
+        tokens = 0;
+      } else if (rate > m) {
+        rate = m;
+      }
+      max = m;
+      tokens = std::min(tokens, rate);
+    }
+
+    // unlimited buckets are not drawn from, they would never be paid back
+    void take(double n) {
+      if (max > 0) {
+        tokens -= n;
+      }
+    }
+
+    void refill(double seconds) {
+      if (max > 0) {
+        // at most one second worth of burst
+        tokens = std::min(rate, tokens + rate * seconds);
+      }
+    }
+
+    clock::duration wait() const {
+      if (max == 0 || tokens >= 0) {
+        return clock::duration::zero();
+      }
+      return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(-tokens / rate));
+    }
+
+    void decrease() {
+      rate = std::max(max / 20, rate / 2);
+      tokens = std::min(tokens, 0.0);
+    }
+
+    void increase() { rate = std::min(max, rate + max / 20); }
+  };
+
+  void refill(clock::time_point now) {
+    const double seconds = std::chrono::duration<double>(now - m_last).count();
+    m_last = now;
+    if (seconds > 0) {
+      m_records.refill(seconds);
+      m_bytes.refill(seconds);
+    }
+  }
+
+  bucket m_records;
+  bucket m_bytes;
+  clock::time_point m_last = clock::now();
+};
+
+}  // namespace eosio
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef KINESIS_SHARD_MAP_HPP
+#define KINESIS_SHARD_MAP_HPP
+
+#include <aws/core/Aws.h>
+#include <aws/core/utils/HashingUtils.h>
+#include <aws/kinesis/KinesisClient.h>
+#include <aws/kinesis/model/ListShardsRequest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace eosio {
+
+// Kinesis maps every record onto a 128-bit hash key: the explicit hash key when
+// one is given, otherwise the MD5 of the partition key read as a big endian number.
+using hash_key = unsigned __int128;
+
+inline bool parse_hash_key(const std::string& decimal, hash_key& out) {
+  if (decimal.empty() || decimal.size() > 39) {
+    return false;
+  }
+  hash_key value = 0;
+  for (char c : decimal) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    const hash_key next = value * 10 + static_cast<unsigned>(c - '0');
+    if (next / 10 != value) {
+      return false;
+    }
+    value = next;
+  }
+  out = value;
+  return true;
+}
+
+inline std::string format_hash_key(hash_key value) {
+  char buf[40];
+  char *p = buf + sizeof(buf);
+  do {
+    *--p = static_cast<char>('0' + static_cast<unsigned>(value % 10));
+    value /= 10;
+  } while (value != 0);
+  return std::string(p, buf + sizeof(buf));
+}
+
+inline hash_key partition_key_hash(const std::string& partition_key) {
+  const Aws::Utils::ByteBuffer digest = Aws::Utils::HashingUtils::CalculateMD5(Aws::String(partition_key.c_str()));
+  hash_key value = 0;
+  for (size_t i = 0; i < digest.GetLength(); ++i) {
+    value = (value << 8) | digest.GetUnderlyingData()[i];
+  }
+  return value;
+}
+
+struct kinesis_shard {
+  std::string id;
+  hash_key start;
+  hash_key end;
+  // Explicit hash key in the middle of [start, end], used to target this shard.
+  std::string target_key;
+};
+
+// Provides the open shards of a stream.
+class shard_map_source {
+ public:
+  virtual ~shard_map_source() {}
+  // Returns false if the shards could not be listed.
+  virtual bool list_shards(std::vector<kinesis_shard>& shards) = 0;
+};
+
+// Lists shards with the ListShards API, skipping closed parent shards.
+class kinesis_shard_source : public shard_map_source {
+ public:
+  kinesis_shard_source(const Aws::Kinesis::KinesisClient *client, const Aws::String& stream_name)
+      : m_client(client), m_streamName(stream_name) {}
+
+  bool list_shards(std::vector<kinesis_shard>& shards) override {
+    Aws::Kinesis::Model::ListShardsRequest request;
+    request.SetStreamName(m_streamName);
+    while (true) {
+      auto outcome = m_client->ListShards(request);
+      if (!outcome.IsSuccess()) {
+        return false;
+      }
+      for (const auto& shard : outcome.GetResult().GetShards()) {
+        if (!shard.GetSequenceNumberRange().GetEndingSequenceNumber().empty()) {
+          continue;
+        }
+        kinesis_shard s;
+        s.id = shard.GetShardId().c_str();
+        if (!parse_hash_key(shard.GetHashKeyRange().GetStartingHashKey().c_str(), s.start) ||
+            !parse_hash_key(shard.GetHashKeyRange().GetEndingHashKey().c_str(), s.end)) {
+          return false;
+        }
+        shards.push_back(std::move(s));
+      }
+      const Aws::String& token = outcome.GetResult().GetNextToken();
+      if (token.empty()) {
+        return true;
+      }
+      // The stream name must not be repeated together with a continuation token.
+      request = Aws::Kinesis::Model::ListShardsRequest();
+      request.SetNextToken(token);
+    }
+  }
+
+ private:
+  const Aws::Kinesis::KinesisClient *m_client;
+  Aws::String m_streamName;
+};
+
+// Offline stand-in that splits the hash key space evenly, the way CreateStream does.
+class mock_shard_source : public shard_map_source {
+ public:
+  explicit mock_shard_source(size_t shards) : m_shards(shards) {}
+
+  // Simulates UpdateShardCount; the next refresh sees the new layout.
+  void reshard(size_t shards) { m_shards = shards; }
+
+  bool list_shards(std::vector<kinesis_shard>& shards) override {
+    const hash_key max = ~hash_key(0);
+    const hash_key width = max / m_shards;
+    for (size_t i = 0; i < m_shards; ++i) {
+      kinesis_shard s;
+      char id[32];
+      std::snprintf(id, sizeof(id), "shardId-%012llu", static_cast<unsigned long long>(m_nextId++));
+      s.id = id;
+      s.start = width * i;
+      s.end = i + 1 == m_shards ? max : width * (i + 1) - 1;
+      shards.push_back(std::move(s));
+    }
+    return true;
+  }
+
+ private:
+  size_t m_shards;
+  uint64_t m_nextId = 0;
+};
+
+// Snapshot of a stream's open shards, sorted by hash key range.
+class shard_map {
+ public:
+  using shards_ptr = std::shared_ptr<const std::vector<kinesis_shard>>;
+
+  // Replaces the current layout; safe to call concurrently with snapshot().
+  bool refresh(shard_map_source& source) {
+    std::vector<kinesis_shard> shards;
+    if (!source.list_shards(shards) || shards.empty()) {
+      return false;
+    }
+    std::sort(shards.begin(), shards.end(),
+              [](const kinesis_shard& a, const kinesis_shard& b) { return a.start < b.start; });
+    for (auto& s : shards) {
+      s.target_key = format_hash_key(s.start + (s.end - s.start) / 2);
+    }
+    auto next = std::make_shared<const std::vector<kinesis_shard>>(std::move(shards));
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_shards = std::move(next);
+    m_version.fetch_add(1, std::memory_order_release);
+    return true;
+  }
+
+  // Incremented on every successful refresh, so readers can cheaply tell if their snapshot is stale.
+  uint64_t version() const { return m_version.load(std::memory_order_acquire); }
+
+  shards_ptr snapshot() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_shards;
+  }
+
+  // Index of the shard whose range contains key.
+  static size_t shard_for(const std::vector<kinesis_shard>& shards, hash_key key) {
+    auto itr = std::upper_bound(shards.begin(), shards.end(), key,
+                                [](hash_key k, const kinesis_shard& s) { return k < s.start; });
+    return itr == shards.begin() ? 0 : static_cast<size_t>(itr - shards.begin() - 1);
+  }
+
+ private:
+  mutable std::mutex m_mutex;
+  shards_ptr m_shards;
+  std::atomic<uint64_t> m_version{0};
+};
+
+}  // namespace eosio
+
+#endif
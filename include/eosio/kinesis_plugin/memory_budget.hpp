@@ -0,0 +1,47 @@
+#ifndef MEMORY_BUDGET_HPP
+#define MEMORY_BUDGET_HPP
+
+#include <atomic>
+#include <cstddef>
+
+namespace eosio {
+
+// Bytes held by several producers against one limit. Acquiring never blocks: a caller that
+// does not get its bytes drops the record itself. Each holder also has a cap of its own, so
+// one that cannot keep up runs out of room before it takes the whole budget from the others.
+class memory_budget {
+ public:
+  explicit memory_budget(size_t limit) : m_limit(limit) {}
+
+  size_t limit() const { return m_limit; }
+
+  size_t used() const { return m_used.load(std::memory_order_relaxed); }
+
+  // held counts the bytes of one holder, which may not exceed cap
+  bool try_acquire(std::atomic<size_t>& held, size_t cap, size_t bytes) {
+    if (bytes > cap || held.load(std::memory_order_relaxed) > cap - bytes) {
+      return false;
+    }
+    size_t used = m_used.load(std::memory_order_relaxed);
+    do {
+      if (bytes > m_limit - used) {
+        return false;
+      }
+    } while (!m_used.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+    held.fetch_add(bytes, std::memory_order_relaxed);
+    return true;
+  }
+
+  void release(std::atomic<size_t>& held, size_t bytes) {
+    held.fetch_sub(bytes, std::memory_order_relaxed);
+    m_used.fetch_sub(bytes, std::memory_order_relaxed);
+  }
+
+ private:
+  const size_t m_limit;
+  std::atomic<size_t> m_used{0};
+};
+
+}  // namespace eosio
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef ORDERED_WORKER_POOL_HPP
+#define ORDERED_WORKER_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace eosio {
+
+// Runs jobs on a fixed set of worker threads and hands their results to a sink
+// in submission order.
+//
+// submit(), emit_ready() and drain() must all be called from the same thread,
+// which is also the thread the sink runs on. At most `window` jobs are pending
+// at once; submitting beyond that first emits the oldest result, waiting for
+// it if necessary. With zero threads jobs run inline in submit(). pending() may
+// be read from any thread.
+template<typename Result>
+class ordered_worker_pool {
+ public:
+  using job = std::function<Result()>;
+  using sink = std::function<void(Result&)>;
+
+  ordered_worker_pool(size_t threads, size_t window, sink s, std::function<void()> on_ready = nullptr)
+      : m_window(std::max<size_t>(1, window)), m_sink(std::move(s)), m_onReady(std::move(on_ready)) {
+    for (size_t i = 0; i < threads; ++i) {
+      m_workers.emplace_back([this] { work(); });
+    }
+  }
+
+  ordered_worker_pool(const ordered_worker_pool&) = delete;
+  ordered_worker_pool& operator=(const ordered_worker_pool&) = delete;
+
+  ~ordered_worker_pool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_done = true;
+    }
+    m_workCv.notify_all();
+    for (auto& w : m_workers) {
+      w.join();
+    }
+  }
+
+  void submit(job j) {
+    if (m_workers.empty()) {
+      Result r = j();
+      m_sink(r);
+      return;
+    }
+    while (m_pending.size() >= m_window) {
+      emit_one(true);
+    }
+    auto s = std::make_shared<slot>();
+    s->work = std::move(j);
+    m_pending.push_back(s);
+    m_pendingCount.store(m_pending.size(), std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_jobs.push_back(s);
+    }
+    m_workCv.notify_one();
+  }
+
+  // Emits the results that are ready, stopping at the first one still in progress.
+  void emit_ready() {
+    while (!m_pending.empty() && emit_one(false)) {
+    }
+  }
+
+  // Emits every pending result, waiting for the jobs still in progress.
+  void drain() {
+    while (!m_pending.empty()) {
+      emit_one(true);
+    }
+  }
+
+  bool has_ready() const {
+    if (m_pending.empty()) {
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_pending.front()->ready;
+  }
+
+  size_t pending() const { return m_pendingCount.load(std::memory_order_relaxed); }
+
+ private:
+  struct slot {
+    job work;
+    Result result;
+    std::exception_ptr error;
+    bool ready = false;  // guarded by m_mutex
+  };
+
+  bool emit_one(bool wait) {
+    std::shared_ptr<slot> s = m_pending.front();
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      if (!s->ready) {
+        if (!wait) {
+          return false;
+        }
+        m_readyCv.wait(lock, [&s] { return s->ready; });
+      }
+    }
+    m_pending.pop_front();
+    m_pendingCount.store(m_pending.size(), std::memory_order_relaxed);
+    if (s->error) {
+      std::rethrow_exception(s->error);
+    }
+    m_sink(s->result);
+    return true;
+  }
+
+  void work() {
+    while (true) {
+      std::shared_ptr<slot> s;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_workCv.wait(lock, [this] { return m_done || !m_jobs.empty(); });
+        if (m_jobs.empty()) {
+          return;
+        }
+        s = std::move(m_jobs.front());
+        m_jobs.pop_front();
+      }
+
+      try {
+        s->result = s->work();
+      } catch (...) {
+        s->error = std::current_exception();
+      }
+      s->work = nullptr;
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        s->ready = true;
+      }
+      m_readyCv.notify_one();
+      if (m_onReady) {
+        m_onReady();
+      }
+    }
+  }
+
+  const size_t m_window;
+  sink m_sink;
+  std::function<void()> m_onReady;
+
+  // Owned by the submitting thread, in submission order.
+  std::deque<std::shared_ptr<slot>> m_pending;
+  // m_pending.size(), published for other threads
+  std::atomic<size_t> m_pendingCount{0};
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_workCv;
+  std::condition_variable m_readyCv;
+  std::deque<std::shared_ptr<slot>> m_jobs;
+  bool m_done = false;
+  std::vector<std::thread> m_workers;
+};
+
+}  // namespace eosio
+
+#endif
@@ -0,0 +1,384 @@
+#ifndef SPILL_LOG_HPP
+#define SPILL_LOG_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <eosio/kinesis_plugin/file_io.hpp>
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace eosio {
+
+// Durable, segment based log of outgoing records between the kinesis thread and
+// the producer.
+//
+// Records get sequential offsets and are appended to memory mapped segment files
+// named after the offset of their first record. The offset below which every
+// record has been acknowledged is kept in the `ack` file; segments entirely
+// below it are recycled. On open, the segments are scanned and reading resumes
+// at the acknowledged offset, so unacknowledged records are delivered again. The
+// log ends at the first torn or missing record; segments after it are dropped.
+//
+//   segment: magic u32 | version u32 | base offset u64 | record...
+//   record:  body size u32 | fnv1a(body) u32 | offset u64 | type u8 | key size u16 | key | data
+//
+// append() is called from one thread and read()/commit() from another.
+class spill_log {
+ public:
+  struct record_view {
+    uint64_t offset;
+    uint8_t type;
+    std::string partition_key;
+    const unsigned char *data;
+    uint32_t size;
+  };
+
+  spill_log(const boost::filesystem::path& dir, size_t segment_size, uint64_t max_bytes)
+      : m_dir(dir), m_segmentSize(std::max(segment_size, kMIN_SEGMENT_SIZE)), m_maxBytes(max_bytes) {
+    boost::filesystem::create_directories(m_dir);
+    open_ack_file();
+    recover();
+  }
+
+  spill_log(const spill_log&) = delete;
+  spill_log& operator=(const spill_log&) = delete;
+
+  ~spill_log() {
+    sync();
+    for (auto& s : m_segments) {
+      unmap(*s);
+    }
+    if (m_ackFd >= 0) {
+      ::close(m_ackFd);
+    }
+  }
+
+  // Appends a record and returns its offset. Blocks while the log is over its size
+  // budget, unless close() has been called.
+  uint64_t append(uint8_t type, const std::string& partition_key, const char *data, size_t size) {
+    const size_t body = 1 + 2 + partition_key.size() + size;
+    if (partition_key.size() > UINT16_MAX || kRECORD_HEADER_SIZE + body > m_segmentSize - kSEGMENT_HEADER_SIZE) {
+      throw std::runtime_error("record too large for the kinesis spill log");
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    segment *s = m_segments.empty() ? nullptr : m_segments.back().get();
+    if (s == nullptr || s->write_pos + kRECORD_HEADER_SIZE + body > s->size) {
+      m_cv.wait(lock, [this] { return m_closed || m_segments.size() * m_segmentSize < m_maxBytes; });
+      s = roll(m_end);
+    }
+
+    char *out = s->data + s->write_pos;
+    char *b = out + kRECORD_HEADER_SIZE;
+    b[0] = static_cast<char>(type);
+    file_io::put(b + 1, static_cast<uint16_t>(partition_key.size()));
+    std::memcpy(b + 3, partition_key.data(), partition_key.size());
+    std::memcpy(b + 3 + partition_key.size(), data, size);
+    file_io::put(out, static_cast<uint32_t>(body));
+    file_io::put(out + 4, file_io::fnv1a(b, body));
+    file_io::put(out + 8, m_end);
+
+    s->positions.push_back(static_cast<uint32_t>(s->write_pos));
+    s->write_pos += kRECORD_HEADER_SIZE + body;
+    const uint64_t offset = m_end++;
+    lock.unlock();
+    m_cv.notify_all();
+    return offset;
+  }
+
+  // Calls f for up to max records starting at offset from; returns the offset after the last one read.
+  template<typename F>
+  uint64_t read(uint64_t from, size_t max, F&& f) {
+    for (size_t n = 0; n < max; ++n) {
+      if (!read_one(from, f)) {
+        break;
+      }
+      ++from;
+    }
+    return from;
+  }
+
+  template<typename F>
+  bool read_one(uint64_t offset, F&& f) {
+    record_view r;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (offset >= m_end) {
+        return false;
+      }
+      auto itr = std::upper_bound(m_segments.begin(), m_segments.end(), offset,
+                                  [](uint64_t o, const std::unique_ptr<segment>& s) { return o < s->base; });
+      if (itr == m_segments.begin()) {
+        return false;
+      }
+      const segment& s = **(itr - 1);
+      if (offset - s.base >= s.positions.size()) {
+        return false;
+      }
+      const char *out = s.data + s.positions[offset - s.base];
+      const char *b = out + kRECORD_HEADER_SIZE;
+      const uint32_t body = file_io::get<uint32_t>(out);
+      const uint16_t key_size = file_io::get<uint16_t>(b + 1);
+      r.offset = offset;
+      r.type = static_cast<uint8_t>(b[0]);
+      r.partition_key.assign(b + 3, key_size);
+      r.data = reinterpret_cast<const unsigned char *>(b + 3 + key_size);
+      r.size = body - 3 - key_size;
+    }
+    // Segments are only recycled once committed, so the mapping stays valid.
+    f(r);
+    return true;
+  }
+
+  // Waits until a record at or after offset is available or timeout expires.
+  void wait_for_data(uint64_t offset, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait_for(lock, timeout, [this, offset] { return m_end > offset; });
+  }
+
+  // Records every offset below offset as acknowledged and recycles the segments that became unused.
+  void commit(uint64_t offset) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (offset <= m_committed) {
+      return;
+    }
+    m_committed = std::min(offset, m_end);
+    if (::pwrite(m_ackFd, &m_committed, sizeof(m_committed), 0) != sizeof(m_committed)) {
+      throw std::runtime_error("unable to write kinesis spill log ack file");
+    }
+    // Keep the last segment, it is still being appended to.
+    while (m_segments.size() > 1 && m_segments[1]->base <= m_committed) {
+      recycle(std::move(m_segments.front()));
+      m_segments.pop_front();
+    }
+    lock.unlock();
+    m_cv.notify_all();
+  }
+
+  // Flushes records written since the last call and the ack offset to disk.
+  void sync() {
+    static const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto& s : m_segments) {
+      if (s->write_pos > s->synced_pos) {
+        const size_t start = s->synced_pos / page * page;
+        ::msync(s->data + start, s->write_pos - start, MS_SYNC);
+        s->synced_pos = s->write_pos;
+      }
+    }
+    if (m_ackFd >= 0) {
+      ::fdatasync(m_ackFd);
+    }
+  }
+
+  // Lets append() exceed the size budget instead of blocking, used on shutdown.
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_closed = true;
+    }
+    m_cv.notify_all();
+  }
+
+  uint64_t committed() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_committed;
+  }
+
+  uint64_t end() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_end;
+  }
+
+ private:
+  static constexpr uint32_t kMAGIC = 0x4c50534b;  // "KSPL"
+  static constexpr uint32_t kVERSION = 1;
+  static constexpr size_t kSEGMENT_HEADER_SIZE = 16;
+  static constexpr size_t kRECORD_HEADER_SIZE = 16;
+  static constexpr size_t kMIN_SEGMENT_SIZE = 2 * 1024 * 1024;
+  static constexpr size_t kMAX_RECYCLED = 2;
+
+  struct segment {
+    uint64_t base = 0;
+    boost::filesystem::path path;
+    char *data = nullptr;
+    size_t size = 0;
+    size_t write_pos = kSEGMENT_HEADER_SIZE;
+    size_t synced_pos = 0;
+    // Position of each record, indexed by offset - base.
+    std::vector<uint32_t> positions;
+  };
+
+  boost::filesystem::path segment_path(uint64_t base) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "%020llu.seg", static_cast<unsigned long long>(base));
+    return m_dir / name;
+  }
+
+  void map(segment& s, bool create) {
+    const int fd = ::open(s.path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+      throw std::runtime_error("unable to open kinesis spill segment " + s.path.string());
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || (static_cast<size_t>(st.st_size) < m_segmentSize && ::ftruncate(fd, m_segmentSize) != 0)) {
+      ::close(fd);
+      throw std::runtime_error("unable to size kinesis spill segment " + s.path.string());
+    }
+    s.size = std::max<size_t>(st.st_size, m_segmentSize);
+    void *p = ::mmap(nullptr, s.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      throw std::runtime_error("unable to map kinesis spill segment " + s.path.string());
+    }
+    s.data = static_cast<char *>(p);
+  }
+
+  static void unmap(segment& s) {
+    if (s.data != nullptr) {
+      ::munmap(s.data, s.size);
+      s.data = nullptr;
+    }
+  }
+
+  // Starts a new segment at base, reusing a recycled file when there is one.
+  segment *roll(uint64_t base) {
+    std::unique_ptr<segment> s(new segment);
+    s->base = base;
+    s->path = segment_path(base);
+    if (!m_recycled.empty()) {
+      boost::filesystem::rename(m_recycled.back(), s->path);
+      m_recycled.pop_back();
+    }
+    map(*s, true);
+    file_io::put(s->data, kMAGIC);
+    file_io::put(s->data + 4, kVERSION);
+    file_io::put(s->data + 8, base);
+    // A recycled file still holds old records; their offsets no longer match, but
+    // clear the first header anyway so a crash right now leaves an empty segment.
+    std::memset(s->data + kSEGMENT_HEADER_SIZE, 0, kRECORD_HEADER_SIZE);
+    m_segments.push_back(std::move(s));
+    return m_segments.back().get();
+  }
+
+  void recycle(std::unique_ptr<segment> s) {
+    unmap(*s);
+    if (m_recycled.size() < kMAX_RECYCLED) {
+      const boost::filesystem::path free_path = m_dir / ("free-" + std::to_string(m_recycled.size()) + ".seg.tmp");
+      boost::filesystem::rename(s->path, free_path);
+      m_recycled.push_back(free_path);
+    } else {
+      boost::filesystem::remove(s->path);
+    }
+  }
+
+  void open_ack_file() {
+    const boost::filesystem::path path = m_dir / "ack";
+    m_ackFd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_ackFd < 0) {
+      throw std::runtime_error("unable to open kinesis spill log ack file " + path.string());
+    }
+    uint64_t committed = 0;
+    if (::pread(m_ackFd, &committed, sizeof(committed), 0) == sizeof(committed)) {
+      m_committed = committed;
+    }
+  }
+
+  void recover() {
+    std::vector<uint64_t> bases;
+    for (boost::filesystem::directory_iterator itr(m_dir), end; itr != end; ++itr) {
+      const std::string name = itr->path().filename().string();
+      if (name.size() == 24 && name.compare(20, 4, ".seg") == 0) {
+        bases.push_back(std::stoull(name.substr(0, 20)));
+      } else if (name.compare(0, 5, "free-") == 0) {
+        boost::filesystem::remove(itr->path());
+      }
+    }
+    std::sort(bases.begin(), bases.end());
+
+    bool have_end = false;
+    for (uint64_t base : bases) {
+      if (have_end && base != m_end) {
+        // A segment ended early (a torn record or an invalid segment before it). Records must be
+        // contiguous for reading and acknowledging to get past them, so the log ends at the gap
+        // and the later segments are dropped.
+        boost::filesystem::remove(segment_path(base));
+        continue;
+      }
+      std::unique_ptr<segment> s(new segment);
+      s->base = base;
+      s->path = segment_path(base);
+      map(*s, false);
+      if (file_io::get<uint32_t>(s->data) != kMAGIC || file_io::get<uint64_t>(s->data + 8) != base) {
+        unmap(*s);
+        boost::filesystem::remove(s->path);
+        continue;
+      }
+      // Scan up to the first record that is missing, torn or stale.
+      uint64_t expected = base;
+      size_t pos = kSEGMENT_HEADER_SIZE;
+      while (pos + kRECORD_HEADER_SIZE <= s->size) {
+        const uint32_t body = file_io::get<uint32_t>(s->data + pos);
+        if (body == 0 || pos + kRECORD_HEADER_SIZE + body > s->size ||
+            file_io::get<uint64_t>(s->data + pos + 8) != expected ||
+            file_io::get<uint32_t>(s->data + pos + 4) != file_io::fnv1a(s->data + pos + kRECORD_HEADER_SIZE, body)) {
+          break;
+        }
+        s->positions.push_back(static_cast<uint32_t>(pos));
+        pos += kRECORD_HEADER_SIZE + body;
+        ++expected;
+      }
+      s->write_pos = pos;
+      s->synced_pos = pos;
+      m_end = expected;
+      have_end = true;
+      m_segments.push_back(std::move(s));
+    }
+
+    if (!have_end) {
+      m_end = m_committed;
+    }
+    if (!m_segments.empty() && m_committed < m_segments.front()->base) {
+      m_committed = m_segments.front()->base;
+    }
+    m_committed = std::min(m_committed, m_end);
+    while (m_segments.size() > 1 && m_segments[1]->base <= m_committed) {
+      recycle(std::move(m_segments.front()));
+      m_segments.pop_front();
+    }
+  }
+
+  const boost::filesystem::path m_dir;
+  const size_t m_segmentSize;
+  const uint64_t m_maxBytes;
+
+  mutable std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::deque<std::unique_ptr<segment>> m_segments;
+  std::vector<boost::filesystem::path> m_recycled;
+  uint64_t m_end = 0;
+  uint64_t m_committed = 0;
+  int m_ackFd = -1;
+  bool m_closed = false;
+};
+
+}  // namespace eosio
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef SPSC_RING_HPP
+#define SPSC_RING_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace eosio {
+
+// What spsc_ring::push does when the ring is full.
+enum class overflow_policy {
+  block,  // wait for the consumer, at most max_wait, then drop
+  drop,   // drop the entry and count it
+  spill   // move the entry to an unbounded overflow list
+};
+
+// Bounded single-producer/single-consumer ring buffer with preallocated slots.
+//
+// The producer and the consumer only share the head and tail indexes, each on its
+// own cache line, so the producer never takes a lock while the ring has room.
+// With overflow_policy::spill, entries pushed while the ring is full go to a
+// mutex protected overflow list; the producer keeps spilling until the consumer
+// has taken the list, which keeps entries in push order.
+template<typename T>
+class spsc_ring {
+ public:
+  explicit spsc_ring(size_t capacity, overflow_policy policy = overflow_policy::block,
+                     std::chrono::milliseconds max_wait = std::chrono::milliseconds(100))
+      : m_slots(round_up(capacity)), m_mask(m_slots.size() - 1), m_policy(policy), m_maxWait(max_wait) {}
+
+  spsc_ring(const spsc_ring&) = delete;
+  spsc_ring& operator=(const spsc_ring&) = delete;
+
+  size_t capacity() const { return m_slots.size(); }
+
+  // Producer side. Returns false if the entry was dropped.
+  bool push(const T& e) {
+    return push_with([&e](T& slot) { slot = e; });
+  }
+
+  bool push(T&& e) {
+    return push_with([&e](T& slot) { slot = std::move(e); });
+  }
+
+  // Producer side: fill(T&) writes the entry straight into a preallocated slot, whose
+  // previous entry has been moved out and reset by the consumer, so nothing is built or
+  // copied on the way. Only an entry going to the overflow list is built separately.
+  // Returns false if the entry was dropped.
+  template<typename F>
+  bool push_with(F&& fill) {
+    if (m_spilling.load(std::memory_order_acquire) && spill(fill, false)) {
+      return true;
+    }
+    if (try_push_with(fill)) {
+      return true;
+    }
+
+    switch (m_policy) {
+      case overflow_policy::spill:
+        return spill(fill, true);
+      case overflow_policy::block: {
+        const auto deadline = std::chrono::steady_clock::now() + m_maxWait;
+        for (uint32_t spins = 0; std::chrono::steady_clock::now() < deadline; ++spins) {
+          if (spins < 64) {
+            std::this_thread::yield();
+          } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+          }
+          if (try_push_with(fill)) {
+            return true;
+          }
+        }
+        break;
+      }
+      case overflow_policy::drop:
+        break;
+    }
+    m_dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  bool try_push(const T& e) {
+    return try_push_with([&e](T& slot) { slot = e; });
+  }
+
+  template<typename F>
+  bool try_push_with(F&& fill) {
+    const size_t head = m_head.load(std::memory_order_relaxed);
+    if (head - m_cachedTail == m_slots.size()) {
+      m_cachedTail = m_tail.load(std::memory_order_acquire);
+      if (head - m_cachedTail == m_slots.size()) {
+        return false;
+      }
+    }
+    fill(m_slots[head & m_mask]);
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side. Calls f for every queued entry in push order, releasing each
+  // slot before f runs. Returns the number of entries consumed.
+  template<typename F>
+  size_t consume_all(F&& f) {
+    size_t count = drain(f);
+
+    if (m_spilling.load(std::memory_order_acquire)) {
+      // The producer stops writing to the ring once m_spilling is set, so after
+      // draining up to the current head only spilled entries are newer.
+      count += drain(f);
+      std::deque<T> spilled;
+      {
+        std::lock_guard<std::mutex> lock(m_spillMutex);
+        spilled.swap(m_spill);
+        m_spillSize.store(0, std::memory_order_relaxed);
+        m_spilling.store(false, std::memory_order_release);
+      }
+      for (auto& e : spilled) {
+        f(e);
+        ++count;
+      }
+    }
+    return count;
+  }
+
+  // Approximate number of queued entries, callable from either side.
+  size_t size() const {
+    return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire) +
+           m_spillSize.load(std::memory_order_relaxed);
+  }
+
+  bool empty() const { return size() == 0; }
+
+  uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+ private:
+  static size_t round_up(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  template<typename F>
+  size_t drain(F& f) {
+    size_t count = 0;
+    size_t tail = m_tail.load(std::memory_order_relaxed);
+    const size_t head = m_head.load(std::memory_order_acquire);
+    while (tail != head) {
+      T e = std::move(m_slots[tail & m_mask]);
+      m_slots[tail & m_mask] = T();
+      m_tail.store(++tail, std::memory_order_release);
+      f(e);
+      ++count;
+    }
+    return count;
+  }
+
+  // Appends to the overflow list if already spilling, or unconditionally when force is set.
+  template<typename F>
+  bool spill(F& fill, bool force) {
+    std::lock_guard<std::mutex> lock(m_spillMutex);
+    if (!force && !m_spilling.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    m_spill.emplace_back();
+    fill(m_spill.back());
+    m_spillSize.fetch_add(1, std::memory_order_relaxed);
+    m_spilling.store(true, std::memory_order_release);
+    return true;
+  }
+
+  static const size_t kCACHE_LINE = 64;
+
+  std::vector<T> m_slots;
+  const size_t m_mask;
+  const overflow_policy m_policy;
+  const std::chrono::milliseconds m_maxWait;
+
+  char m_pad0[kCACHE_LINE];
+  std::atomic<size_t> m_head{0};  // written by the producer
+  size_t m_cachedTail = 0;        // producer's last view of m_tail
+  char m_pad1[kCACHE_LINE];
+  std::atomic<size_t> m_tail{0};  // written by the consumer
+  char m_pad2[kCACHE_LINE];
+
+  std::atomic<bool> m_spilling{false};
+  std::atomic<size_t> m_spillSize{0};
+  std::atomic<uint64_t> m_dropped{0};
+  std::mutex m_spillMutex;
+  std::deque<T> m_spill;
+};
+
+}  // namespace eosio
+
+#endif
@@ -0,0 +1,415 @@
+#ifndef TRACE_PROJECTION_HPP
+#define TRACE_PROJECTION_HPP
+
+#include <eosio/chain/trace.hpp>
+#include <eosio/chain/types.hpp>
+
+#include <fc/crypto/hex.hpp>
+#include <fc/io/json.hpp>
+#include <fc/io/raw.hpp>
+
+#include <boost/algorithm/string.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace eosio {
+
+// The fields of a transaction trace that records keep, at the trace, action trace and action
+// receipt levels. Everything is kept by default.
+//
+// JSON records are written field by field straight from the trace, without building an
+// fc::variant tree; dropped fields are left out, and `except` only appears on failed traces.
+// Binary records keep their layout so the published ABI still applies; dropped fields are
+// packed as their empty value (zeros, empty strings and arrays, absent optionals).
+class trace_projection {
+ public:
+  enum trace_field : uint32_t {
+    trace_id = 1 << 0,
+    trace_receipt = 1 << 1,
+    trace_elapsed = 1 << 2,
+    trace_net_usage = 1 << 3,
+    trace_scheduled = 1 << 4,
+    trace_action_traces = 1 << 5,
+    trace_except = 1 << 6
+  };
+
+  enum action_field : uint32_t {
+    action_receipt = 1 << 0,
+    action_act = 1 << 1,
+    action_context_free = 1 << 2,
+    action_elapsed = 1 << 3,
+    action_console = 1 << 4,
+    action_trx_id = 1 << 5,
+    action_block_num = 1 << 6,
+    action_block_time = 1 << 7,
+    action_producer_block_id = 1 << 8,
+    action_account_ram_deltas = 1 << 9,
+    action_inline_traces = 1 << 10
+  };
+
+  enum receipt_field : uint32_t {
+    receipt_receiver = 1 << 0,
+    receipt_act_digest = 1 << 1,
+    receipt_global_sequence = 1 << 2,
+    receipt_recv_sequence = 1 << 3,
+    receipt_auth_sequence = 1 << 4,
+    receipt_code_sequence = 1 << 5,
+    receipt_abi_sequence = 1 << 6
+  };
+
+  static constexpr uint32_t kALL = ~uint32_t(0);
+
+  // Each list is comma separated field names, empty for all fields. Throws
+  // std::invalid_argument for unknown fields.
+  void set_trace_fields(const std::string& fields) {
+    m_trace = parse(fields, {"id", "receipt", "elapsed", "net_usage", "scheduled", "action_traces", "except"},
+                    "transaction trace");
+  }
+
+  void set_action_fields(const std::string& fields) {
+    m_action = parse(fields, {"receipt", "act", "context_free", "elapsed", "console", "trx_id", "block_num",
+                              "block_time", "producer_block_id", "account_ram_deltas", "inline_traces"},
+                     "action trace");
+  }
+
+  void set_receipt_fields(const std::string& fields) {
+    m_receipt = parse(fields, {"receiver", "act_digest", "global_sequence", "recv_sequence", "auth_sequence",
+                               "code_sequence", "abi_sequence"},
+                      "action receipt");
+  }
+
+  bool all() const { return m_trace == kALL && m_action == kALL && m_receipt == kALL; }
+
+  // The trace fields of a binary record, after its envelope.
+  template<typename Stream>
+  void pack(Stream& ds, const chain::transaction_trace& t, const fc::optional<std::string>& except) const {
+    pack_field(ds, m_trace & trace_id, t.id);
+    pack_field(ds, m_trace & trace_receipt, t.receipt);
+    pack_field(ds, m_trace & trace_elapsed, t.elapsed);
+    pack_field(ds, m_trace & trace_net_usage, t.net_usage);
+    pack_field(ds, m_trace & trace_scheduled, t.scheduled);
+    pack_action_traces(ds, m_trace & trace_action_traces, t.action_traces);
+    pack_field(ds, m_trace & trace_except, except);
+  }
+
+  // Appends the trace as a JSON object. decode(act) returns the action's data decoded with its
+  // ABI, or an empty optional to send it as hex.
+  template<typename Decode>
+  void write_json(std::string& out, const chain::transaction_trace& t, Decode&& decode) const {
+    json_object o(out);
+    if (m_trace & trace_id) {
+      write_checksum(o.key("id"), t.id);
+    }
+    if (m_trace & trace_receipt) {
+      if (t.receipt) {
+        const auto& r = *t.receipt;
+        json_object ro(o.key("receipt"));
+        write_string(ro.key("status"),
+                     fc::reflector<chain::transaction_receipt_header::status_enum>::to_string(
+                         static_cast<chain::transaction_receipt_header::status_enum>(r.status)));
+        write_uint64(ro.key("cpu_usage_us"), r.cpu_usage_us);
+        write_uint64(ro.key("net_usage_words"), r.net_usage_words.value);
+        ro.close();
+      } else {
+        o.key("receipt") += "null";
+      }
+    }
+    if (m_trace & trace_elapsed) {
+      write_int64(o.key("elapsed"), t.elapsed.count());
+    }
+    if (m_trace & trace_net_usage) {
+      write_uint64(o.key("net_usage"), t.net_usage);
+    }
+    if (m_trace & trace_scheduled) {
+      o.key("scheduled") += t.scheduled ? "true" : "false";
+    }
+    if (m_trace & trace_action_traces) {
+      write_action_traces(o.key("action_traces"), t.action_traces, decode);
+    }
+    if ((m_trace & trace_except) && t.except) {
+      o.key("except") += fc::json::to_string(*t.except);
+    }
+    o.close();
+  }
+
+ private:
+  // Writes the separators and closing brace of a JSON object.
+  class json_object {
+   public:
+    explicit json_object(std::string& out) : m_out(out) { m_out += '{'; }
+
+    std::string& key(const char *k) {
+      if (!m_first) {
+        m_out += ',';
+      }
+      m_first = false;
+      m_out += '"';
+      m_out += k;
+      m_out += "\":";
+      return m_out;
+    }
+
+    void close() { m_out += '}'; }
+
+   private:
+    std::string& m_out;
+    bool m_first = true;
+  };
+
+  static uint32_t parse(const std::string& fields, const std::vector<std::string>& names, const char *level) {
+    if (fields.empty()) {
+      return kALL;
+    }
+    std::vector<std::string> list;
+    boost::split(list, fields, boost::is_any_of(","));
+    uint32_t mask = 0;
+    for (auto field : list) {
+      boost::trim(field);
+      auto itr = std::find(names.begin(), names.end(), field);
+      if (itr == names.end()) {
+        throw std::invalid_argument("unknown " + std::string(level) + " field '" + field + "'");
+      }
+      mask |= uint32_t(1) << (itr - names.begin());
+    }
+    return mask;
+  }
+
+  template<typename Stream, typename T>
+  static void pack_field(Stream& ds, bool keep, const T& value) {
+    if (keep) {
+      fc::raw::pack(ds, value);
+    } else {
+      fc::raw::pack(ds, T());
+    }
+  }
+
+  template<typename Stream>
+  void pack_action_traces(Stream& ds, bool keep, const std::vector<chain::action_trace>& traces) const {
+    fc::raw::pack(ds, fc::unsigned_int(keep ? traces.size() : 0));
+    if (!keep) {
+      return;
+    }
+    for (const auto& at : traces) {
+      pack_action_receipt(ds, at.receipt);
+      pack_field(ds, m_action & action_act, at.act);
+      pack_field(ds, m_action & action_context_free, at.context_free);
+      pack_field(ds, m_action & action_elapsed, at.elapsed);
+      pack_field(ds, m_action & action_console, at.console);
+      pack_field(ds, m_action & action_trx_id, at.trx_id);
+      pack_field(ds, m_action & action_block_num, at.block_num);
+      pack_field(ds, m_action & action_block_time, at.block_time);
+      pack_field(ds, m_action & action_producer_block_id, at.producer_block_id);
+      pack_field(ds, m_action & action_account_ram_deltas, at.account_ram_deltas);
+      pack_action_traces(ds, m_action & action_inline_traces, at.inline_traces);
+    }
+  }
+
+  template<typename Stream>
+  void pack_action_receipt(Stream& ds, const chain::action_receipt& r) const {
+    const uint32_t keep = (m_action & action_receipt) ? m_receipt : 0;
+    pack_field(ds, keep & receipt_receiver, r.receiver);
+    pack_field(ds, keep & receipt_act_digest, r.act_digest);
+    pack_field(ds, keep & receipt_global_sequence, r.global_sequence);
+    pack_field(ds, keep & receipt_recv_sequence, r.recv_sequence);
+    pack_field(ds, keep & receipt_auth_sequence, r.auth_sequence);
+    pack_field(ds, keep & receipt_code_sequence, r.code_sequence);
+    pack_field(ds, keep & receipt_abi_sequence, r.abi_sequence);
+  }
+
+  template<typename Decode>
+  void write_action_traces(std::string& out, const std::vector<chain::action_trace>& traces, Decode& decode) const {
+    out += '[';
+    for (size_t i = 0; i < traces.size(); ++i) {
+      if (i > 0) {
+        out += ',';
+      }
+      write_action_trace(out, traces[i], decode);
+    }
+    out += ']';
+  }
+
+  template<typename Decode>
+  void write_action_trace(std::string& out, const chain::action_trace& at, Decode& decode) const {
+    json_object o(out);
+    if (m_action & action_receipt) {
+      write_action_receipt(o.key("receipt"), at.receipt);
+    }
+    if (m_action & action_act) {
+      json_object act(o.key("act"));
+      write_name(act.key("account"), at.act.account);
+      write_name(act.key("name"), at.act.name);
+      std::string& auth = act.key("authorization");
+      auth += '[';
+      for (size_t i = 0; i < at.act.authorization.size(); ++i) {
+        if (i > 0) {
+          auth += ',';
+        }
+        json_object p(auth);
+        write_name(p.key("actor"), at.act.authorization[i].actor);
+        write_name(p.key("permission"), at.act.authorization[i].permission);
+        p.close();
+      }
+      auth += ']';
+      const fc::optional<fc::variant> data = decode(at.act);
+      if (data) {
+        act.key("data") += fc::json::to_string(*data);
+        write_hex(act.key("hex_data"), at.act.data);
+      } else {
+        write_hex(act.key("data"), at.act.data);
+      }
+      act.close();
+    }
+    if (m_action & action_context_free) {
+      o.key("context_free") += at.context_free ? "true" : "false";
+    }
+    if (m_action & action_elapsed) {
+      write_int64(o.key("elapsed"), at.elapsed.count());
+    }
+    if (m_action & action_console) {
+      write_string(o.key("console"), at.console);
+    }
+    if (m_action & action_trx_id) {
+      write_checksum(o.key("trx_id"), at.trx_id);
+    }
+    if (m_action & action_block_num) {
+      write_uint64(o.key("block_num"), at.block_num);
+    }
+    if (m_action & action_block_time) {
+      write_string(o.key("block_time"), std::string(at.block_time.to_time_point()));
+    }
+    if (m_action & action_producer_block_id) {
+      if (at.producer_block_id) {
+        write_checksum(o.key("producer_block_id"), *at.producer_block_id);
+      } else {
+        o.key("producer_block_id") += "null";
+      }
+    }
+    if (m_action & action_account_ram_deltas) {
+      std::string& deltas = o.key("account_ram_deltas");
+      deltas += '[';
+      bool first = true;
+      for (const auto& d : at.account_ram_deltas) {
+        if (!first) {
+          deltas += ',';
+        }
+        first = false;
+        json_object d_o(deltas);
+        write_name(d_o.key("account"), d.account);
+        write_int64(d_o.key("delta"), d.delta);
+        d_o.close();
+      }
+      deltas += ']';
+    }
+    if (m_action & action_inline_traces) {
+      write_action_traces(o.key("inline_traces"), at.inline_traces, decode);
+    }
+    o.close();
+  }
+
+  void write_action_receipt(std::string& out, const chain::action_receipt& r) const {
+    json_object o(out);
+    if (m_receipt & receipt_receiver) {
+      write_name(o.key("receiver"), r.receiver);
+    }
+    if (m_receipt & receipt_act_digest) {
+      write_checksum(o.key("act_digest"), r.act_digest);
+    }
+    if (m_receipt & receipt_global_sequence) {
+      write_uint64(o.key("global_sequence"), r.global_sequence);
+    }
+    if (m_receipt & receipt_recv_sequence) {
+      write_uint64(o.key("recv_sequence"), r.recv_sequence);
+    }
+    if (m_receipt & receipt_auth_sequence) {
+      // a map is an array of [key, value] pairs, as fc writes it
+      std::string& seq = o.key("auth_sequence");
+      seq += '[';
+      bool first = true;
+      for (const auto& a : r.auth_sequence) {
+        if (!first) {
+          seq += ',';
+        }
+        first = false;
+        seq += '[';
+        write_name(seq, a.first);
+        seq += ',';
+        write_uint64(seq, a.second);
+        seq += ']';
+      }
+      seq += ']';
+    }
+    if (m_receipt & receipt_code_sequence) {
+      write_uint64(o.key("code_sequence"), r.code_sequence.value);
+    }
+    if (m_receipt & receipt_abi_sequence) {
+      write_uint64(o.key("abi_sequence"), r.abi_sequence.value);
+    }
+    o.close();
+  }
+
+  // Numbers beyond 32 bits are quoted, as fc::json does, so JavaScript consumers keep precision.
+  static void write_uint64(std::string& out, uint64_t v) {
+    char buf[24];
+    const int n = std::snprintf(buf, sizeof(buf), v > 0xffffffffull ? "\"%llu\"" : "%llu",
+                                static_cast<unsigned long long>(v));
+    out.append(buf, n);
+  }
+
+  static void write_int64(std::string& out, int64_t v) {
+    const bool quote = v > int64_t(0xffffffff) || v < -int64_t(0xffffffff);
+    char buf[24];
+    const int n = std::snprintf(buf, sizeof(buf), quote ? "\"%lld\"" : "%lld", static_cast<long long>(v));
+    out.append(buf, n);
+  }
+
+  static void write_name(std::string& out, const chain::name& n) { write_string(out, n.to_string()); }
+
+  template<typename Hash>
+  static void write_checksum(std::string& out, const Hash& h) {
+    out += '"';
+    out += h.str();
+    out += '"';
+  }
+
+  static void write_hex(std::string& out, const std::vector<char>& data) {
+    out += '"';
+    out += fc::to_hex(data.data(), static_cast<uint32_t>(data.size()));
+    out += '"';
+  }
+
+  static void write_string(std::string& out, const std::string& s) {
+    static const char *hex = "0123456789abcdef";
+    out += '"';
+    for (const char c : s) {
+      switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+          if (static_cast<unsigned char>(c) < 0x20) {
+            out += "\\u00";
+            out += hex[(c >> 4) & 0xf];
+            out += hex[c & 0xf];
+          } else {
+            out += c;
+          }
+      }
+    }
+    out += '"';
+  }
+
+  uint32_t m_trace = kALL;
+  uint32_t m_action = kALL;
+  uint32_t m_receipt = kALL;
+};
+
+}  // namespace eosio
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef TRACE_SERIALIZER_HPP
+#define TRACE_SERIALIZER_HPP
+
+#include <eosio/kinesis_plugin/abi_cache.hpp>
+#include <eosio/kinesis_plugin/trace_projection.hpp>
+
+#include <eosio/chain/trace.hpp>
+#include <eosio/chain/types.hpp>
+
+#include <aws/core/utils/memory/stl/AWSString.h>
+#include <aws/core/utils/Array.h>
+
+#include <fc/io/json.hpp>
+#include <fc/io/raw.hpp>
+#include <fc/variant.hpp>
+#include <fc/variant_object.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace eosio {
+
+enum TransactionType {
+  APPLIED_TRANSACTION = 1,
+  ACCEPTED_TRANSACTION = 2,
+  BACKFILLED_TRANSACTION = 3,
+  ACCEPTED_BLOCK = 4,
+  IRREVERSIBLE_BLOCK = 5,
+  ACTION_BATCH = 6
+};
+
+enum class output_format {
+  json,
+  binary
+};
+
+enum class partition_strategy {
+  block,         // block number, keeps a block's traces on one shard
+  transaction,   // transaction id
+  account,       // receiver of the first action
+  explicit_hash  // transaction id, spread evenly over the open shards with explicit hash keys
+};
+
+// Layout of binary records, published for consumers as kinesis_trace.abi. Bump
+// binary_format_version whenever it changes.
+const uint8_t binary_format_version = 1;
+
+template<typename Stream>
+void pack_binary_trace(Stream& ds, TransactionType type, uint32_t block_number, uint64_t block_time,
+                       const chain::transaction_trace& trace, const fc::optional<std::string>& except,
+                       const trace_projection& projection) {
+  fc::raw::pack(ds, binary_format_version);
+  fc::raw::pack(ds, static_cast<uint8_t>(type));
+  fc::raw::pack(ds, block_number);
+  fc::raw::pack(ds, block_time);
+  // fc::exception carries variants that have no ABI equivalent, ship its text instead
+  projection.pack(ds, trace, except);
+}
+
+// Turns applied transaction traces into the data and partition keys of their records, as
+// configured by the kinesis-output-format, kinesis-partition-strategy, field and ABI decoding
+// options. Used by the plugin and by kinesis_pipeline_bench. Configure it before use; after
+// that it is read only and may be used from any number of threads.
+class trace_serializer {
+ public:
+  output_format format = output_format::json;
+  partition_strategy partitioning = partition_strategy::block;
+  // fields of the trace written to records
+  trace_projection projection;
+  // set when action data is decoded with the contracts' ABIs, owned by the caller
+  abi_cache *abis = nullptr;
+
+  std::string partition_key(uint32_t block_number, const chain::transaction_id_type& id,
+                            const chain::account_name *receiver) const {
+    switch (partitioning) {
+      case partition_strategy::transaction:
+      case partition_strategy::explicit_hash:
+        return id.str();
+      case partition_strategy::account:
+        if (receiver != nullptr) {
+          return receiver->to_string();
+        }
+        return id.str();
+      case partition_strategy::block:
+        break;
+    }
+    return std::to_string(block_number);
+  }
+
+  std::string partition_key(uint32_t block_number, const chain::transaction_trace& trace) const {
+    const auto& actions = trace.action_traces;
+    return partition_key(block_number, trace.id, actions.empty() ? nullptr : &actions.front().receipt.receiver);
+  }
+
+  // The record of an applied transaction trace.
+  Aws::Utils::ByteBuffer serialize(uint32_t block_number, fc::time_point block_time,
+                                   const chain::transaction_trace& trace) const {
+    const uint64_t time = block_time.time_since_epoch().count() / 1000;
+    if (format == output_format::binary) {
+      fc::optional<std::string> except;
+      if (trace.except) {
+        except = trace.except->to_string();
+      }
+      fc::datastream<size_t> ss;
+      pack_binary_trace(ss, APPLIED_TRANSACTION, block_number, time, trace, except, projection);
+      Aws::Utils::ByteBuffer data(ss.tellp());
+      fc::datastream<char *> ds(reinterpret_cast<char *>(data.GetUnderlyingData()), data.GetLength());
+      pack_binary_trace(ds, APPLIED_TRANSACTION, block_number, time, trace, except, projection);
+      return data;
+    }
+    std::string trace_json;
+    if (!projection.all()) {
+      trace_json.reserve(1024);
+      projection.write_json(trace_json, trace, [this](const chain::action& act) { return decode_action_data(act); });
+    } else if (abis) {
+      fc::variant v;
+      fc::to_variant(trace, v);
+      fc::mutable_variant_object object(v.get_object());
+      object("action_traces", decode_action_traces(trace.action_traces, object["action_traces"].get_array()));
+      trace_json = fc::json::to_string(fc::variant(std::move(object)));
+    } else {
+      trace_json = fc::json::to_string(trace);
+    }
+    // write the envelope around the trace straight into the record
+    char head[80];
+    const int head_size = std::snprintf(head, sizeof(head), "{\"block_number\":%u,\"block_time\":%llu,\"trace\":",
+                                        static_cast<unsigned>(block_number), static_cast<unsigned long long>(time));
+    Aws::Utils::ByteBuffer data(head_size + trace_json.size() + 1);
+    unsigned char *out = data.GetUnderlyingData();
+    std::memcpy(out, head, head_size);
+    std::memcpy(out + head_size, trace_json.data(), trace_json.size());
+    out[head_size + trace_json.size()] = '}';
+    return data;
+  }
+
+  // The action's data decoded with its contract's ABI, if ABI decoding is enabled and it matches.
+  fc::optional<fc::variant> decode_action_data(const chain::action& act) const {
+    if (!abis) {
+      return fc::optional<fc::variant>();
+    }
+    auto abi = abis->get(act.account);
+    if (abi) {
+      try {
+        const auto type = abi->get_action_type(act.name);
+        if (!type.empty()) {
+          return abi->binary_to_variant(type, act.data, abis->max_time());
+        }
+      } catch (fc::exception&) {
+        // data that does not match the ABI is sent as hex
+      }
+    }
+    return fc::optional<fc::variant>();
+  }
+
+  fc::variants decode_action_traces(const std::vector<chain::action_trace>& traces, fc::variants vs) const {
+    for (size_t i = 0; i < traces.size() && i < vs.size(); ++i) {
+      const auto& at = traces[i];
+      fc::mutable_variant_object v(vs[i].get_object());
+      auto data = decode_action_data(at.act);
+      if (data) {
+        fc::mutable_variant_object act(v["act"].get_object());
+        act("hex_data", act["data"]);
+        act("data", std::move(*data));
+        v("act", std::move(act));
+      }
+      v("inline_traces", decode_action_traces(at.inline_traces, v["inline_traces"].get_array()));
+      vs[i] = fc::variant(std::move(v));
+    }
+    return vs;
+  }
+};
+
+}  // namespace eosio
+
+#endif
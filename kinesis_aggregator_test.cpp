@@ -0,0 +1,178 @@
+// Round trip of KPL aggregated records: the records built by kinesis_aggregator are decoded
+// back (magic, protobuf tables and records, MD5 trailer) the way KCL de-aggregates them.
+#include "include/eosio/kinesis_plugin/kinesis_aggregator.hpp"
+#include "kinesis_test.hpp"
+
+#include <aws/core/Aws.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace eosio;
+
+struct user_record {
+  std::string partition_key;
+  std::string explicit_hash_key;
+  std::string data;
+};
+
+// Minimal protobuf reader, fails the test on malformed input.
+struct reader {
+  const unsigned char *p;
+  const unsigned char *end;
+
+  bool done() const { return p == end; }
+
+  uint64_t varint() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      CHECK(p < end);
+      const unsigned char b = *p++;
+      v |= uint64_t(b & 0x7f) << shift;
+      if ((b & 0x80) == 0) {
+        return v;
+      }
+    }
+    CHECK(false);
+    return 0;
+  }
+
+  reader bytes() {
+    const uint64_t n = varint();
+    CHECK(n <= static_cast<uint64_t>(end - p));
+    reader r{p, p + n};
+    p += n;
+    return r;
+  }
+
+  std::string string() {
+    const reader r = bytes();
+    return std::string(reinterpret_cast<const char *>(r.p), r.end - r.p);
+  }
+};
+
+static std::vector<user_record> decode(const Aws::Utils::ByteBuffer& record) {
+  const unsigned char *data = record.GetUnderlyingData();
+  const size_t size = record.GetLength();
+  CHECK(size >= kinesis_aggregator::kMAGIC_SIZE + kinesis_aggregator::kDIGEST_SIZE);
+  const unsigned char magic[] = {0xf3, 0x89, 0x9a, 0xc2};
+  CHECK(std::memcmp(data, magic, sizeof(magic)) == 0);
+
+  const unsigned char *body = data + kinesis_aggregator::kMAGIC_SIZE;
+  const size_t body_size = size - kinesis_aggregator::kMAGIC_SIZE - kinesis_aggregator::kDIGEST_SIZE;
+  const Aws::Utils::ByteBuffer digest =
+      Aws::Utils::HashingUtils::CalculateMD5(Aws::String(reinterpret_cast<const char *>(body), body_size));
+  CHECK(digest.GetLength() == kinesis_aggregator::kDIGEST_SIZE);
+  CHECK(std::memcmp(digest.GetUnderlyingData(), body + body_size, kinesis_aggregator::kDIGEST_SIZE) == 0);
+
+  std::vector<std::string> keys;
+  std::vector<std::string> hash_keys;
+  struct entry {
+    uint64_t key;
+    uint64_t hash_key;
+    std::string data;
+  };
+  std::vector<entry> entries;
+  reader in{body, body + body_size};
+  while (!in.done()) {
+    const uint64_t tag = in.varint();
+    CHECK((tag & 7) == 2);
+    if (tag >> 3 == 1) {
+      keys.push_back(in.string());
+    } else if (tag >> 3 == 2) {
+      hash_keys.push_back(in.string());
+    } else {
+      CHECK(tag >> 3 == 3);
+      reader r = in.bytes();
+      entry e{~uint64_t(0), ~uint64_t(0), std::string()};
+      bool has_data = false;
+      while (!r.done()) {
+        const uint64_t field = r.varint();
+        if (field == (1 << 3)) {
+          e.key = r.varint();
+        } else if (field == (2 << 3)) {
+          e.hash_key = r.varint();
+        } else {
+          CHECK(field == ((3 << 3) | 2));
+          e.data = r.string();
+          has_data = true;
+        }
+      }
+      CHECK(e.key != ~uint64_t(0));
+      CHECK(has_data);
+      entries.push_back(std::move(e));
+    }
+  }
+
+  std::vector<user_record> records;
+  for (const auto& e : entries) {
+    CHECK(e.key < keys.size());
+    CHECK(e.hash_key == ~uint64_t(0) || e.hash_key < hash_keys.size());
+    records.push_back(user_record{keys[e.key], e.hash_key == ~uint64_t(0) ? std::string() : hash_keys[e.hash_key],
+                                  e.data});
+  }
+  return records;
+}
+
+static void check_round_trip(const std::vector<user_record>& records) {
+  kinesis_aggregator aggregator(1024 * 1024);
+  size_t expected_size = 0;
+  for (const auto& r : records) {
+    CHECK(aggregator.fits(r.partition_key, r.explicit_hash_key, r.data.size()));
+    expected_size = aggregator.size_with(r.partition_key, r.explicit_hash_key, r.data.size());
+    aggregator.add(r.partition_key, r.explicit_hash_key, reinterpret_cast<const unsigned char *>(r.data.data()),
+                   r.data.size());
+  }
+  CHECK(aggregator.count() == records.size());
+  CHECK(aggregator.partition_key() == records.front().partition_key);
+  CHECK(aggregator.explicit_hash_key() == records.front().explicit_hash_key);
+  const std::string routing_key = aggregator.partition_key();
+
+  const Aws::Utils::ByteBuffer record = aggregator.build();
+  CHECK(aggregator.empty());
+  // the size estimate is exact, so max_bytes is never exceeded
+  CHECK(record.GetLength() + routing_key.size() == expected_size);
+
+  const std::vector<user_record> decoded = decode(record);
+  CHECK(decoded.size() == records.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    CHECK(decoded[i].partition_key == records[i].partition_key);
+    CHECK(decoded[i].explicit_hash_key == records[i].explicit_hash_key);
+    CHECK(decoded[i].data == records[i].data);
+  }
+}
+
+int main() {
+  Aws::SDKOptions options;
+  Aws::InitAPI(options);
+
+  // repeated and distinct partition keys, records larger than a single varint byte
+  std::vector<user_record> plain;
+  for (int i = 0; i < 300; ++i) {
+    plain.push_back(user_record{"key-" + std::to_string(i % 7), std::string(), std::string(i, static_cast<char>(i))});
+  }
+  check_round_trip(plain);
+
+  // explicit hash keys, as with explicit-hash partitioning, mixed with records without one
+  std::vector<user_record> hashed;
+  for (int i = 0; i < 50; ++i) {
+    hashed.push_back(user_record{std::to_string(i), i % 3 == 0 ? std::string() : "8507059173023461586584365185794205286" +
+                                                                                   std::to_string(i % 2),
+                                 "payload " + std::to_string(i)});
+  }
+  check_round_trip(hashed);
+
+  // a full aggregate does not take the record that would push it over max_bytes
+  kinesis_aggregator small(256);
+  const std::string data(100, 'x');
+  small.add("k", std::string(), reinterpret_cast<const unsigned char *>(data.data()), data.size());
+  CHECK(small.fits("k", std::string(), data.size()));
+  small.add("k", std::string(), reinterpret_cast<const unsigned char *>(data.data()), data.size());
+  CHECK(!small.fits("k", std::string(), data.size()));
+
+  Aws::ShutdownAPI(options);
+  std::printf("kinesis_aggregator_test passed\n");
+  return 0;
+}
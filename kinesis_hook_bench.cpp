@@ -0,0 +1,211 @@
+// Chain-thread cost of kinesis_plugin's applied_transaction hook: the entry written into
+// a preallocated ring slot in place, as the plugin does, versus built on the stack and
+// copied in, as it did before. A consumer thread drains the ring meanwhile. Reports the
+// nanoseconds and heap allocations per transaction on the chain thread, and exits with 1
+// if the pooled hook takes more than budget_ns per transaction on average.
+//
+//   kinesis_hook_bench [transactions] [queue_size] [budget_ns]
+#include <eosio/kinesis_plugin/kinesis_metrics.hpp>
+#include <eosio/kinesis_plugin/spsc_ring.hpp>
+
+#include <boost/chrono.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace {
+
+// heap allocations made by the thread running the hook
+thread_local bool count_allocations = false;
+thread_local uint64_t allocations = 0;
+
+// Out of line, or GCC inlines the deletes into callers of new and warns that free gets
+// a pointer from operator new (-Wmismatched-new-delete).
+__attribute__((noinline)) void release(void *p) noexcept { std::free(p); }
+
+}  // namespace
+
+// The plain, array and sized forms all go through the counting new and through free, so
+// no allocation escapes the count (the nothrow forms call these).
+void *operator new(size_t size) {
+  if (count_allocations) {
+    ++allocations;
+  }
+  if (void *p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) { return ::operator new(size); }
+
+void operator delete(void *p) noexcept { release(p); }
+
+void operator delete(void *p, size_t) noexcept { release(p); }
+
+void operator delete[](void *p) noexcept { release(p); }
+
+void operator delete[](void *p, size_t) noexcept { release(p); }
+
+namespace {
+
+using bench_clock = std::chrono::steady_clock;
+
+// stand-ins for the controller's trace and pending block state
+struct trace {
+  char body[512];
+};
+using trace_ptr = std::shared_ptr<trace>;
+
+struct pending_block {
+  uint32_t block_num = 1000;
+  int64_t timestamp = 1546300800000000;
+};
+
+// the layout of kinesis_plugin_impl::trasaction_info_st
+struct entry {
+  uint64_t block_number;
+  int64_t block_time;
+  trace_ptr trace;
+  bench_clock::time_point enqueued;
+};
+
+struct hook {
+  eosio::spsc_ring<entry> ring;
+  boost::mutex mtx;
+  boost::condition_variable condition;
+  std::atomic<bool> consumer_waiting{false};
+  std::atomic<bool> done{false};
+  eosio::latency_histogram signal_to_enqueue;
+  pending_block pending;
+  uint32_t calls = 0;
+  uint32_t unnotified = 0;
+
+  explicit hook(size_t size) : ring(size, eosio::overflow_policy::block, std::chrono::milliseconds(1000)) {}
+
+  void notify() {
+    if (consumer_waiting.load()) {
+      boost::mutex::scoped_lock lock(mtx);
+      condition.notify_one();
+    }
+  }
+
+  void sample(bench_clock::time_point start) {
+    if ((++calls & 15) == 0) {
+      signal_to_enqueue.record(bench_clock::now() - start);
+    }
+  }
+
+  // what applied_transaction does now: the consumer polls, it is only woken up for a backlog
+  void pooled(const trace_ptr& t) {
+    const auto start = bench_clock::now();
+    ring.push_with([&](entry& slot) {
+      slot.block_number = pending.block_num;
+      slot.block_time = pending.timestamp;
+      slot.trace = t;
+      slot.enqueued = start;
+    });
+    if (++unnotified >= 64) {
+      unnotified = 0;
+      notify();
+    }
+    sample(start);
+  }
+
+  // what it did before: a local entry copied into the queue, waking up the consumer
+  void copied(const trace_ptr& t) {
+    const auto start = bench_clock::now();
+    entry e = entry{pending.block_num, pending.timestamp, trace_ptr(t), start};
+    ring.push(e);
+    notify();
+    sample(start);
+  }
+
+  void consume() {
+    while (true) {
+      {
+        boost::mutex::scoped_lock lock(mtx);
+        consumer_waiting = true;
+        if (ring.empty() && !done) {
+          condition.wait_for(lock, boost::chrono::milliseconds(10));
+        }
+        consumer_waiting = false;
+      }
+      const bool finished = done;
+      const size_t processed = ring.consume_all([](entry&) {});
+      if (processed == 0 && finished) {
+        break;
+      }
+    }
+  }
+
+  void finish() {
+    done = true;
+    boost::mutex::scoped_lock lock(mtx);
+    condition.notify_one();
+  }
+};
+
+// Traces are created in small batches right before the hook runs on them, as nodeos
+// creates each trace right before the signal, so they are still in cache; only the
+// hook calls are timed.
+template<typename F>
+double run(const char *name, size_t transactions, size_t queue_size, F call) {
+  const size_t kBATCH = 256;
+  hook h(queue_size);
+  boost::thread consumer([&h] { h.consume(); });
+
+  std::vector<trace_ptr> batch;
+  batch.reserve(kBATCH);
+  bench_clock::duration elapsed{};
+  uint64_t hook_allocations = 0;
+  for (size_t done = 0; done < transactions; done += kBATCH) {
+    for (size_t i = 0; i < kBATCH; ++i) {
+      batch.push_back(std::make_shared<trace>());
+    }
+    allocations = 0;
+    count_allocations = true;
+    const auto begin = bench_clock::now();
+    for (const auto& t : batch) {
+      call(h, t);
+    }
+    elapsed += bench_clock::now() - begin;
+    count_allocations = false;
+    hook_allocations += allocations;
+    batch.clear();
+  }
+
+  h.finish();
+  consumer.join();
+
+  const size_t calls = (transactions + kBATCH - 1) / kBATCH * kBATCH;
+  const double ns = std::chrono::duration<double, std::nano>(elapsed).count() / calls;
+  std::printf("%-7s %8.1f ns/trx  %6.3f allocations/trx  sampled p99 %llu us\n", name, ns,
+              double(hook_allocations) / calls, (unsigned long long)h.signal_to_enqueue.quantile(0.99));
+  return ns;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const size_t transactions = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 2000000;
+  const size_t queue_size = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 16384;
+  const double budget_ns = argc > 3 ? std::strtod(argv[3], nullptr) : 200;
+
+  std::printf("transactions %zu, queue size %zu, budget %.0f ns/trx\n", transactions, queue_size, budget_ns);
+  run("copied", transactions, queue_size, [](hook& h, const trace_ptr& t) { h.copied(t); });
+  const double pooled = run("pooled", transactions, queue_size, [](hook& h, const trace_ptr& t) { h.pooled(t); });
+  if (pooled > budget_ns) {
+    std::printf("pooled hook over budget: %.1f > %.0f ns/trx\n", pooled, budget_ns);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,390 @@
+// End-to-end throughput of the kinesis_plugin pipeline, without nodeos or AWS.
+//
+// Synthetic transaction traces go through the same stages as in the plugin: an
+// spsc_ring filled by the "chain thread", a consume thread handing them to an
+// ordered_worker_pool that serializes them with the plugin's trace_serializer, and kinesis_producer, which
+// talks to an in-process HTTP stand-in for Kinesis (PutRecord/PutRecords/ListShards)
+// that can add latency and reject a share of the records as throttled.
+//
+//   kinesis_pipeline_bench [traces] [actions] [inline_actions] [payload_bytes]
+//                          [latency_ms] [throttle_percent] [serialization_threads] [json|binary]
+#include <eosio/kinesis_plugin/kinesis_metrics.hpp>
+#include <eosio/kinesis_plugin/kinesis_producer.hpp>
+#include <eosio/kinesis_plugin/ordered_worker_pool.hpp>
+#include <eosio/kinesis_plugin/spsc_ring.hpp>
+#include <eosio/kinesis_plugin/trace_serializer.hpp>
+
+#include <eosio/chain/trace.hpp>
+#include <eosio/chain/types.hpp>
+
+#include <fc/crypto/sha256.hpp>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace eosio;
+using bench_clock = std::chrono::steady_clock;
+
+// Minimal HTTP/1.1 server answering the Kinesis JSON protocol (X-Amz-Target header).
+// Requests are not authenticated and record data is not decoded.
+class kinesis_stand_in {
+ public:
+  kinesis_stand_in(uint32_t latency_ms, uint32_t throttle_percent)
+      : m_latency(latency_ms), m_throttlePercent(throttle_percent) {
+    m_listen = ::socket(AF_INET, SOCK_STREAM, 0);
+    const int one = 1;
+    ::setsockopt(m_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t len = sizeof(addr);
+    if (::bind(m_listen, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || ::listen(m_listen, 64) != 0 ||
+        ::getsockname(m_listen, reinterpret_cast<sockaddr *>(&addr), &len) != 0) {
+      std::perror("kinesis stand-in");
+      std::exit(1);
+    }
+    m_port = ntohs(addr.sin_port);
+    m_acceptor = std::thread([this] { accept_loop(); });
+  }
+
+  ~kinesis_stand_in() {
+    m_stopping = true;
+    ::shutdown(m_listen, SHUT_RDWR);
+    ::close(m_listen);
+    m_acceptor.join();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (int fd : m_connections) {
+      ::shutdown(fd, SHUT_RDWR);
+    }
+    for (auto& t : m_workers) {
+      t.join();
+    }
+  }
+
+  uint16_t port() const { return m_port; }
+  uint64_t requests() const { return m_requests.load(); }
+  uint64_t throttled() const { return m_throttled.load(); }
+
+ private:
+  void accept_loop() {
+    while (!m_stopping) {
+      const int fd = ::accept(m_listen, nullptr, nullptr);
+      if (fd < 0) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_connections.push_back(fd);
+      m_workers.emplace_back([this, fd] { serve(fd); });
+    }
+  }
+
+  static std::string header(const std::string& head, const char *name) {
+    const std::string key = std::string("\r\n") + name + ":";
+    auto itr = std::search(head.begin(), head.end(), key.begin(), key.end(),
+                           [](char a, char b) { return std::tolower(a) == std::tolower(b); });
+    if (itr == head.end()) {
+      return std::string();
+    }
+    size_t begin = (itr - head.begin()) + key.size();
+    const size_t end = head.find("\r\n", begin);
+    while (begin < end && head[begin] == ' ') {
+      ++begin;
+    }
+    return head.substr(begin, end - begin);
+  }
+
+  void serve(int fd) {
+    std::string in;
+    char buf[64 * 1024];
+    while (true) {
+      size_t head_end;
+      while ((head_end = in.find("\r\n\r\n")) == std::string::npos) {
+        const ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+          ::close(fd);
+          return;
+        }
+        in.append(buf, n);
+      }
+      const std::string head = in.substr(0, head_end + 2);
+      const size_t length = std::strtoull(header(head, "Content-Length").c_str(), nullptr, 10);
+      if (header(head, "Expect") == "100-continue" && in.size() < head_end + 4 + length) {
+        send_all(fd, "HTTP/1.1 100 Continue\r\n\r\n");
+      }
+      while (in.size() < head_end + 4 + length) {
+        const ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+          ::close(fd);
+          return;
+        }
+        in.append(buf, n);
+      }
+      const std::string body = in.substr(head_end + 4, length);
+      in.erase(0, head_end + 4 + length);
+
+      std::this_thread::sleep_for(m_latency);
+      const std::string target = header(head, "X-Amz-Target");
+      const std::string operation = target.substr(target.find('.') + 1);
+      int status = 200;
+      std::string response;
+      if (operation == "PutRecords") {
+        response = put_records(body);
+      } else if (operation == "PutRecord") {
+        response = "{\"SequenceNumber\":\"" + std::to_string(++m_sequence) + "\",\"ShardId\":\"shardId-000000000000\"}";
+      } else if (operation == "ListShards") {
+        response = "{\"Shards\":[{\"ShardId\":\"shardId-000000000000\",\"HashKeyRange\":{\"StartingHashKey\":\"0\","
+                   "\"EndingHashKey\":\"340282366920938463463374607431768211455\"},"
+                   "\"SequenceNumberRange\":{\"StartingSequenceNumber\":\"0\"}}]}";
+      } else {
+        status = 400;
+        response = "{\"__type\":\"UnknownOperationException\",\"message\":\"" + operation + "\"}";
+      }
+      ++m_requests;
+      send_all(fd, "HTTP/1.1 " + std::to_string(status) + (status == 200 ? " OK" : " Bad Request") +
+                       "\r\nContent-Type: application/x-amz-json-1.1\r\nx-amzn-RequestId: bench\r\nContent-Length: " +
+                       std::to_string(response.size()) + "\r\n\r\n" + response);
+    }
+  }
+
+  std::string put_records(const std::string& body) {
+    static const std::string key = "\"PartitionKey\"";
+    std::string records;
+    size_t failed = 0;
+    for (size_t pos = body.find(key); pos != std::string::npos; pos = body.find(key, pos + key.size())) {
+      if (!records.empty()) {
+        records += ',';
+      }
+      if (m_throttlePercent > 0 && m_random() % 100 < m_throttlePercent) {
+        ++failed;
+        records += "{\"ErrorCode\":\"ProvisionedThroughputExceededException\",\"ErrorMessage\":\"Rate exceeded\"}";
+      } else {
+        records += "{\"SequenceNumber\":\"" + std::to_string(++m_sequence) +
+                   "\",\"ShardId\":\"shardId-000000000000\"}";
+      }
+    }
+    m_throttled += failed;
+    return "{\"FailedRecordCount\":" + std::to_string(failed) + ",\"Records\":[" + records + "]}";
+  }
+
+  static void send_all(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+      const ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0) {
+        return;
+      }
+      sent += n;
+    }
+  }
+
+  const std::chrono::milliseconds m_latency;
+  const uint32_t m_throttlePercent;
+  int m_listen;
+  uint16_t m_port;
+  std::atomic<bool> m_stopping{false};
+  std::thread m_acceptor;
+  std::mutex m_mutex;
+  std::vector<int> m_connections;
+  std::vector<std::thread> m_workers;
+  std::atomic<uint64_t> m_sequence{0};
+  std::atomic<uint64_t> m_requests{0};
+  std::atomic<uint64_t> m_throttled{0};
+  static thread_local std::minstd_rand m_random;
+};
+
+thread_local std::minstd_rand kinesis_stand_in::m_random{42};
+
+// Traces shaped like mainnet dapp traffic: a few accounts, transfer-like actions with
+// authorizations, random payloads and inline notifications.
+class trace_generator {
+ public:
+  trace_generator(size_t actions, size_t inline_actions, size_t payload_bytes)
+      : m_actions(actions), m_inlineActions(inline_actions), m_payloadBytes(payload_bytes) {}
+
+  chain::transaction_trace_ptr make(uint64_t seq) {
+    static const chain::account_name accounts[] = {N(eosio.token), N(eosbetdice11), N(pptqipaelyog),
+                                                   N(betdicetasks), N(whaleextrust)};
+    auto t = std::make_shared<chain::transaction_trace>();
+    t->id = fc::sha256::hash(std::to_string(seq));
+    t->receipt = chain::transaction_receipt_header(chain::transaction_receipt_header::executed);
+    t->receipt->cpu_usage_us = 200 + m_random() % 800;
+    t->receipt->net_usage_words = 16 + m_random() % 32;
+    t->elapsed = fc::microseconds(100 + m_random() % 900);
+    t->net_usage = t->receipt->net_usage_words * 8;
+    for (size_t a = 0; a < m_actions; ++a) {
+      const auto account = accounts[m_random() % 5];
+      auto at = make_action(t->id, account, account, seq);
+      for (size_t i = 0; i < m_inlineActions; ++i) {
+        at.inline_traces.push_back(make_action(t->id, accounts[m_random() % 5], account, seq));
+      }
+      t->action_traces.push_back(std::move(at));
+    }
+    return t;
+  }
+
+ private:
+  chain::action_trace make_action(const chain::transaction_id_type& id, chain::account_name receiver,
+                                  chain::account_name account, uint64_t seq) {
+    chain::action_trace at;
+    at.receipt.receiver = receiver;
+    at.receipt.global_sequence = seq;
+    at.receipt.recv_sequence = seq;
+    at.receipt.act_digest = fc::sha256::hash(std::to_string(m_random()));
+    at.act.account = account;
+    at.act.name = N(transfer);
+    at.act.authorization.push_back(chain::permission_level{account, N(active)});
+    at.act.data.resize(m_payloadBytes);
+    for (auto& c : at.act.data) {
+      c = static_cast<char>(m_random());
+    }
+    at.elapsed = fc::microseconds(10 + m_random() % 90);
+    at.trx_id = id;
+    at.block_num = static_cast<uint32_t>(seq / 100);
+    return at;
+  }
+
+  const size_t m_actions;
+  const size_t m_inlineActions;
+  const size_t m_payloadBytes;
+  std::mt19937_64 m_random{7};
+};
+
+struct bench_item {
+  uint64_t seq;
+  chain::transaction_trace_ptr trace;
+};
+
+struct bench_payload {
+  uint64_t seq;
+  std::string partition_key;
+  Aws::Utils::ByteBuffer data;
+};
+
+// A hundred traces per block, the sequence number doubles as the block time in milliseconds.
+bench_payload serialize(const trace_serializer& records, const bench_item& item) {
+  const uint32_t block_number = item.seq / 100;
+  return bench_payload{item.seq, records.partition_key(block_number, *item.trace),
+                       records.serialize(block_number, fc::time_point(fc::milliseconds(item.seq)), *item.trace)};
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const size_t traces = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 200000;
+  const size_t actions = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 2;
+  const size_t inline_actions = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 2;
+  const size_t payload_bytes = argc > 4 ? std::strtoull(argv[4], nullptr, 10) : 64;
+  const uint32_t latency_ms = argc > 5 ? std::strtoul(argv[5], nullptr, 10) : 20;
+  const uint32_t throttle_percent = argc > 6 ? std::strtoul(argv[6], nullptr, 10) : 0;
+  const size_t threads = argc > 7 ? std::strtoull(argv[7], nullptr, 10) : 2;
+  const bool binary = argc > 8 && std::strcmp(argv[8], "binary") == 0;
+
+  std::printf("traces %zu, actions %zu (+%zu inline each), payload %zu bytes, latency %u ms, throttle %u%%, "
+              "serialization threads %zu, %s\n",
+              traces, actions, inline_actions, payload_bytes, latency_ms, throttle_percent, threads,
+              binary ? "binary" : "json");
+
+  trace_serializer records;
+  records.format = binary ? output_format::binary : output_format::json;
+
+  // Generating traces is not what is being measured, cycle through a pool of them.
+  trace_generator generator(actions, inline_actions, payload_bytes);
+  std::vector<chain::transaction_trace_ptr> pool;
+  for (size_t i = 0; i < std::min<size_t>(traces, 4096); ++i) {
+    pool.push_back(generator.make(i));
+  }
+
+  kinesis_stand_in stand_in(latency_ms, throttle_percent);
+  ::setenv("AWS_ACCESS_KEY_ID", "bench", 1);
+  ::setenv("AWS_SECRET_ACCESS_KEY", "bench", 1);
+  ::setenv("AWS_EC2_METADATA_DISABLED", "true", 1);
+
+  auto metrics = std::make_shared<kinesis_metrics>();
+  latency_histogram end_to_end;
+  std::vector<bench_clock::time_point> enqueued(traces);
+
+  kinesis_producer producer;
+  producer.kinesis_set_endpoint("http://127.0.0.1:" + std::to_string(stand_in.port()));
+  producer.kinesis_set_shard_refresh(0);
+  producer.kinesis_set_metrics(metrics);
+  producer.kinesis_set_completion_callback([&](const std::vector<kinesis_ack>& acks) {
+    const auto now = bench_clock::now();
+    for (const auto& a : acks) {
+      if (a.ok) {
+        end_to_end.record(now - enqueued[a.tag]);
+      }
+    }
+  });
+  producer.kinesis_init("bench", "us-east-1");
+
+  spsc_ring<bench_item> ring(16384, overflow_policy::block, std::chrono::milliseconds(1000));
+  std::atomic<bool> done{false};
+  std::atomic<uint64_t> bytes{0};
+
+  ordered_worker_pool<bench_payload> serializer(
+      threads, std::max<size_t>(1, threads) * 64,
+      [&](bench_payload& p) {
+        bytes += p.data.GetLength();
+        producer.kinesis_sendmsg(1, p.partition_key, std::move(p.data), p.seq);
+      },
+      [] {});
+
+  const auto start = bench_clock::now();
+  std::thread consumer([&] {
+    while (true) {
+      const bool finished = done.load();
+      const size_t n = ring.consume_all([&](const bench_item& item) {
+        serializer.submit([&records, item]() { return serialize(records, item); });
+      });
+      serializer.emit_ready();
+      producer.kinesis_poll();
+      if (n == 0) {
+        if (finished) {
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    }
+    serializer.drain();
+    producer.kinesis_flush();
+  });
+
+  for (size_t i = 0; i < traces; ++i) {
+    enqueued[i] = bench_clock::now();
+    ring.push(bench_item{i, pool[i % pool.size()]});
+  }
+  done = true;
+  consumer.join();
+  producer.kinesis_destory();
+  const double seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+
+  std::printf("traces/s %12.0f  MB/s %8.2f  records ok %llu failed %llu  requests %llu\n", traces / seconds,
+              bytes.load() / seconds / 1e6, static_cast<unsigned long long>(metrics->records_sent.value()),
+              static_cast<unsigned long long>(metrics->records_failed.value()),
+              static_cast<unsigned long long>(stand_in.requests()));
+  std::printf("end to end  p50 %8llu us  p99 %8llu us  p99.9 %8llu us\n",
+              static_cast<unsigned long long>(end_to_end.quantile(0.5)),
+              static_cast<unsigned long long>(end_to_end.quantile(0.99)),
+              static_cast<unsigned long long>(end_to_end.quantile(0.999)));
+  std::printf("%s\n", metrics->summary().c_str());
+  return 0;
+}
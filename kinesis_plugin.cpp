@@ -4,27 +4,63 @@
  */
 //
 #include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <eosio/kinesis_plugin/kinesis_producer.hpp>
 #include <eosio/kinesis_plugin/kinesis_plugin.hpp>
-
+#include <eosio/kinesis_plugin/abi_cache.hpp>
+#include <eosio/kinesis_plugin/ack_tracker.hpp>
+#include <eosio/kinesis_plugin/action_columns.hpp>
+#include <eosio/kinesis_plugin/action_filter.hpp>
+#include <eosio/kinesis_plugin/block_log_reader.hpp>
+#include <eosio/kinesis_plugin/delivery_checkpoint.hpp>
+#include <eosio/kinesis_plugin/file_io.hpp>
+#include <eosio/kinesis_plugin/fingerprint_index.hpp>
+#include <eosio/kinesis_plugin/kinesis_metrics.hpp>
+#include <eosio/kinesis_plugin/memory_budget.hpp>
+#include <eosio/kinesis_plugin/ordered_worker_pool.hpp>
+#include <eosio/kinesis_plugin/spill_log.hpp>
+#include <eosio/kinesis_plugin/spsc_ring.hpp>
+#include <eosio/kinesis_plugin/trace_projection.hpp>
+#include <eosio/kinesis_plugin/trace_serializer.hpp>
+
+#include <eosio/chain/account_object.hpp>
+#include <eosio/chain/contract_types.hpp>
 #include <eosio/chain/eosio_contract.hpp>
 #include <eosio/chain/config.hpp>
 #include <eosio/chain/exceptions.hpp>
+#include <eosio/chain/trace.hpp>
 #include <eosio/chain/transaction.hpp>
 #include <eosio/chain/types.hpp>
+#include <eosio/http_plugin/http_plugin.hpp>
 
 #include <fc/io/json.hpp>
+#include <fc/io/raw.hpp>
 #include <fc/utf8.hpp>
 #include <fc/variant.hpp>
+#include <fc/variant_object.hpp>
 
+#include <boost/algorithm/string.hpp>
 #include <boost/chrono.hpp>
 #include <boost/signals2/connection.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition_variable.hpp>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <map>
+#include <mutex>
 #include <queue>
+#include <set>
+#include <sstream>
 #include <string>
+#include <tuple>
+#include <unordered_map>
 
 namespace fc { class variant; }
 
@@ -40,9 +76,9 @@ using chain::signed_block;
 using chain::transaction_id_type;
 using chain::packed_transaction;
 
-enum TransactionType {
-    APPLIED_TRANSACTION = 1,
-    ACCEPTED_TRANSACTION = 2
+enum class block_content {
+    header,         // id, previous, producer, transaction count and last irreversible block
+    full            // the header fields and the signed block with its transaction receipts
 };
 
 static appbase::abstract_plugin& _kinesis_plugin = app().register_plugin<kinesis_plugin>();
@@ -63,6 +99,7 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
             uint64_t block_number;
             fc::time_point block_time;
             chain::transaction_trace_ptr trace;
+            std::chrono::steady_clock::time_point enqueued;
         };
 
         void consume_blocks();
@@ -75,14 +112,142 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
 
         void applied_transaction(const chain::transaction_trace_ptr &);
 
-        void process_accepted_transaction(const chain::transaction_metadata_ptr &);
+        // kinesis-speculative-traces=final, on the chain thread: true if the trace was held back
+        bool hold_speculative_trace(bool speculative, const block_id_type &parent, trasaction_info_st &);
+
+        void release_speculative_traces(const chain::block_state &);
 
-        void _process_accepted_transaction(const chain::transaction_metadata_ptr &);
+        void drop_speculative_traces();
 
         void process_applied_transaction(const trasaction_info_st &);
 
         void _process_applied_transaction(const trasaction_info_st &);
 
+        void submit_applied_transaction(const trasaction_info_st &);
+
+        // columnar action batches, on consume_thread
+        void add_action_rows(const trasaction_info_st &);
+
+        void end_action_block(uint32_t block_num);
+
+        void flush_action_batch();
+
+        // serialized record, produced on a serialization worker and sent from consume_thread; data is
+        // the buffer the producer sends, serialized in place and handed over without copying. A
+        // block_end entry carries no record and marks that all records of block_number came before it.
+        struct payload_st {
+            TransactionType trxtype;
+            std::string partition_key;
+            Aws::Utils::ByteBuffer data;
+            fc::time_point block_time;
+            uint32_t block_number;
+            bool block_end = false;
+            // bit i set if the record is also sent to routes[i]
+            uint32_t routes = 0;
+        };
+
+        std::string partition_key(const trasaction_info_st &) const;
+
+        std::string partition_key(uint32_t block_number, const transaction_id_type &id,
+                                  const account_name *receiver) const;
+
+        payload_st serialize_applied_transaction(const trasaction_info_st &) const;
+
+        void send_payload(payload_st &);
+
+        void mark_block_end(uint32_t block_num);
+
+        void update_checkpoint(bool flush);
+
+        static std::vector<chain::setabi> abi_updates(const chain::transaction_trace &);
+
+        void update_abis(const trasaction_info_st &);
+
+        void drop_forked_abis(const chain::block_state &);
+
+        fc::optional<chain::abi_def> load_abi(const account_name &);
+
+        void emit_serialized(bool drain);
+
+        void notify_consumer();
+
+        std::string prometheus_metrics() const;
+
+        void log_metrics();
+
+        void send_spilled();
+
+        void on_acks(const std::vector<kinesis_ack> &);
+
+        // backfill: blocks.log ranges split into chunks, each sent by one worker with its own producer
+        struct backfill_chunk_st {
+            uint32_t first;
+            uint32_t last;
+        };
+        struct backfill_progress_st;
+
+        void backfill();
+
+        void backfill_chunk(kinesis_producer &, backfill_progress_st &, const backfill_chunk_st &);
+
+        uint64_t send_backfilled_block(kinesis_producer &, uint32_t block_num, uint64_t seq);
+
+        payload_st serialize_backfilled_transaction(uint32_t block_number, fc::time_point block_time,
+                                                    const chain::transaction_receipt &) const;
+
+        // event types other than applied transactions, each sent by its own thread and producer
+        // without waiting for the others
+        template<typename Entry>
+        struct event_pipeline_st {
+            std::string name;
+            // nice value of the pipeline's thread
+            int priority = 0;
+            std::unique_ptr<spsc_ring<Entry>> queue;
+            kinesis_producer_ptr producer;
+            // only used to park the thread while the queue is empty
+            boost::mutex mtx;
+            boost::condition_variable condition;
+            boost::atomic<bool> consumer_waiting{false};
+            boost::thread thread;
+        };
+        struct accepted_transaction_st {
+            chain::transaction_metadata_ptr trx;
+            uint32_t block_number;
+            fc::time_point block_time;
+        };
+        // what block records need from a block_state, taken on the main thread so queued events do not
+        // keep block states alive; block is only set with block_content::full
+        struct block_event_st {
+            block_id_type id;
+            block_id_type previous;
+            uint32_t block_number;
+            fc::time_point block_time;
+            account_name producer;
+            uint32_t transaction_count;
+            uint32_t last_irreversible_block;
+            chain::signed_block_ptr block;
+        };
+
+        block_event_st block_event(const chain::block_state &) const;
+
+        template<typename Entry, typename F>
+        void run_pipeline(event_pipeline_st<Entry> &, F process);
+
+        // creates the pipeline's queue and producer; its thread is started by init()
+        template<typename Entry>
+        void enable_pipeline(std::unique_ptr<event_pipeline_st<Entry>> &, const std::string &name,
+                             const std::string &stream, int priority, kinesis_producer::completion_callback);
+
+        template<typename Entry>
+        void stop_pipeline(event_pipeline_st<Entry> *);
+
+        template<typename Entry>
+        void send_event(event_pipeline_st<Entry> &, payload_st);
+
+        payload_st serialize_accepted_transaction(const accepted_transaction_st &) const;
+
+        payload_st serialize_block(TransactionType, const block_event_st &) const;
+
         void process_accepted_block(const chain::block_state_ptr &);
 
         void _process_accepted_block(const chain::block_state_ptr &);
@@ -91,24 +256,127 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
 
         void _process_irreversible_block(const chain::block_state_ptr &);
 
+        // kinesis-route: trace records matching a route's rules are also sent to its stream, through its own
+        // queue, thread and producer. The route records queued or in flight share route_budget, of which each
+        // route holds at most route_cap bytes; what does not fit is dropped for that route only. Records are
+        // tagged with their size, released once acknowledged.
+        struct route_st {
+            std::string stream;
+            action_filter rules;
+            std::unique_ptr<event_pipeline_st<payload_st>> pipeline;
+            std::atomic<size_t> held{0};
+        };
+        static const size_t kMAX_ROUTES = 32;
+
+        uint32_t route_mask(const chain::transaction_trace &) const;
+
+        void route_payload(const payload_st &);
+
+        void send_routed(route_st &, payload_st &);
+
+        size_t consume_applied_transactions();
+
+        size_t consume_accepted_blocks();
+
         void init();
 
         bool configured{false};
 
+        // evaluated on consume_thread, before a trace is buffered or serialized
+        action_filter filter;
+
+        // format, partition keys and fields of trace records; trace_records.abis is abis
+        trace_serializer trace_records;
+
+        // set when action data is decoded with the contracts' ABIs
+        std::unique_ptr<abi_cache> abis;
+        // without irreversible_only: accounts whose ABI was replaced by a setabi of a reversible block, by
+        // block number, and the last accepted block, to reload them when their block is forked out
+        std::map<uint32_t, std::vector<account_name>> reversible_abi_updates;
+        block_id_type last_accepted_block;
+        // with irreversible_only: accounts whose ABI was replaced by a setabi of a block not sent yet, by block
+        // number. The head state already holds their new ABI, so load_abi does not read them from it. Filled
+        // on the main thread, emptied on consume_thread as blocks are sent.
+        std::mutex pending_abi_mtx;
+        std::map<uint32_t, std::vector<account_name>> pending_abi_updates;
+        // how long an ABI that could not be loaded is sent as hex before it is loaded again
+        const fc::microseconds abi_retry_after = fc::seconds(5);
+
         uint32_t start_block_num = 0;
         bool start_block_reached = false;
 
-        size_t queue_size = 10000;
-        std::deque<chain::transaction_metadata_ptr> transaction_metadata_queue;
-        std::deque<chain::transaction_metadata_ptr> transaction_metadata_process_queue;
-        std::deque<trasaction_info_st> transaction_trace_queue;
-        std::deque<trasaction_info_st> transaction_trace_process_queue;
-        std::deque<chain::block_state_ptr> block_state_queue;
-        std::deque<chain::block_state_ptr> block_state_process_queue;
-        std::deque<chain::block_state_ptr> irreversible_block_state_queue;
-        std::deque<chain::block_state_ptr> irreversible_block_state_process_queue;
+        // kinesis-speculative-traces=final: speculative executions in the pending block are held on the
+        // chain thread, the last one of each transaction replacing the earlier ones, until the block is
+        // accepted; those of transactions in the block are queued then, the others dropped as superseded
+        std::unique_ptr<fingerprint_index> speculative_index;
+        // held executions by (transaction, pending block), found through speculative_index; the id is kept
+        // to tell fingerprint collisions apart once the trace has been moved out
+        struct speculative_trace_st {
+            transaction_id_type id;
+            trasaction_info_st t;
+        };
+        std::vector<speculative_trace_st> speculative_traces;
+        block_id_type speculative_parent;
+
+        // kinesis-actions-dir/kinesis-actions-stream: the actions of the traces sent, flattened into columnar
+        // batches (see action_columns.hpp) of aligned ranges of action_batch_blocks blocks, appended to files
+        // of action_file_blocks blocks and/or sent as records; null if neither is enabled
+        std::unique_ptr<action_batch_writer> action_batches;
+        action_row action_batch_row;
+        bfs::path action_batch_dir;
+        bool action_batches_to_stream = false;
+        uint32_t action_batch_blocks = 100;
+        uint32_t action_file_blocks = 10000;
+        // block_num / action_batch_blocks of the batch's rows, and the time of its last block
+        uint32_t action_batch_range = 0;
+        fc::time_point action_batch_time;
+        std::ofstream action_file;
+        bfs::path action_file_path;
+        // batches sent as records are closed early beyond this size, well below the 1 MiB record limit
+        static const size_t kMAX_ACTION_BATCH_RECORD = 512 * 1024;
+
+        // irreversible-only mode: traces are held back until their block becomes irreversible
+        bool irreversible_only = false;
+        struct block_traces_st {
+            block_id_type id;
+            std::vector<trasaction_info_st> traces;
+        };
+        // traces of blocks not accepted yet (including speculative and aborted ones), by block number
+        std::map<uint32_t, std::vector<trasaction_info_st>> unaccepted_traces;
+        // traces of accepted blocks by block number, one entry per fork until the number becomes irreversible
+        std::map<uint32_t, std::vector<block_traces_st>> reversible_traces;
+
+        size_t queue_size = 16384;
+        overflow_policy queue_overflow = overflow_policy::block;
+        std::chrono::milliseconds queue_max_wait{100};
+        // the applied transaction pipeline: rings filled on the main thread and drained by consume_thread,
+        // the block rings only to place traces in their blocks; all null unless applied_transaction is enabled
+        bool trace_pipeline = true;
+        int trace_priority = 0;
+        std::unique_ptr<spsc_ring<trasaction_info_st>> transaction_trace_queue;
+        std::unique_ptr<spsc_ring<chain::block_state_ptr>> block_state_queue;
+        // only with irreversible_only
+        std::unique_ptr<spsc_ring<chain::block_state_ptr>> irreversible_block_state_queue;
+        // the other event types, null unless enabled
+        std::unique_ptr<event_pipeline_st<accepted_transaction_st>> accepted_transaction_pipeline;
+        std::unique_ptr<event_pipeline_st<block_event_st>> accepted_block_pipeline;
+        std::unique_ptr<event_pipeline_st<block_event_st>> irreversible_block_pipeline;
+        block_content block_records = block_content::header;
+        std::vector<std::unique_ptr<route_st>> routes;
+        // routed records are not sent to the applied transaction stream
+        bool route_only = false;
+        std::unique_ptr<memory_budget> route_budget;
+        size_t route_cap = 0;
+        // applied_transaction calls, to sample the hook's latency
+        uint32_t hook_calls = 0;
+        // traces queued since consume_thread was last woken up, and how often it polls the queues
+        static const uint32_t kTRACE_WAKE_BATCH = 64;
+        const std::chrono::milliseconds trace_poll_interval{10};
+        uint32_t unnotified_traces = 0;
+        // mtx/condition are only used to park consume_thread while all queues are empty
         boost::mutex mtx;
         boost::condition_variable condition;
+        boost::atomic<bool> consumer_waiting{false};
         boost::thread consume_thread;
         boost::atomic<bool> done{false};
         boost::atomic<bool> startup{true};
@@ -125,6 +393,62 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
         static const std::string actions_col;
         static const std::string accounts_col;
         kinesis_producer_ptr producer;
+
+        // optional durable log between consume_thread and the producer, drained by spill_thread;
+        // record offsets double as producer tags so acks can advance the committed offset
+        std::unique_ptr<spill_log> spill;
+        std::unique_ptr<ack_tracker> spill_acks;
+        std::chrono::milliseconds spill_sync_interval{1000};
+        // records the producer gave up on with a retriable error are sent again after a backoff, up to
+        // kSPILL_MAX_RETRIES times; then, or right away for other errors, they are acknowledged and logged
+        struct spill_retry_st {
+            uint64_t offset;
+            std::chrono::steady_clock::time_point due;
+        };
+        static const uint32_t kSPILL_MAX_RETRIES = 10;
+        std::mutex spill_retry_mtx;
+        std::vector<spill_retry_st> spill_retry;
+        // spill-level attempts by offset, guarded by spill_retry_mtx
+        std::unordered_map<uint64_t, uint32_t> spill_attempts;
+        boost::thread spill_thread;
+        boost::atomic<bool> spill_done{false};
+
+        // highest fully acknowledged block; records are tagged in send order and block ends are
+        // marked in the same order, so a block is delivered once every tag before its mark is acked
+        std::unique_ptr<delivery_checkpoint> checkpoint;
+        std::chrono::milliseconds checkpoint_interval{1000};
+        std::chrono::steady_clock::time_point last_checkpoint;
+        // traces of blocks up to the checkpoint found at startup are skipped
+        uint32_t delivered_block = 0;
+        uint32_t marked_block = 0;
+        // tags of records sent without the spill log, whose offsets serve as tags otherwise
+        std::unique_ptr<ack_tracker> delivery_acks;
+        uint64_t next_delivery_tag = 0;
+        // (first tag after the block, block number) of marked blocks not known to be delivered
+        std::deque<std::pair<uint64_t, uint32_t>> delivery_pending;
+        std::mutex delivery_mtx;
+        // Kinesis sequence numbers of acknowledged records above the last checkpoint
+        std::map<uint64_t, std::string> delivery_sequence_numbers;
+        std::string delivered_sequence_number;
+
+        std::shared_ptr<kinesis_metrics> metrics = std::make_shared<kinesis_metrics>();
+        std::chrono::seconds metrics_log_interval{60};
+        std::chrono::steady_clock::time_point last_metrics_log;
+        std::chrono::steady_clock::time_point last_queue_warning;
+
+        size_t serialization_threads = 2;
+        std::unique_ptr<ordered_worker_pool<payload_st>> serializer;
+
+        // creates a configured and initialized producer for a stream (aws-stream-name if empty)
+        // reporting to the callback
+        std::function<kinesis_producer_ptr(const std::string &, kinesis_producer::completion_callback)> make_producer;
+
+        std::unique_ptr<block_log_reader> block_log;
+        std::vector<backfill_chunk_st> backfill_chunks;
+        boost::atomic<size_t> next_backfill_chunk{0};
+        bfs::path backfill_checkpoint_dir;
+        size_t backfill_thread_count = 4;
+        std::vector<boost::thread> backfill_threads;
     };
 
     const account_name kinesis_plugin_impl::newaccount = "newaccount";
@@ -139,35 +463,32 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
 
     namespace {
 
-        template<typename Queue, typename Entry>
-        void queue(boost::mutex &mtx, boost::condition_variable &condition, Queue &queue, const Entry &e,
-                   size_t queue_size) {
-            int sleep_time = 100;
-            size_t last_queue_size = 0;
-            boost::mutex::scoped_lock lock(mtx);
-            if (queue.size() > queue_size) {
-                lock.unlock();
+        template<typename Entry>
+        void queue(boost::mutex &mtx, boost::condition_variable &condition, boost::atomic<bool> &consumer_waiting,
+                   spsc_ring<Entry> &queue, const Entry &e) {
+            queue.push(e);
+            // only touch the mutex when the consumer is parked
+            if (consumer_waiting.load()) {
+                boost::mutex::scoped_lock lock(mtx);
                 condition.notify_one();
-                if (last_queue_size < queue.size()) {
-                    sleep_time += 100;
-                } else {
-                    sleep_time -= 100;
-                    if (sleep_time < 0) sleep_time = 100;
-                }
-                last_queue_size = queue.size();
-                boost::this_thread::sleep_for(boost::chrono::milliseconds(sleep_time));
-                lock.lock();
             }
-            queue.emplace_back(e);
-            lock.unlock();
-            condition.notify_one();
         }
 
     }
 
+    void kinesis_plugin_impl::notify_consumer() {
+        if (consumer_waiting.load()) {
+            boost::mutex::scoped_lock lock(mtx);
+            condition.notify_one();
+        }
+    }
+
     void kinesis_plugin_impl::accepted_transaction(const chain::transaction_metadata_ptr &t) {
         try {
-            queue(mtx, condition, transaction_metadata_queue, t, queue_size);
+            auto &chain = chain_plug->chain();
+            auto &p = *accepted_transaction_pipeline;
+            queue(p.mtx, p.condition, p.consumer_waiting, *p.queue,
+                  accepted_transaction_st{t, chain.pending_block_state()->block_num, chain.pending_block_time()});
         } catch (fc::exception &e) {
             elog("FC Exception while accepted_transaction ${e}", ("e", e.to_string()));
         } catch (std::exception &e) {
@@ -179,15 +500,48 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
 
     void kinesis_plugin_impl::applied_transaction(const chain::transaction_trace_ptr &t) {
         try {
+            // runs inside block application: the entry is written straight into a preallocated ring
+            // slot, taking one reference to the trace and allocating nothing while the ring has room
+            const auto start = std::chrono::steady_clock::now();
             auto &chain = chain_plug->chain();
-            trasaction_info_st transactioninfo = trasaction_info_st{
-                    .block_number = chain.pending_block_state()->block_num,
-                    .block_time = chain.pending_block_time(),
-                    .trace = chain::transaction_trace_ptr(t)
+            const auto &pending = *chain.pending_block_state();
+            const auto fill = [&](trasaction_info_st &slot) {
+                slot.block_number = pending.block_num;
+                slot.block_time = pending.header.timestamp.to_time_point();
+                slot.trace = t;
+                slot.enqueued = start;
             };
-            trasaction_info_st &info_t = transactioninfo;
+            if (irreversible_only && abis) {
+                const auto updates = abi_updates(*t);
+                if (!updates.empty()) {
+                    std::lock_guard<std::mutex> lock(pending_abi_mtx);
+                    auto &accounts = pending_abi_updates[pending.block_num];
+                    for (const auto &update : updates) {
+                        accounts.push_back(update.account);
+                    }
+                }
+            }
 
-            queue(mtx, condition, transaction_trace_queue, info_t, queue_size);
+            if (speculative_index) {
+                trasaction_info_st info;
+                fill(info);
+                if (hold_speculative_trace(chain.is_producing_block(), pending.header.previous, info)) {
+                    return;
+                }
+                transaction_trace_queue->push(std::move(info));
+            } else {
+                transaction_trace_queue->push_with(fill);
+            }
+            // a wake-up is a syscall; consume_thread polls and is only woken up for a backlog, and by
+            // the block that follows the traces
+            if (++unnotified_traces >= kTRACE_WAKE_BATCH) {
+                unnotified_traces = 0;
+                notify_consumer();
+            }
+            // sampled, reading the clock costs about as much as the rest of the hook
+            if ((++hook_calls & 15) == 0) {
+                metrics->signal_to_enqueue.record(std::chrono::steady_clock::now() - start);
+            }
         } catch (fc::exception &e) {
             elog("FC Exception while applied_transaction ${e}", ("e", e.to_string()));
         } catch (std::exception &e) {
@@ -199,7 +553,13 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
 
     void kinesis_plugin_impl::applied_irreversible_block(const chain::block_state_ptr &bs) {
         try {
-            queue(mtx, condition, irreversible_block_state_queue, bs, queue_size);
+            if (irreversible_block_state_queue) {
+                queue(mtx, condition, consumer_waiting, *irreversible_block_state_queue, bs);
+            }
+            if (irreversible_block_pipeline) {
+                auto &p = *irreversible_block_pipeline;
+                queue(p.mtx, p.condition, p.consumer_waiting, *p.queue, block_event(*bs));
+            }
         } catch (fc::exception &e) {
             elog("FC Exception while applied_irreversible_block ${e}", ("e", e.to_string()));
         } catch (std::exception &e) {
@@ -211,7 +571,18 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
 
     void kinesis_plugin_impl::accepted_block(const chain::block_state_ptr &bs) {
         try {
-            queue(mtx, condition, block_state_queue, bs, queue_size);
+            if (speculative_index) {
+                // ahead of the block, traces are queued before their block
+                release_speculative_traces(*bs);
+            }
+            if (block_state_queue) {
+                unnotified_traces = 0;
+                queue(mtx, condition, consumer_waiting, *block_state_queue, bs);
+            }
+            if (accepted_block_pipeline) {
+                auto &p = *accepted_block_pipeline;
+                queue(p.mtx, p.condition, p.consumer_waiting, *p.queue, block_event(*bs));
+            }
         } catch (fc::exception &e) {
             elog("FC Exception while accepted_block ${e}", ("e", e.to_string()));
         } catch (std::exception &e) {
@@ -221,84 +592,191 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
         }
     }
 
-    void kinesis_plugin_impl::consume_blocks() {
-        try {
-            while (true) {
-                boost::mutex::scoped_lock lock(mtx);
-                while (transaction_metadata_queue.empty() &&
-                       transaction_trace_queue.empty() &&
-                       block_state_queue.empty() &&
-                       irreversible_block_state_queue.empty() &&
-                       !done) {
-                    condition.wait(lock);
-                }
-                // capture for processing
-                size_t transaction_metadata_size = transaction_metadata_queue.size();
-                if (transaction_metadata_size > 0) {
-                    transaction_metadata_process_queue = move(transaction_metadata_queue);
-                    transaction_metadata_queue.clear();
+    namespace {
+
+        template<typename Entry>
+        size_t queued(const std::unique_ptr<spsc_ring<Entry>> &q) {
+            return q ? q->size() : 0;
+        }
+
+        // renice the calling thread; lowering the nice value needs CAP_SYS_NICE
+        void set_thread_priority(const std::string &name, int priority) {
+            if (priority != 0 && setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), priority) != 0) {
+                wlog("unable to set the priority of the kinesis ${n} thread to ${p}: ${e}",
+                     ("n", name)("p", priority)("e", std::string(strerror(errno))));
+            }
+        }
+
+    }
+
+    namespace {
+
+        bool is_onblock(const chain::transaction_trace &trace) {
+            const auto &actions = trace.action_traces;
+            return actions.size() == 1 && actions.front().act.account == chain::config::system_account_name &&
+                   actions.front().act.name == N(onblock);
+        }
+
+        // a transaction in one pending block; a restarted pending block has another timestamp
+        uint64_t speculative_key(const transaction_id_type &id, fc::time_point block_time) {
+            return id._hash[0] ^ (static_cast<uint64_t>(block_time.time_since_epoch().count()) * 0x9e3779b97f4a7c15ULL);
+        }
+
+    }
+
+    bool kinesis_plugin_impl::hold_speculative_trace(bool speculative, const block_id_type &parent,
+                                                     trasaction_info_st &t) {
+        if (parent != speculative_parent) {
+            // a pending block on another head: held executions are redone on top of it or were forked out
+            drop_speculative_traces();
+            speculative_parent = parent;
+        }
+        const auto &id = t.trace->id;
+        const uint64_t key = speculative_key(id, t.block_time);
+        const uint32_t pos = speculative_index->find(key);
+        if (pos != fingerprint_index::npos &&
+            (speculative_traces[pos].id != id || speculative_traces[pos].t.block_time != t.block_time)) {
+            // another transaction with the same fingerprint is held, send this one as it comes
+            return false;
+        }
+        if (!speculative) {
+            // applying a received block, its execution is final and supersedes a held one
+            if (pos != fingerprint_index::npos && speculative_traces[pos].t.trace) {
+                speculative_traces[pos].t.trace.reset();
+                metrics->traces_superseded.add();
+            }
+            return false;
+        }
+        if (pos != fingerprint_index::npos) {
+            // the transaction was applied again in the same pending block
+            if (speculative_traces[pos].t.trace) {
+                metrics->traces_superseded.add();
+            }
+            speculative_traces[pos].t = std::move(t);
+            return true;
+        }
+        if (!speculative_index->insert(key, static_cast<uint32_t>(speculative_traces.size()))) {
+            // more transactions than kinesis-speculative-capacity, send the rest as they come
+            return false;
+        }
+        speculative_traces.push_back(speculative_trace_st{id, std::move(t)});
+        return true;
+    }
+
+    void kinesis_plugin_impl::release_speculative_traces(const chain::block_state &bs) {
+        const auto block_time = bs.header.timestamp.to_time_point();
+        if (bs.header.previous == speculative_parent) {
+            // only executions in a pending block with the block's timestamp, i.e. the one that became the
+            // block when it was produced here, in block order; when a block is received, its own executions
+            // were sent as they came, and a pending block with another timestamp ran its own onblock, whose
+            // id differs from the block's
+            for (auto &held : speculative_traces) {
+                if (held.t.trace && held.t.block_time == block_time && is_onblock(*held.t.trace)) {
+                    transaction_trace_queue->push(std::move(held.t));
                 }
-                size_t transaction_trace_size = transaction_trace_queue.size();
-                if (transaction_trace_size > 0) {
-                    transaction_trace_process_queue = move(transaction_trace_queue);
-                    transaction_trace_queue.clear();
+            }
+            for (const auto &receipt : bs.block->transactions) {
+                const transaction_id_type &id = receipt.trx.contains<transaction_id_type>()
+                                                ? receipt.trx.get<transaction_id_type>()
+                                                : receipt.trx.get<packed_transaction>().id();
+                const uint32_t pos = speculative_index->find(speculative_key(id, block_time));
+                if (pos != fingerprint_index::npos && speculative_traces[pos].id == id &&
+                    speculative_traces[pos].t.block_time == block_time && speculative_traces[pos].t.trace) {
+                    transaction_trace_queue->push(std::move(speculative_traces[pos].t));
                 }
+            }
+            notify_consumer();
+        }
+        // whatever is left is applied again in the next block
+        drop_speculative_traces();
+        speculative_parent = bs.id;
+    }
 
-                size_t block_state_size = block_state_queue.size();
-                if (block_state_size > 0) {
-                    block_state_process_queue = move(block_state_queue);
-                    block_state_queue.clear();
-                }
-                size_t irreversible_block_size = irreversible_block_state_queue.size();
-                if (irreversible_block_size > 0) {
-                    irreversible_block_state_process_queue = move(irreversible_block_state_queue);
-                    irreversible_block_state_queue.clear();
+    void kinesis_plugin_impl::drop_speculative_traces() {
+        for (const auto &held : speculative_traces) {
+            if (held.t.trace) {
+                metrics->traces_superseded.add();
+            }
+        }
+        speculative_traces.clear();
+        speculative_index->clear();
+    }
+
+    void kinesis_plugin_impl::consume_blocks() {
+        try {
+            set_thread_priority("applied_transaction", trace_priority);
+            // without the applied transaction pipeline the thread only logs metrics; with it, the thread
+            // polls since applied_transaction wakes it up only now and then
+            const auto linger = producer ? std::min(producer->kinesis_linger(), trace_poll_interval)
+                                         : std::chrono::milliseconds(1000);
+            while (true) {
+                {
+                    boost::mutex::scoped_lock lock(mtx);
+                    consumer_waiting = true;
+                    if (queued(transaction_trace_queue) == 0 &&
+                        queued(block_state_queue) == 0 &&
+                        queued(irreversible_block_state_queue) == 0 &&
+                        !serializer->has_ready() &&
+                        !done) {
+                        // wake up at least once per linger period so partial batches get flushed
+                        condition.wait_for(lock, boost::chrono::milliseconds(linger.count()));
+                    }
+                    consumer_waiting = false;
                 }
 
-                lock.unlock();
+                size_t transaction_trace_size = queued(transaction_trace_queue);
+                size_t block_state_size = queued(block_state_queue);
+                size_t irreversible_block_size = queued(irreversible_block_state_queue);
 
-                // warn if queue size greater than 75%
-                if (transaction_metadata_size > (queue_size * 0.75) ||
-                    transaction_trace_size > (queue_size * 0.75) ||
+                // warn if queue size greater than 75%, at most every 10 seconds
+                const auto now = std::chrono::steady_clock::now();
+                if (transaction_trace_size > (queue_size * 0.75) ||
                     block_state_size > (queue_size * 0.75) ||
                     irreversible_block_size > (queue_size * 0.75)) {
-//            wlog("queue size: ${q}", ("q", transaction_metadata_size + transaction_trace_size ));
-                } else if (done) {
-                    ilog("draining queue, size: ${q}", ("q", transaction_metadata_size + transaction_trace_size));
+                    if (now - last_queue_warning >= std::chrono::seconds(10)) {
+                        wlog("queue size: ${q}", ("q", transaction_trace_size));
+                        last_queue_warning = now;
+                    }
+                } else if (done && transaction_trace_size > 0) {
+                    ilog("draining queue, size: ${q}", ("q", transaction_trace_size));
                 }
 
-                // process transactions
-                while (!transaction_metadata_process_queue.empty()) {
-                    const auto &t = transaction_metadata_process_queue.front();
-                    process_accepted_transaction(t);
-                    transaction_metadata_process_queue.pop_front();
-                }
+                size_t processed = 0;
+                if (transaction_trace_queue) {
+                    processed += consume_applied_transactions();
 
-                while (!transaction_trace_process_queue.empty()) {
-                    const auto &t = transaction_trace_process_queue.front();
-                    process_applied_transaction(t);
-                    transaction_trace_process_queue.pop_front();
+                    // process blocks
+                    processed += consume_accepted_blocks();
                 }
 
-                // process blocks
-                while (!block_state_process_queue.empty()) {
-                    const auto &bs = block_state_process_queue.front();
-                    process_accepted_block(bs);
-                    block_state_process_queue.pop_front();
+                // process irreversible blocks
+                if (irreversible_block_state_queue) {
+                    processed += irreversible_block_state_queue->consume_all(
+                            [this](const chain::block_state_ptr &bs) {
+                                // a block is accepted before it becomes irreversible, but it may still sit in its queue
+                                consume_accepted_blocks();
+                                process_irreversible_block(bs);
+                            });
                 }
 
-                // process irreversible blocks
-                while (!irreversible_block_state_process_queue.empty()) {
-                    const auto &bs = irreversible_block_state_process_queue.front();
-                    process_irreversible_block(bs);
-                    irreversible_block_state_process_queue.pop_front();
+                emit_serialized(false);
+                if (!spill && producer) {
+                    producer->kinesis_poll();
+                }
+                if (checkpoint && now - last_checkpoint >= checkpoint_interval) {
+                    update_checkpoint(true);
+                    last_checkpoint = now;
+                }
+                if (metrics_log_interval.count() > 0 && now - last_metrics_log >= metrics_log_interval) {
+                    log_metrics();
+                    last_metrics_log = now;
                 }
 
-                if (transaction_metadata_size == 0 &&
-                    transaction_trace_size == 0 &&
-                    block_state_size == 0 &&
-                    irreversible_block_size == 0 &&
-                    done) {
+                if (processed == 0 && done) {
+                    if (action_batches && action_batches->rows() > 0) {
+                        flush_action_batch();
+                    }
+                    emit_serialized(true);
                     break;
                 }
             }
@@ -313,22 +791,10 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
     }
 
 
-    void kinesis_plugin_impl::process_accepted_transaction(const chain::transaction_metadata_ptr &t) {
-        try {
-            // always call since we need to capture setabi on accounts even if not storing transactions
-            _process_accepted_transaction(t);
-        } catch (fc::exception &e) {
-            elog("FC Exception while processing accepted transaction metadata: ${e}", ("e", e.to_detail_string()));
-        } catch (std::exception &e) {
-            elog("STD Exception while processing accepted tranasction metadata: ${e}", ("e", e.what()));
-        } catch (...) {
-            elog("Unknown exception while processing accepted transaction metadata");
-        }
-    }
-
     void kinesis_plugin_impl::process_applied_transaction(const trasaction_info_st &t) {
         try {
-            if (start_block_reached) {
+            metrics->queue_wait.record(std::chrono::steady_clock::now() - t.enqueued);
+            if (start_block_reached && t.block_number > delivered_block) {
                 _process_applied_transaction(t);
             }
         } catch (fc::exception &e) {
@@ -364,6 +830,13 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
             }
             if (start_block_reached) {
                 _process_accepted_block(bs);
+                if (abis && !irreversible_only) {
+                    drop_forked_abis(*bs);
+                }
+                if (!irreversible_only) {
+                    end_action_block(bs->block_num);
+                    mark_block_end(bs->block_num);
+                }
             }
         } catch (fc::exception &e) {
             elog("FC Exception while processing accepted block trace ${e}", ("e", e.to_string()));
@@ -374,31 +847,1052 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
         }
     }
 
-    void kinesis_plugin_impl::_process_accepted_transaction(const chain::transaction_metadata_ptr &t) {
-       //const auto& trx = t->trx;
-       //string trx_json = fc::json::to_string( trx );
-       //producer->trx_kinesis_sendmsg(ACCEPTED_TRANSCTION, (unsigned char*)trx_json.c_str(), trx_json.length());
+    size_t kinesis_plugin_impl::consume_applied_transactions() {
+        return transaction_trace_queue->consume_all(
+                [this](const trasaction_info_st &t) { process_applied_transaction(t); });
+    }
+
+    size_t kinesis_plugin_impl::consume_accepted_blocks() {
+        return block_state_queue->consume_all(
+                [this](const chain::block_state_ptr &bs) {
+                    if (irreversible_only || checkpoint) {
+                        // traces are queued before their block, make sure all of them have been buffered
+                        // (or submitted ahead of the block's end mark)
+                        consume_applied_transactions();
+                    }
+                    process_accepted_block(bs);
+                });
     }
 
     void kinesis_plugin_impl::_process_applied_transaction(const trasaction_info_st &t) {
-       uint64_t time = (t.block_time.time_since_epoch().count()/1000);
-        string transaction_metadata_json =
-            "{\"block_number\":" + std::to_string(t.block_number) + ",\"block_time\":" + std::to_string(time) +
-            ",\"trace\":" + fc::json::to_string(t.trace).c_str() + "}";
-       producer->kinesis_sendmsg(APPLIED_TRANSACTION,
-                                 (unsigned char*)transaction_metadata_json.c_str(),
-                                 transaction_metadata_json.length());
+        if (!irreversible_only) {
+            submit_applied_transaction(t);
+            return;
+        }
+        if (abis && !abi_updates(*t.trace).empty()) {
+            // the setabi is applied when the trace is submitted, whether or not the filter keeps it
+            unaccepted_traces[t.block_number].push_back(t);
+            return;
+        }
+        auto trace = filter.apply(t.trace);
+        if (!trace) {
+            metrics->traces_filtered.add();
+            return;
+        }
+        unaccepted_traces[t.block_number].push_back(trasaction_info_st{t.block_number, t.block_time, std::move(trace),
+                                                                       t.enqueued});
+    }
 
+    // ABI updates are applied in the order traces are sent, so they only change the decoding of later traces.
+    void kinesis_plugin_impl::submit_applied_transaction(const trasaction_info_st &unfiltered) {
+        if (abis) {
+            // before filtering, the ABI must be tracked even if the setabi itself is not sent
+            update_abis(unfiltered);
+        }
+        auto trace = filter.apply(unfiltered.trace);
+        if (!trace) {
+            metrics->traces_filtered.add();
+            return;
+        }
+        const trasaction_info_st t{unfiltered.block_number, unfiltered.block_time, std::move(trace),
+                                   unfiltered.enqueued};
+        if (action_batches) {
+            add_action_rows(t);
+        }
+        serializer->submit([this, t]() {
+            const auto start = std::chrono::steady_clock::now();
+            auto p = serialize_applied_transaction(t);
+            if (!routes.empty()) {
+                p.routes = route_mask(*t.trace);
+            }
+            metrics->serialization.record(std::chrono::steady_clock::now() - start);
+            return p;
+        });
+    }
+
+    std::string kinesis_plugin_impl::partition_key(const trasaction_info_st &t) const {
+        return trace_records.partition_key(t.block_number, *t.trace);
+    }
+
+    std::string kinesis_plugin_impl::partition_key(uint32_t block_number, const transaction_id_type &id,
+                                                   const account_name *receiver) const {
+        return trace_records.partition_key(block_number, id, receiver);
+    }
+
+    kinesis_plugin_impl::payload_st
+    kinesis_plugin_impl::serialize_applied_transaction(const trasaction_info_st &t) const {
+        return payload_st{APPLIED_TRANSACTION, partition_key(t),
+                          trace_records.serialize(t.block_number, t.block_time, *t.trace), t.block_time,
+                          t.block_number};
+    }
+
+    namespace {
+
+        // {"block_number":..,"block_time":..,"<field>":<json>}, written straight into the record
+        Aws::Utils::ByteBuffer json_record(const char *field, uint32_t block_number, uint64_t block_time,
+                                           const std::string &json) {
+            char head[96];
+            const int head_size = snprintf(head, sizeof(head), "{\"block_number\":%u,\"block_time\":%llu,\"%s\":",
+                                           static_cast<unsigned>(block_number),
+                                           static_cast<unsigned long long>(block_time), field);
+            Aws::Utils::ByteBuffer data(head_size + json.size() + 1);
+            unsigned char *out = data.GetUnderlyingData();
+            memcpy(out, head, head_size);
+            memcpy(out + head_size, json.data(), json.size());
+            out[head_size + json.size()] = '}';
+            return data;
+        }
+
+        void log_failed_acks(const std::vector<kinesis_ack> &acks) {
+            auto failed = std::count_if(acks.begin(), acks.end(), [](const kinesis_ack& a) { return !a.ok; });
+            if (failed > 0) {
+                auto first = std::find_if(acks.begin(), acks.end(), [](const kinesis_ack& a) { return !a.ok; });
+                elog("${f} of ${t} kinesis records failed: ${e}",
+                     ("f", failed)("t", acks.size())("e", std::string(first->error_code.c_str())));
+            }
+        }
+
+    }
+
+    kinesis_plugin_impl::payload_st
+    kinesis_plugin_impl::serialize_backfilled_transaction(uint32_t block_number, fc::time_point block_time,
+                                                          const chain::transaction_receipt &receipt) const {
+        const uint64_t time = block_time.time_since_epoch().count() / 1000;
+        transaction_id_type id;
+        const chain::transaction *trx = nullptr;
+        if (receipt.trx.contains<packed_transaction>()) {
+            const auto &pt = receipt.trx.get<packed_transaction>();
+            id = pt.id();
+            trx = &pt.get_transaction();
+        } else {
+            // deferred transactions are only referenced by id
+            id = receipt.trx.get<transaction_id_type>();
+        }
+        const account_name *receiver = trx != nullptr && !trx->actions.empty() ? &trx->actions.front().account : nullptr;
+        auto key = partition_key(block_number, id, receiver);
+
+        if (trace_records.format == output_format::binary) {
+            // the receipt as stored in the block, see backfilled_transaction_v1 in kinesis_trace.abi
+            const auto size = 2 + sizeof(block_number) + sizeof(time) + fc::raw::pack_size(receipt);
+            Aws::Utils::ByteBuffer data(size);
+            fc::datastream<char*> ds(reinterpret_cast<char*>(data.GetUnderlyingData()), data.GetLength());
+            fc::raw::pack(ds, binary_format_version);
+            fc::raw::pack(ds, static_cast<uint8_t>(BACKFILLED_TRANSACTION));
+            fc::raw::pack(ds, block_number);
+            fc::raw::pack(ds, time);
+            fc::raw::pack(ds, receipt);
+            return payload_st{BACKFILLED_TRANSACTION, std::move(key), std::move(data), block_time, block_number};
+        }
+
+        const fc::variant header(static_cast<const chain::transaction_receipt_header &>(receipt));
+        fc::mutable_variant_object v(header.get_object());
+        v("id", id);
+        if (trx != nullptr) {
+            v("signatures", receipt.trx.get<packed_transaction>().get_signatures());
+            v("transaction", *trx);
+        }
+        return payload_st{BACKFILLED_TRANSACTION, std::move(key),
+                          json_record("transaction", block_number, time, fc::json::to_string(fc::variant(std::move(v)))),
+                          block_time, block_number};
+    }
+
+    kinesis_plugin_impl::payload_st
+    kinesis_plugin_impl::serialize_accepted_transaction(const accepted_transaction_st &t) const {
+        const uint64_t time = t.block_time.time_since_epoch().count() / 1000;
+        const auto &pt = *t.trx->packed_trx;
+        const auto &trx = pt.get_transaction();
+        auto key = partition_key(t.block_number, t.trx->id, trx.actions.empty() ? nullptr : &trx.actions.front().account);
+
+        if (trace_records.format == output_format::binary) {
+            // see accepted_transaction_v1 in kinesis_trace.abi
+            const auto size = 2 + sizeof(t.block_number) + sizeof(time) + fc::raw::pack_size(t.trx->id) + 2 +
+                              fc::raw::pack_size(pt);
+            Aws::Utils::ByteBuffer data(size);
+            fc::datastream<char*> ds(reinterpret_cast<char*>(data.GetUnderlyingData()), data.GetLength());
+            fc::raw::pack(ds, binary_format_version);
+            fc::raw::pack(ds, static_cast<uint8_t>(ACCEPTED_TRANSACTION));
+            fc::raw::pack(ds, t.block_number);
+            fc::raw::pack(ds, time);
+            fc::raw::pack(ds, t.trx->id);
+            fc::raw::pack(ds, t.trx->implicit);
+            fc::raw::pack(ds, t.trx->scheduled);
+            fc::raw::pack(ds, pt);
+            return payload_st{ACCEPTED_TRANSACTION, std::move(key), std::move(data), t.block_time, t.block_number};
+        }
+
+        fc::mutable_variant_object v;
+        v("id", t.trx->id);
+        v("implicit", t.trx->implicit);
+        v("scheduled", t.trx->scheduled);
+        v("signatures", pt.get_signatures());
+        v("transaction", trx);
+        return payload_st{ACCEPTED_TRANSACTION, std::move(key),
+                          json_record("transaction", t.block_number, time, fc::json::to_string(fc::variant(std::move(v)))),
+                          t.block_time, t.block_number};
+    }
+
+    kinesis_plugin_impl::block_event_st kinesis_plugin_impl::block_event(const chain::block_state &bs) const {
+        return block_event_st{bs.id, bs.header.previous, bs.block_num, bs.header.timestamp.to_time_point(),
+                              bs.header.producer, static_cast<uint32_t>(bs.block->transactions.size()),
+                              bs.dpos_irreversible_blocknum,
+                              block_records == block_content::full ? bs.block : chain::signed_block_ptr()};
+    }
+
+    kinesis_plugin_impl::payload_st
+    kinesis_plugin_impl::serialize_block(TransactionType type, const block_event_st &b) const {
+        const uint64_t time = b.block_time.time_since_epoch().count() / 1000;
+
+        if (trace_records.format == output_format::binary) {
+            // see block_v1 in kinesis_trace.abi, block is an optional signed_block
+            const bool full = b.block != nullptr;
+            const auto size = 2 + sizeof(b.block_number) + sizeof(time) + fc::raw::pack_size(b.id) +
+                              fc::raw::pack_size(b.previous) + fc::raw::pack_size(b.producer) +
+                              sizeof(b.transaction_count) + sizeof(b.last_irreversible_block) + 1 +
+                              (full ? fc::raw::pack_size(*b.block) : 0);
+            Aws::Utils::ByteBuffer data(size);
+            fc::datastream<char*> ds(reinterpret_cast<char*>(data.GetUnderlyingData()), data.GetLength());
+            fc::raw::pack(ds, binary_format_version);
+            fc::raw::pack(ds, static_cast<uint8_t>(type));
+            fc::raw::pack(ds, b.block_number);
+            fc::raw::pack(ds, time);
+            fc::raw::pack(ds, b.id);
+            fc::raw::pack(ds, b.previous);
+            fc::raw::pack(ds, b.producer);
+            fc::raw::pack(ds, b.transaction_count);
+            fc::raw::pack(ds, b.last_irreversible_block);
+            fc::raw::pack(ds, full);
+            if (full) {
+                fc::raw::pack(ds, *b.block);
+            }
+            return payload_st{type, std::to_string(b.block_number), std::move(data), b.block_time, b.block_number};
+        }
+
+        fc::mutable_variant_object v;
+        v("id", b.id);
+        v("previous", b.previous);
+        v("producer", b.producer);
+        v("transaction_count", b.transaction_count);
+        v("last_irreversible_block", b.last_irreversible_block);
+        if (b.block) {
+            v("signed_block", *b.block);
+        }
+        return payload_st{type, std::to_string(b.block_number),
+                          json_record("block", b.block_number, time, fc::json::to_string(fc::variant(std::move(v)))),
+                          b.block_time, b.block_number};
+    }
+
+    template<typename Entry, typename F>
+    void kinesis_plugin_impl::run_pipeline(event_pipeline_st<Entry> &p, F process) {
+        try {
+            set_thread_priority(p.name, p.priority);
+            const auto linger = p.producer->kinesis_linger();
+            while (true) {
+                {
+                    boost::mutex::scoped_lock lock(p.mtx);
+                    p.consumer_waiting = true;
+                    if (p.queue->empty() && !done) {
+                        // wake up at least once per linger period so partial batches get flushed
+                        p.condition.wait_for(lock, boost::chrono::milliseconds(linger.count()));
+                    }
+                    p.consumer_waiting = false;
+                }
+                const size_t processed = p.queue->consume_all([&p, &process](Entry &entry) {
+                    try {
+                        process(entry);
+                    } catch (fc::exception &e) {
+                        elog("FC Exception while processing ${n} ${e}", ("n", p.name)("e", e.to_detail_string()));
+                    } catch (std::exception &e) {
+                        elog("STD Exception while processing ${n} ${e}", ("n", p.name)("e", e.what()));
+                    } catch (...) {
+                        elog("Unknown exception while processing ${n}", ("n", p.name));
+                    }
+                });
+                p.producer->kinesis_poll();
+                if (processed == 0 && done) {
+                    break;
+                }
+            }
+            ilog("kinesis_plugin ${n} thread shutdown gracefully", ("n", p.name));
+        } catch (fc::exception &e) {
+            elog("FC Exception while consuming ${n} ${e}", ("n", p.name)("e", e.to_string()));
+        } catch (std::exception &e) {
+            elog("STD Exception while consuming ${n} ${e}", ("n", p.name)("e", e.what()));
+        } catch (...) {
+            elog("Unknown exception while consuming ${n}", ("n", p.name));
+        }
+    }
+
+    template<typename Entry>
+    void kinesis_plugin_impl::enable_pipeline(std::unique_ptr<event_pipeline_st<Entry>> &p, const std::string &name,
+                                              const std::string &stream, int priority,
+                                              kinesis_producer::completion_callback on_acks) {
+        p.reset(new event_pipeline_st<Entry>());
+        p->name = name;
+        p->priority = priority;
+        p->queue.reset(new spsc_ring<Entry>(queue_size, queue_overflow, queue_max_wait));
+        p->producer = make_producer(stream, std::move(on_acks));
+    }
+
+    template<typename Entry>
+    void kinesis_plugin_impl::stop_pipeline(event_pipeline_st<Entry> *p) {
+        if (p == nullptr) {
+            return;
+        }
+        {
+            boost::mutex::scoped_lock lock(p->mtx);
+            p->condition.notify_one();
+        }
+        if (p->thread.joinable()) {
+            p->thread.join();
+        }
+        p->producer->kinesis_destory();
+    }
+
+    template<typename Entry>
+    void kinesis_plugin_impl::send_event(event_pipeline_st<Entry> &p, payload_st payload) {
+        if (p.producer->kinesis_sendmsg(payload.trxtype, payload.partition_key, std::move(payload.data)) != 0) {
+            elog("kinesis ${n} record for ${k} dropped: larger than a Kinesis record",
+                 ("n", p.name)("k", payload.partition_key));
+            metrics->records_failed.add();
+        }
+    }
+
+    namespace {
+
+        template<typename F>
+        void for_each_action(const std::vector<chain::action_trace> &traces, F &f) {
+            for (const auto &at : traces) {
+                f(at);
+                for_each_action(at.inline_traces, f);
+            }
+        }
+
+    }
+
+    void kinesis_plugin_impl::add_action_rows(const trasaction_info_st &t) {
+        const auto &trace = *t.trace;
+        // actions of failed transactions were rolled back
+        if (!trace.receipt || trace.receipt->status != chain::transaction_receipt_header::executed) {
+            return;
+        }
+        const uint32_t range = static_cast<uint32_t>(t.block_number / action_batch_blocks);
+        if (action_batches->rows() > 0 &&
+            (range != action_batch_range ||
+             (action_batches_to_stream && action_batches->size() >= kMAX_ACTION_BATCH_RECORD))) {
+            flush_action_batch();
+        }
+        action_batch_range = range;
+        action_batch_time = t.block_time;
+
+        // one row reused for all actions
+        action_row &row = action_batch_row;
+        row.block_num = static_cast<uint32_t>(t.block_number);
+        row.block_time = t.block_time.time_since_epoch().count() / 1000;
+        memcpy(row.trx_id.data(), trace.id.data(), row.trx_id.size());
+        auto add = [this, &row](const chain::action_trace &at) {
+            row.global_sequence = at.receipt.global_sequence;
+            row.receiver = at.receipt.receiver.value;
+            row.account = at.act.account.value;
+            row.name = at.act.name.value;
+            row.authorization.clear();
+            for (const auto &auth : at.act.authorization) {
+                row.authorization.emplace_back(auth.actor.value, auth.permission.value);
+            }
+            row.data.assign(at.act.data.begin(), at.act.data.end());
+            action_batches->add(row);
+        };
+        for_each_action(trace.action_traces, add);
+    }
+
+    void kinesis_plugin_impl::end_action_block(uint32_t block_num) {
+        // the last block of the batch's range, later traces may only come from forks
+        if (action_batches && action_batches->rows() > 0 && block_num / action_batch_blocks == action_batch_range &&
+            (block_num + 1) % action_batch_blocks == 0) {
+            flush_action_batch();
+        }
+    }
+
+    void kinesis_plugin_impl::flush_action_batch() {
+        const uint32_t first = action_batch_range * action_batch_blocks;
+        std::string batch;
+        action_batches->finish(batch);
+        metrics->action_batches.add();
+
+        if (!action_batch_dir.empty()) {
+            // a fork back over a range boundary appends to the previous file again
+            const uint32_t file_first = first / action_file_blocks * action_file_blocks;
+            const auto path = action_batch_dir / ("actions-" + std::to_string(file_first) + "-" +
+                                                  std::to_string(file_first + (action_file_blocks - 1)) + ".kacb");
+            if (path != action_file_path) {
+                action_file.close();
+                action_file.clear();
+                action_file.open(path.string(), std::ios::binary | std::ios::app);
+                action_file_path = path;
+            }
+            action_file.write(batch.data(), batch.size());
+            action_file.flush();
+            if (!action_file) {
+                elog("unable to write kinesis action batch of blocks ${f} to ${p}",
+                     ("f", first)("p", path.generic_string()));
+                // try again with the next batch
+                action_file_path.clear();
+            }
+        }
+        if (action_batches_to_stream) {
+            const auto block_time = action_batch_time;
+            auto data = std::make_shared<std::string>(std::move(batch));
+            serializer->submit([first, block_time, data]() {
+                Aws::Utils::ByteBuffer record(data->size());
+                memcpy(record.GetUnderlyingData(), data->data(), data->size());
+                return payload_st{ACTION_BATCH, std::to_string(first), std::move(record), block_time, first};
+            });
+        }
+    }
+
+    std::vector<chain::setabi> kinesis_plugin_impl::abi_updates(const chain::transaction_trace &trace) {
+        std::vector<chain::setabi> updates;
+        if (!trace.receipt || trace.receipt->status != chain::transaction_receipt_header::executed) {
+            return updates;
+        }
+        auto find_setabi = [&updates](const chain::action_trace &at) {
+            if (at.receipt.receiver == chain::config::system_account_name &&
+                at.act.account == chain::config::system_account_name && at.act.name == setabi) {
+                updates.push_back(at.act.data_as<chain::setabi>());
+            }
+        };
+        for_each_action(trace.action_traces, find_setabi);
+        return updates;
+    }
+
+    void kinesis_plugin_impl::update_abis(const trasaction_info_st &t) {
+        const auto updates = abi_updates(*t.trace);
+        if (updates.empty()) {
+            return;
+        }
+        // traces submitted earlier must be decoded with the previous ABI, let them finish first
+        emit_serialized(true);
+        for (const auto &update : updates) {
+            fc::optional<chain::abi_def> abi;
+            if (!update.abi.empty()) {
+                abi = fc::raw::unpack<chain::abi_def>(update.abi);
+            }
+            abis->set(update.account, abi);
+            if (!irreversible_only) {
+                reversible_abi_updates[static_cast<uint32_t>(t.block_number)].push_back(update.account);
+            }
+        }
+    }
+
+    void kinesis_plugin_impl::drop_forked_abis(const chain::block_state &bs) {
+        if (last_accepted_block != block_id_type() && bs.header.previous != last_accepted_block) {
+            // switched forks: ABIs set at or above this number may come from forked out blocks, reload them
+            // from chain state (this block's own setabi actions included, which is harmless)
+            auto first = reversible_abi_updates.lower_bound(bs.block_num);
+            if (first != reversible_abi_updates.end()) {
+                emit_serialized(true);
+                for (auto itr = first; itr != reversible_abi_updates.end(); ++itr) {
+                    for (const auto &account : itr->second) {
+                        abis->erase(account);
+                    }
+                }
+                reversible_abi_updates.erase(first, reversible_abi_updates.end());
+            }
+        }
+        last_accepted_block = bs.id;
+        reversible_abi_updates.erase(reversible_abi_updates.begin(),
+                                     reversible_abi_updates.upper_bound(bs.dpos_irreversible_blocknum));
+    }
+
+    fc::optional<chain::abi_def> kinesis_plugin_impl::load_abi(const account_name &account) {
+        // the main loop no longer runs while the queues drain on shutdown, send the data as hex
+        EOS_ASSERT(!done, fc::timeout_exception, "not loading abi of ${a} during shutdown", ("a", account));
+        // chain state may only be read on the main thread; it is the head state, which can be ahead of
+        // the trace being decoded
+        auto promise = std::make_shared<std::promise<fc::optional<chain::abi_def>>>();
+        auto future = promise->get_future();
+        app().get_io_service().post([this, account, promise]() {
+            try {
+                if (irreversible_only) {
+                    // the head state holds an ABI newer than the irreversible one, send the data as hex until
+                    // the setabi is sent and replaces the cached entry
+                    std::lock_guard<std::mutex> lock(pending_abi_mtx);
+                    for (const auto &block : pending_abi_updates) {
+                        EOS_ASSERT(std::find(block.second.begin(), block.second.end(), account) == block.second.end(),
+                                   fc::invalid_operation_exception, "abi of ${a} has a reversible update",
+                                   ("a", account));
+                    }
+                }
+                fc::optional<chain::abi_def> abi;
+                const auto *a = chain_plug->chain().db().find<chain::account_object, chain::by_name>(account);
+                if (a != nullptr && a->abi.size() > 0) {
+                    abi = a->get_abi();
+                }
+                promise->set_value(std::move(abi));
+            } catch (...) {
+                promise->set_exception(std::current_exception());
+            }
+        });
+        EOS_ASSERT(future.wait_for(std::chrono::seconds(1)) == std::future_status::ready, fc::timeout_exception,
+                   "timed out loading abi of ${a}", ("a", account));
+        return future.get();
+    }
+
+    uint32_t kinesis_plugin_impl::route_mask(const chain::transaction_trace &trace) const {
+        uint32_t mask = 0;
+        for (size_t i = 0; i < routes.size(); ++i) {
+            if (routes[i]->rules.matches(trace)) {
+                mask |= 1u << i;
+            }
+        }
+        return mask;
+    }
+
+    void kinesis_plugin_impl::route_payload(const payload_st &p) {
+        const size_t bytes = p.data.GetLength() + p.partition_key.size();
+        for (size_t i = 0; i < routes.size(); ++i) {
+            if ((p.routes & (1u << i)) == 0) {
+                continue;
+            }
+            auto &r = *routes[i];
+            auto &pipeline = *r.pipeline;
+            // never wait for a route, a slow stream only loses its own copies
+            if (!route_budget->try_acquire(r.held, route_cap, bytes)) {
+                metrics->route_dropped.add();
+                continue;
+            }
+            const bool queued = pipeline.queue->try_push_with([&p](payload_st &slot) {
+                slot.trxtype = p.trxtype;
+                slot.partition_key = p.partition_key;
+                slot.data = Aws::Utils::ByteBuffer(p.data.GetUnderlyingData(), p.data.GetLength());
+                slot.block_time = p.block_time;
+                slot.block_number = p.block_number;
+            });
+            if (!queued) {
+                route_budget->release(r.held, bytes);
+                metrics->route_dropped.add();
+                continue;
+            }
+            if (pipeline.consumer_waiting.load()) {
+                boost::mutex::scoped_lock lock(pipeline.mtx);
+                pipeline.condition.notify_one();
+            }
+        }
+    }
+
+    void kinesis_plugin_impl::send_routed(route_st &r, payload_st &p) {
+        const size_t bytes = p.data.GetLength() + p.partition_key.size();
+        if (r.pipeline->producer->kinesis_sendmsg(p.trxtype, p.partition_key, std::move(p.data), bytes) != 0) {
+            route_budget->release(r.held, bytes);
+            elog("kinesis record for ${k} dropped on route ${s}: larger than a Kinesis record",
+                 ("k", p.partition_key)("s", r.stream));
+            metrics->records_failed.add();
+        }
+    }
+
+    void kinesis_plugin_impl::send_payload(payload_st &p) {
+       if (p.block_end) {
+          delivery_pending.emplace_back(spill ? spill->end() : next_delivery_tag, p.block_number);
+          return;
+       }
+       metrics->block_lag.record(std::chrono::microseconds((fc::time_point::now() - p.block_time).count()));
+       if (p.routes != 0) {
+          route_payload(p);
+          if (route_only) {
+             return;
+          }
+       }
+       if (spill) {
+          // blocks while the log is over kinesis-spill-max-mb
+          spill->append(static_cast<uint8_t>(p.trxtype), p.partition_key,
+                        reinterpret_cast<const char*>(p.data.GetUnderlyingData()), p.data.GetLength());
+          return;
+       }
+       const uint64_t tag = next_delivery_tag++;
+       if (producer->kinesis_sendmsg(p.trxtype, p.partition_key, std::move(p.data), tag) != 0) {
+          elog("kinesis record for ${k} dropped: larger than a Kinesis record", ("k", p.partition_key));
+          metrics->records_failed.add();
+          if (delivery_acks) {
+             delivery_acks->ack(tag);
+          }
+       }
+    }
+
+    void kinesis_plugin_impl::mark_block_end(uint32_t block_num) {
+        // forks may revisit lower numbers, the checkpoint only moves forward
+        if (!checkpoint || block_num <= marked_block) {
+            return;
+        }
+        marked_block = block_num;
+        serializer->submit([block_num]() {
+            payload_st p{APPLIED_TRANSACTION, std::string(), Aws::Utils::ByteBuffer(), fc::time_point(), block_num};
+            p.block_end = true;
+            return p;
+        });
+    }
+
+    void kinesis_plugin_impl::update_checkpoint(bool flush) {
+        if (!checkpoint) {
+            return;
+        }
+        try {
+            const uint64_t watermark = spill ? spill_acks->watermark() : delivery_acks->watermark();
+            uint32_t block = 0;
+            uint64_t end = 0;
+            while (!delivery_pending.empty() && delivery_pending.front().first <= watermark) {
+                std::tie(end, block) = delivery_pending.front();
+                delivery_pending.pop_front();
+            }
+            if (block != 0) {
+                {
+                    std::lock_guard<std::mutex> lock(delivery_mtx);
+                    auto itr = end > 0 ? delivery_sequence_numbers.find(end - 1) : delivery_sequence_numbers.end();
+                    if (itr != delivery_sequence_numbers.end()) {
+                        delivered_sequence_number = itr->second;
+                    }
+                    delivery_sequence_numbers.erase(delivery_sequence_numbers.begin(),
+                                                    delivery_sequence_numbers.lower_bound(end));
+                }
+                checkpoint->update(block, delivered_sequence_number);
+            }
+            if (flush) {
+                checkpoint->flush();
+            }
+        } catch (fc::exception &e) {
+            elog("FC Exception while updating the kinesis checkpoint ${e}", ("e", e.to_string()));
+        } catch (std::exception &e) {
+            elog("STD Exception while updating the kinesis checkpoint ${e}", ("e", e.what()));
+        } catch (...) {
+            elog("Unknown exception while updating the kinesis checkpoint");
+        }
+    }
+
+    void kinesis_plugin_impl::send_spilled() {
+        try {
+            // everything after the committed offset is (re)sent, including records left over from the last run
+            uint64_t next = spill->committed();
+            auto last_sync = std::chrono::steady_clock::now();
+            auto send = [this](const spill_log::record_view &r) {
+                if (producer->kinesis_sendmsg(r.type, r.partition_key, const_cast<unsigned char*>(r.data), r.size,
+                                              r.offset) != 0) {
+                    // can never be sent; acknowledge it so the log is not held back forever
+                    elog("spilled kinesis record ${o} dropped: larger than a Kinesis record", ("o", r.offset));
+                    metrics->records_failed.add();
+                    spill_acks->ack(r.offset);
+                }
+            };
+            while (!spill_done) {
+                std::vector<uint64_t> retry;
+                {
+                    const auto now = std::chrono::steady_clock::now();
+                    std::lock_guard<std::mutex> lock(spill_retry_mtx);
+                    auto due = std::stable_partition(spill_retry.begin(), spill_retry.end(),
+                                                     [now](const spill_retry_st &r) { return r.due > now; });
+                    for (auto itr = due; itr != spill_retry.end(); ++itr) {
+                        retry.push_back(itr->offset);
+                    }
+                    spill_retry.erase(due, spill_retry.end());
+                }
+                for (uint64_t offset : retry) {
+                    spill->read_one(offset, send);
+                }
+                next = spill->read(next, kMAX_RECORDS_PER_REQUEST, send);
+                producer->kinesis_poll();
+                spill->commit(spill_acks->watermark());
+
+                auto now = std::chrono::steady_clock::now();
+                if (now - last_sync >= spill_sync_interval) {
+                    spill->sync();
+                    last_sync = now;
+                }
+                if (next == spill->end()) {
+                    spill->wait_for_data(next, producer->kinesis_linger());
+                }
+            }
+            ilog("kinesis_plugin spill thread shutdown gracefully");
+        } catch (fc::exception &e) {
+            elog("FC Exception while sending spilled records ${e}", ("e", e.to_string()));
+        } catch (std::exception &e) {
+            elog("STD Exception while sending spilled records ${e}", ("e", e.what()));
+        } catch (...) {
+            elog("Unknown exception while sending spilled records");
+        }
+    }
+
+    void kinesis_plugin_impl::on_acks(const std::vector<kinesis_ack> &acks) {
+        // called on producer threads
+        log_failed_acks(acks);
+        if (checkpoint) {
+            std::lock_guard<std::mutex> lock(delivery_mtx);
+            for (const auto &a : acks) {
+                if (a.ok) {
+                    delivery_sequence_numbers[a.tag] = a.sequence_number.c_str();
+                }
+            }
+        }
+        if (!spill) {
+            if (delivery_acks) {
+                // the checkpoint stops in front of a record that failed for good, so its block is sent again
+                // after a restart
+                for (const auto &a : acks) {
+                    if (a.ok) {
+                        delivery_acks->ack(a.tag);
+                    }
+                }
+            }
+            return;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(spill_retry_mtx);
+        for (const auto &a : acks) {
+            if (a.ok) {
+                if (!spill_attempts.empty()) {
+                    spill_attempts.erase(a.tag);
+                }
+                spill_acks->ack(a.tag);
+                continue;
+            }
+            const uint32_t attempts = a.retriable ? ++spill_attempts[a.tag] : kSPILL_MAX_RETRIES + 1;
+            if (attempts > kSPILL_MAX_RETRIES) {
+                // given up on, so the log is not held back forever
+                elog("spilled kinesis record ${o} dropped after ${n} retries: ${e}",
+                     ("o", a.tag)("n", attempts - 1)("e", std::string(a.error_code.c_str())));
+                spill_attempts.erase(a.tag);
+                spill_acks->ack(a.tag);
+                continue;
+            }
+            // 1 s, doubling up to a minute
+            const auto backoff = std::chrono::seconds(std::min<uint32_t>(60, 1u << std::min<uint32_t>(attempts - 1, 6)));
+            spill_retry.push_back(spill_retry_st{a.tag, now + backoff});
+            metrics->retries.add();
+        }
+    }
+
+    // Acknowledgements of one backfill worker. Records are tagged with a per worker sequence number;
+    // a block is done once the records up to its last sequence number are acknowledged.
+    struct kinesis_plugin_impl::backfill_progress_st {
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::unique_ptr<ack_tracker> acks;
+        uint64_t completed = 0;
+        uint64_t failed = 0;
+
+        void on_acks(const std::vector<kinesis_ack> &acks_) {
+            uint64_t failures = 0;
+            for (const auto &a : acks_) {
+                if (a.ok) {
+                    acks->ack(a.tag);
+                } else {
+                    ++failures;
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                completed += acks_.size();
+                failed += failures;
+            }
+            cv.notify_all();
+        }
+    };
+
+    namespace {
+
+        // next block to send from a chunk, 0 if there is no checkpoint yet
+        uint32_t read_backfill_checkpoint(const bfs::path &path) {
+            std::ifstream in(path.string());
+            uint32_t next = 0;
+            in >> next;
+            return next;
+        }
+
+        void write_backfill_checkpoint(const bfs::path &path, uint32_t next) {
+            const std::string text = std::to_string(next) + '\n';
+            file_io::write_durably(path, text.data(), text.size());
+        }
+
+    }
+
+    void kinesis_plugin_impl::backfill() {
+        auto progress = std::make_shared<backfill_progress_st>();
+        kinesis_producer_ptr backfill_producer;
+        try {
+            // the callback may outlive this function on an SDK thread, hence the shared progress
+            backfill_producer = make_producer(std::string(), [progress](const std::vector<kinesis_ack> &acks) {
+                progress->on_acks(acks);
+            });
+            while (!done) {
+                const size_t i = next_backfill_chunk++;
+                if (i >= backfill_chunks.size()) {
+                    break;
+                }
+                backfill_chunk(*backfill_producer, *progress, backfill_chunks[i]);
+            }
+        } catch (fc::exception &e) {
+            elog("FC Exception while backfilling ${e}", ("e", e.to_string()));
+        } catch (std::exception &e) {
+            elog("STD Exception while backfilling ${e}", ("e", e.what()));
+        } catch (...) {
+            elog("Unknown exception while backfilling");
+        }
+        if (backfill_producer) {
+            backfill_producer->kinesis_destory();
+        }
+    }
+
+    void kinesis_plugin_impl::backfill_chunk(kinesis_producer &p, backfill_progress_st &progress,
+                                             const backfill_chunk_st &chunk) {
+        const auto checkpoint = backfill_checkpoint_dir / (std::to_string(chunk.first) + "-" +
+                                                           std::to_string(chunk.last));
+        const uint32_t start = std::max(chunk.first, read_backfill_checkpoint(checkpoint));
+        if (start > chunk.last) {
+            return;
+        }
+        ilog("backfilling blocks ${f} to ${l}", ("f", start)("l", chunk.last));
+
+        uint64_t seq;
+        uint64_t sent;
+        {
+            std::lock_guard<std::mutex> lock(progress.mtx);
+            seq = progress.completed;
+            sent = progress.completed;
+            progress.acks.reset(new ack_tracker(seq));
+        }
+        // (first sequence number after the block, block number) of blocks not known to be acknowledged
+        std::deque<std::pair<uint64_t, uint32_t>> pending;
+        uint32_t next = start;
+        uint32_t checkpointed = start;
+        auto advance = [&]() {
+            const uint64_t watermark = progress.acks->watermark();
+            while (!pending.empty() && pending.front().first <= watermark) {
+                next = pending.front().second + 1;
+                pending.pop_front();
+            }
+            if (next != checkpointed) {
+                write_backfill_checkpoint(checkpoint, next);
+                checkpointed = next;
+            }
+        };
+
+        const auto begin = std::chrono::steady_clock::now();
+        auto last_checkpoint = begin;
+        for (uint32_t n = start; n <= chunk.last && !done; ++n) {
+            const uint64_t end = send_backfilled_block(p, n, seq);
+            sent += end - seq;
+            seq = end;
+            pending.emplace_back(seq, n);
+            metrics->backfilled_blocks.add();
+
+            const auto now = std::chrono::steady_clock::now();
+            if (now - last_checkpoint >= std::chrono::seconds(1)) {
+                p.kinesis_poll();
+                advance();
+                last_checkpoint = now;
+            }
+        }
+
+        p.kinesis_flush();
+        uint64_t failed;
+        {
+            std::unique_lock<std::mutex> lock(progress.mtx);
+            progress.cv.wait(lock, [&] { return progress.completed >= sent; });
+            failed = progress.failed;
+            progress.failed = 0;
+        }
+        advance();
+        if (failed > 0) {
+            elog("${n} records of blocks ${f} to ${l} failed, the backfill of these blocks stopped at ${c}; "
+                 "restart to resume", ("n", failed)("f", chunk.first)("l", chunk.last)("c", next));
+        } else if (next > chunk.last) {
+            const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            ilog("backfilled blocks ${f} to ${l} in ${s}s", ("f", start)("l", chunk.last)("s", seconds));
+        }
+    }
+
+    uint64_t kinesis_plugin_impl::send_backfilled_block(kinesis_producer &p, uint32_t block_num, uint64_t seq) {
+        const auto view = block_log->read(block_num);
+        fc::datastream<const char*> ds(view.data, view.size);
+        signed_block block;
+        fc::raw::unpack(ds, block);
+        const fc::time_point block_time = block.timestamp.to_time_point();
+        for (const auto &receipt : block.transactions) {
+            auto payload = serialize_backfilled_transaction(block_num, block_time, receipt);
+            if (p.kinesis_sendmsg(payload.trxtype, payload.partition_key, std::move(payload.data), seq) != 0) {
+                elog("backfilled kinesis record of block ${b} dropped: larger than a Kinesis record", ("b", block_num));
+                metrics->records_failed.add();
+                // never sent, so it does not hold the checkpoint back
+                continue;
+            }
+            ++seq;
+        }
+        return seq;
+    }
+
+    void kinesis_plugin_impl::emit_serialized(bool drain) {
+        // a failed job rethrows when its turn comes; log it and keep emitting the rest
+        while (true) {
+            try {
+                if (drain) {
+                    serializer->drain();
+                } else {
+                    serializer->emit_ready();
+                }
+                return;
+            } catch (fc::exception &e) {
+                elog("FC Exception while serializing applied transaction trace: ${e}", ("e", e.to_detail_string()));
+            } catch (std::exception &e) {
+                elog("STD Exception while serializing applied transaction trace: ${e}", ("e", e.what()));
+            } catch (...) {
+                elog("Unknown exception while serializing applied transaction trace");
+            }
+        }
     }
 
     void kinesis_plugin_impl::_process_accepted_block( const chain::block_state_ptr& bs ) {
+        if (!irreversible_only) {
+            return;
+        }
+        std::vector<trasaction_info_st> applied;
+        auto itr = unaccepted_traces.find(bs->block_num);
+        if (itr != unaccepted_traces.end()) {
+            applied.swap(itr->second);
+            unaccepted_traces.erase(itr);
+        }
+
+        // speculative execution and aborted pending blocks leave traces behind as well; the last trace
+        // of each transaction is the one from applying this block
+        const trasaction_info_st *onblock = nullptr;
+        std::unordered_map<transaction_id_type, const trasaction_info_st *> by_id;
+        for (const auto &t : applied) {
+            const auto &actions = t.trace->action_traces;
+            if (actions.size() == 1 && actions.front().act.account == chain::config::system_account_name &&
+                actions.front().act.name == N(onblock)) {
+                onblock = &t;
+            } else {
+                by_id[t.trace->id] = &t;
+            }
+        }
+
+        block_traces_st block{bs->id, {}};
+        block.traces.reserve(bs->block->transactions.size() + 1);
+        if (onblock != nullptr) {
+            block.traces.push_back(*onblock);
+        }
+        for (const auto &receipt : bs->block->transactions) {
+            const transaction_id_type id = receipt.trx.contains<transaction_id_type>()
+                                           ? receipt.trx.get<transaction_id_type>()
+                                           : receipt.trx.get<packed_transaction>().id();
+            auto found = by_id.find(id);
+            if (found != by_id.end()) {
+                block.traces.push_back(*found->second);
+            }
+        }
+        reversible_traces[bs->block_num].push_back(std::move(block));
     }
 
     void kinesis_plugin_impl::_process_irreversible_block(const chain::block_state_ptr& bs) {
+        if (!irreversible_only) {
+            return;
+        }
+        auto itr = reversible_traces.find(bs->block_num);
+        if (itr != reversible_traces.end()) {
+            for (const auto &block : itr->second) {
+                if (block.id == bs->id) {
+                    // submitted back to back so they end up in the same PutRecords batches
+                    for (const auto &t : block.traces) {
+                        submit_applied_transaction(t);
+                    }
+                    break;
+                }
+            }
+        }
+        // anything else at or below this number was forked out
+        reversible_traces.erase(reversible_traces.begin(), reversible_traces.upper_bound(bs->block_num));
+        unaccepted_traces.erase(unaccepted_traces.begin(), unaccepted_traces.upper_bound(bs->block_num));
+        if (abis) {
+            std::lock_guard<std::mutex> lock(pending_abi_mtx);
+            pending_abi_updates.erase(pending_abi_updates.begin(), pending_abi_updates.upper_bound(bs->block_num));
+        }
+        end_action_block(bs->block_num);
+        mark_block_end(bs->block_num);
+    }
+
+    std::string kinesis_plugin_impl::prometheus_metrics() const {
+        std::ostringstream os;
+        metrics->write_prometheus(os);
+        // (label, size, dropped) of every queue in use; the block rings of the applied transaction
+        // pipeline are labelled after it
+        std::vector<std::tuple<std::string, size_t, uint64_t>> queues;
+        auto add_queue = [&queues](const std::string &label, const auto &q) {
+            if (q) {
+                queues.emplace_back(label, q->size(), q->dropped());
+            }
+        };
+        add_queue("applied_transaction", transaction_trace_queue);
+        add_queue("applied_transaction/accepted_block", block_state_queue);
+        add_queue("applied_transaction/irreversible_block", irreversible_block_state_queue);
+        if (accepted_transaction_pipeline) {
+            add_queue("accepted_transaction", accepted_transaction_pipeline->queue);
+        }
+        if (accepted_block_pipeline) {
+            add_queue("accepted_block", accepted_block_pipeline->queue);
+        }
+        if (irreversible_block_pipeline) {
+            add_queue("irreversible_block", irreversible_block_pipeline->queue);
+        }
+        for (const auto &r : routes) {
+            add_queue(r->pipeline->name, r->pipeline->queue);
+        }
+        os << "# HELP kinesis_queue_size Entries waiting in each event queue.\n# TYPE kinesis_queue_size gauge\n";
+        for (const auto &q : queues) {
+            os << "kinesis_queue_size{queue=\"" << std::get<0>(q) << "\"} " << std::get<1>(q) << '\n';
+        }
+        os << "# HELP kinesis_queue_dropped_total Entries dropped because a queue was full.\n"
+           << "# TYPE kinesis_queue_dropped_total counter\n";
+        for (const auto &q : queues) {
+            os << "kinesis_queue_dropped_total{queue=\"" << std::get<0>(q) << "\"} " << std::get<2>(q) << '\n';
+        }
+        kinesis_metrics::write_gauge(os, "kinesis_serialization_pending", "Traces submitted for serialization and not sent yet.",
+                                     serializer->pending());
+        if (route_budget) {
+            kinesis_metrics::write_gauge(os, "kinesis_route_memory_bytes",
+                                         "Bytes of routed records queued or in flight.", route_budget->used());
+        }
+        if (spill) {
+            kinesis_metrics::write_gauge(os, "kinesis_spill_backlog", "Spill log records not acknowledged yet.",
+                                         spill->end() - spill->committed());
+        }
+        return os.str();
+    }
+
+    void kinesis_plugin_impl::log_metrics() {
+        size_t queue = 0;
+        uint64_t dropped = 0;
+        auto add_queue = [&queue, &dropped](const auto &q) {
+            if (q) {
+                queue += q->size();
+                dropped += q->dropped();
+            }
+        };
+        add_queue(transaction_trace_queue);
+        add_queue(block_state_queue);
+        add_queue(irreversible_block_state_queue);
+        if (accepted_transaction_pipeline) {
+            add_queue(accepted_transaction_pipeline->queue);
+        }
+        if (accepted_block_pipeline) {
+            add_queue(accepted_block_pipeline->queue);
+        }
+        if (irreversible_block_pipeline) {
+            add_queue(irreversible_block_pipeline->queue);
+        }
+        for (const auto &r : routes) {
+            add_queue(r->pipeline->queue);
+        }
+        ilog("kinesis metrics: ${m}; queued ${q}, dropped ${d}${s}",
+             ("m", metrics->summary())("q", queue)("d", dropped)
+             ("s", spill ? ", spill backlog " + std::to_string(spill->end() - spill->committed()) : std::string()));
     }
 
-    kinesis_plugin_impl::kinesis_plugin_impl()
-    :producer(new kinesis_producer) {
+    kinesis_plugin_impl::kinesis_plugin_impl() {
     }
 
     kinesis_plugin_impl::~kinesis_plugin_impl() {
@@ -407,9 +1901,33 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
              ilog( "kinesis_db_plugin shutdown in process please be patient this can take a few minutes" );
              done = true;
              condition.notify_one();
+             if (spill) {
+                // don't let the drain wait for acknowledgements, unsent records are replayed on restart
+                spill->close();
+             }
 
              consume_thread.join();
-             producer->kinesis_destory();
+             stop_pipeline(accepted_transaction_pipeline.get());
+             stop_pipeline(accepted_block_pipeline.get());
+             stop_pipeline(irreversible_block_pipeline.get());
+             for (auto &r : routes) {
+                stop_pipeline(r->pipeline.get());
+             }
+             for (auto &t : backfill_threads) {
+                t.join();
+             }
+             if (spill) {
+                spill_done = true;
+                spill_thread.join();
+             }
+             if (producer) {
+                producer->kinesis_destory();
+             }
+             if (spill) {
+                spill->commit(spill_acks->watermark());
+                spill->sync();
+             }
+             update_checkpoint(true);
           } catch( std::exception& e ) {
              elog( "Exception on kinesis_plugin shutdown of consume thread: ${e}", ("e", e.what()));
           }
@@ -417,9 +1935,72 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
     }
 
     void kinesis_plugin_impl::init() {
+        if (trace_pipeline) {
+            transaction_trace_queue.reset(new spsc_ring<trasaction_info_st>(queue_size, queue_overflow, queue_max_wait));
+            // accepted blocks decide when kinesis-block-start is reached
+            block_state_queue.reset(new spsc_ring<chain::block_state_ptr>(queue_size, queue_overflow, queue_max_wait));
+            if (irreversible_only) {
+                irreversible_block_state_queue.reset(
+                        new spsc_ring<chain::block_state_ptr>(queue_size, queue_overflow, queue_max_wait));
+            }
+        }
+        serializer.reset(new ordered_worker_pool<payload_st>(
+                serialization_threads, std::max<size_t>(1, serialization_threads) * 64,
+                [this](payload_st &p) { send_payload(p); },
+                [this]() { notify_consumer(); }));
+
+        last_metrics_log = std::chrono::steady_clock::now();
+        last_checkpoint = last_metrics_log;
 
         ilog("starting kinesis plugin thread");
         consume_thread = boost::thread([this] { consume_blocks(); });
+        if (spill) {
+            spill_thread = boost::thread([this] { send_spilled(); });
+        }
+        if (accepted_transaction_pipeline) {
+            auto &p = *accepted_transaction_pipeline;
+            p.thread = boost::thread([this, &p] {
+                run_pipeline(p, [this, &p](const accepted_transaction_st &t) {
+                    if (t.block_number >= start_block_num) {
+                        send_event(p, serialize_accepted_transaction(t));
+                    }
+                });
+            });
+        }
+        if (accepted_block_pipeline) {
+            auto &p = *accepted_block_pipeline;
+            p.thread = boost::thread([this, &p] {
+                run_pipeline(p, [this, &p](const block_event_st &b) {
+                    if (b.block_number >= start_block_num) {
+                        send_event(p, serialize_block(ACCEPTED_BLOCK, b));
+                    }
+                });
+            });
+        }
+        if (irreversible_block_pipeline) {
+            auto &p = *irreversible_block_pipeline;
+            p.thread = boost::thread([this, &p] {
+                run_pipeline(p, [this, &p](const block_event_st &b) {
+                    if (b.block_number >= start_block_num) {
+                        send_event(p, serialize_block(IRREVERSIBLE_BLOCK, b));
+                    }
+                });
+            });
+        }
+        for (auto &r : routes) {
+            auto &p = *r->pipeline;
+            route_st *route = r.get();
+            p.thread = boost::thread([this, &p, route] {
+                run_pipeline(p, [this, route](payload_st &payload) { send_routed(*route, payload); });
+            });
+        }
+        if (!backfill_chunks.empty()) {
+            ilog("starting ${n} kinesis backfill threads for ${c} chunks",
+                 ("n", backfill_thread_count)("c", backfill_chunks.size()));
+            for (size_t i = 0; i < backfill_thread_count; ++i) {
+                backfill_threads.emplace_back([this] { backfill(); });
+            }
+        }
         startup = false;
     }
 
@@ -440,10 +2021,146 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
                  "AWS region name in string, e.g. 'ap-northeast-1'")
                 ("aws-stream-name", bpo::value<std::string>(),
                  "The stream name for AWS kinesis.")
+                ("kinesis-endpoint", bpo::value<std::string>()->default_value(""),
+                 "Override of the Kinesis endpoint, e.g. 'http://127.0.0.1:4567' for a local stand-in.")
                 ("kinesis-block-start", bpo::value<uint32_t>()->default_value(256),
                  "If specified then only abi data pushed to kinesis until specified block is reached.")
+                ("kinesis-events", bpo::value<std::string>()->default_value("applied_transaction"),
+                 "Comma separated event types to send, each through its own queue, thread and producer: "
+                 "applied_transaction (traces), accepted_transaction, accepted_block, irreversible_block. "
+                 "Signals of other event types are not subscribed to.")
+                ("kinesis-batch-max-records", bpo::value<uint32_t>()->default_value(500),
+                 "Maximum number of records sent in a single PutRecords call (at most 500).")
+                ("kinesis-batch-max-bytes", bpo::value<uint32_t>()->default_value(5 * 1024 * 1024),
+                 "Maximum number of bytes sent in a single PutRecords call (at most 5 MiB).")
+                ("kinesis-batch-linger-ms", bpo::value<uint32_t>()->default_value(100),
+                 "Maximum time in milliseconds a record is buffered before its batch is sent.")
+                ("kinesis-aggregation-enabled", bpo::bool_switch()->default_value(false),
+                 "Pack multiple traces of the same shard into one Kinesis record using the KPL aggregated record format. "
+                 "Requires kinesis-shard-refresh-sec.")
+                ("kinesis-aggregation-max-bytes", bpo::value<uint32_t>()->default_value(1024 * 1024),
+                 "Maximum size in bytes of an aggregated record (at most 1 MiB).")
+                ("kinesis-queue-size", bpo::value<uint32_t>()->default_value(16384),
+                 "Capacity of each event queue between the chain thread and the kinesis thread.")
+                ("kinesis-queue-overflow", bpo::value<std::string>()->default_value("block"),
+                 "What to do when a queue is full: 'block' (wait at most kinesis-queue-max-wait-ms, then drop), "
+                 "'drop', or 'spill' (to an unbounded overflow list).")
+                ("kinesis-queue-max-wait-ms", bpo::value<uint32_t>()->default_value(100),
+                 "Maximum time the chain thread waits for room in a full queue with kinesis-queue-overflow=block.")
+                ("kinesis-output-format", bpo::value<std::string>()->default_value("json"),
+                 "Record format: 'json', or 'binary' (versioned envelope plus packed trace, see kinesis_trace.abi).")
+                ("kinesis-compression", bpo::value<std::string>()->default_value("none"),
+                 "Compress each record (each aggregated record with aggregation): 'none', 'zstd' or 'lz4'. "
+                 "Compressed records start with a codec byte.")
+                ("kinesis-compression-level", bpo::value<int>()->default_value(3),
+                 "Compression level for zstd, acceleration factor for lz4.")
+                ("kinesis-compression-dictionary", bpo::value<std::string>()->default_value(""),
+                 "Optional dictionary file, e.g. trained with 'zstd --train' on sample records.")
+                ("kinesis-serialization-threads", bpo::value<uint32_t>()->default_value(2),
+                 "Number of threads serializing traces. Records are still sent in order; 0 serializes on the kinesis thread.")
+                ("kinesis-partition-strategy", bpo::value<std::string>()->default_value("block"),
+                 "Partition key of each record: 'block' (block number), 'transaction' (transaction id), "
+                 "'account' (receiver of the first action) or 'explicit-hash' (spread evenly over the open shards).")
+                ("kinesis-shard-refresh-sec", bpo::value<uint32_t>()->default_value(60),
+                 "How often the stream's shard map is refreshed with ListShards, 0 to disable. "
+                 "Required by the explicit-hash strategy.")
+                ("kinesis-max-in-flight", bpo::value<uint32_t>()->default_value(4),
+                 "Maximum number of concurrent PutRecords calls. Records with the same partition key stay in order.")
+                ("kinesis-retry-max", bpo::value<uint32_t>()->default_value(8),
+                 "How many times a record rejected for throttling or an internal failure is resent.")
+                ("kinesis-retry-base-ms", bpo::value<uint32_t>()->default_value(100),
+                 "Backoff before the first retry; doubled on each attempt and randomized (full jitter).")
+                ("kinesis-retry-max-backoff-ms", bpo::value<uint32_t>()->default_value(5000),
+                 "Upper bound of the retry backoff.")
+                ("kinesis-shard-rate-limit", bpo::value<bool>()->default_value(true),
+                 "Pace PutRecords calls to the write limits of the shards (1000 records and 1 MiB per second each), "
+                 "slowing down while Kinesis throttles. Requires kinesis-shard-refresh-sec.")
+                ("kinesis-spill-dir", bpo::value<bfs::path>()->default_value(""),
+                 "Directory of a durable on-disk log between nodeos and Kinesis (relative paths are under the data "
+                 "dir). Records not acknowledged by Kinesis are resent after a restart. Empty disables the log.")
+                ("kinesis-spill-segment-mb", bpo::value<uint32_t>()->default_value(64),
+                 "Size of each spill log segment file in MiB.")
+                ("kinesis-spill-max-mb", bpo::value<uint32_t>()->default_value(4096),
+                 "Maximum size of the spill log in MiB; the kinesis thread waits for acknowledgements beyond it.")
+                ("kinesis-spill-sync-ms", bpo::value<uint32_t>()->default_value(1000),
+                 "How often the spill log is flushed to disk.")
+                ("kinesis-speculative-traces", bpo::value<std::string>()->default_value("all"),
+                 "Traces of speculative executions to send: 'all', or 'final' to hold them on the chain thread until "
+                 "their block is accepted and send only the last execution of each transaction in the block.")
+                ("kinesis-speculative-capacity", bpo::value<uint32_t>()->default_value(16384),
+                 "Number of transactions per pending block held with kinesis-speculative-traces=final; "
+                 "traces beyond it are sent as they come.")
+                ("kinesis-actions-dir", bpo::value<bfs::path>()->default_value(""),
+                 "Directory to write the actions of the traces sent to as columnar batches (relative paths are under "
+                 "the data dir), in files of kinesis-actions-file-blocks blocks. Empty disables it.")
+                ("kinesis-actions-stream", bpo::bool_switch()->default_value(false),
+                 "Also send the columnar action batches as records of the applied transaction stream.")
+                ("kinesis-actions-batch-blocks", bpo::value<uint32_t>()->default_value(100),
+                 "Number of blocks whose actions make up one columnar batch.")
+                ("kinesis-actions-file-blocks", bpo::value<uint32_t>()->default_value(10000),
+                 "Number of blocks of each columnar action batch file, a multiple of kinesis-actions-batch-blocks.")
+                ("kinesis-block-content", bpo::value<std::string>()->default_value("header"),
+                 "Content of accepted_block and irreversible_block records: 'header' (id, previous, producer, "
+                 "transaction count and last irreversible block) or 'full' (also the signed block with its "
+                 "transaction receipts).")
+                ("kinesis-irreversible-only", bpo::bool_switch()->default_value(false),
+                 "Hold traces back until their block becomes irreversible and drop those of forked out blocks.")
+                ("kinesis-abi-decode", bpo::bool_switch()->default_value(false),
+                 "Decode action data with the contract's ABI in JSON records (the hex is kept as hex_data).")
+                ("kinesis-abi-cache-size", bpo::value<uint32_t>()->default_value(1024),
+                 "Number of contract ABIs kept for decoding.")
+                ("kinesis-trace-fields", bpo::value<std::string>()->default_value(""),
+                 "Comma separated transaction trace fields to send (id, receipt, elapsed, net_usage, scheduled, "
+                 "action_traces, except); empty sends all of them.")
+                ("kinesis-action-fields", bpo::value<std::string>()->default_value(""),
+                 "Comma separated action trace fields to send (receipt, act, context_free, elapsed, console, trx_id, "
+                 "block_num, block_time, producer_block_id, account_ram_deltas, inline_traces); empty sends all of them.")
+                ("kinesis-receipt-fields", bpo::value<std::string>()->default_value(""),
+                 "Comma separated action receipt fields to send (receiver, act_digest, global_sequence, recv_sequence, "
+                 "auth_sequence, code_sequence, abi_sequence); empty sends all of them.")
+                ("kinesis-checkpoint-file", bpo::value<bfs::path>()->default_value(""),
+                 "File keeping the highest block whose records have all been acknowledged (relative paths are under "
+                 "the data dir), e.g. kinesis-checkpoint. Traces of blocks up to it are skipped after a restart. "
+                 "Empty (the default) disables it.")
+                ("kinesis-checkpoint-sync-ms", bpo::value<uint32_t>()->default_value(1000),
+                 "How often the checkpoint file is written and synced.")
+                ("kinesis-backfill-range", bpo::value<vector<string>>()->composing()->multitoken(),
+                 "Blocks to send from blocks.log as backfilled transactions, e.g. '1-5000000'. "
+                 "May be specified multiple times.")
+                ("kinesis-backfill-threads", bpo::value<uint32_t>()->default_value(4),
+                 "Number of backfill workers, each with its own producer.")
+                ("kinesis-backfill-chunk-blocks", bpo::value<uint32_t>()->default_value(100000),
+                 "Backfill ranges are split into chunks of this many blocks, the unit of work and of checkpoints. "
+                 "Changing it restarts backfills that have not completed.")
+                ("kinesis-backfill-checkpoint-dir", bpo::value<bfs::path>()->default_value("kinesis-backfill"),
+                 "Directory of the backfill checkpoints (relative paths are under the data dir).")
+                ("kinesis-metrics-log-sec", bpo::value<uint32_t>()->default_value(60),
+                 "How often a summary of the plugin's metrics is logged, 0 to disable. The metrics are also served "
+                 "in Prometheus text format at /v1/kinesis/metrics when http_plugin is enabled.")
+                ("kinesis-filter-on", bpo::value<vector<string>>()->composing(),
+                 "Only send actions matching receiver:account:action:actor (or receiver:action:actor), "
+                 "blank fields match anything. Traces without such actions are skipped. Default sends everything.")
+                ("kinesis-filter-out", bpo::value<vector<string>>()->composing(),
+                 "Do not send actions matching receiver:account:action:actor (or receiver:action:actor), "
+                 "blank fields match anything.")
+                ("kinesis-route", bpo::value<vector<string>>()->composing(),
+                 "stream=receiver:account:action:actor; also send trace records with an action matching the rule "
+                 "to the stream, with its own producer. May be specified multiple times, up to 32 streams.")
+                ("kinesis-route-only", bpo::bool_switch()->default_value(false),
+                 "Do not send trace records that match a route to the applied transaction stream.")
+                ("kinesis-route-memory-mb", bpo::value<uint32_t>()->default_value(256),
+                 "Memory for routed records queued or in flight, shared by all routes; each route may hold "
+                 "half of it, or all of it if it is the only one. Records beyond it are dropped for that route.")
 
                  ;
+        for (const std::string event : {"applied-transaction", "accepted-transaction", "accepted-block",
+                                        "irreversible-block"}) {
+            cfg.add_options()
+                    (("kinesis-" + event + "-stream").c_str(), bpo::value<std::string>()->default_value(""),
+                     ("Stream of the " + event + " events, aws-stream-name if empty.").c_str())
+                    (("kinesis-" + event + "-priority").c_str(), bpo::value<int>()->default_value(0),
+                     ("Nice value of the " + event + " thread (-20 to 19); negative values need CAP_SYS_NICE.").c_str());
+        }
     }
 
     void kinesis_plugin::plugin_initialize(const variables_map &options) {
@@ -463,14 +2180,272 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
                 aws_stream_name = "EOS_Asia_Kinesis";
             }
 
-            if (0!=my->producer->kinesis_init(aws_stream_name, aws_region_name)) {
-                elog("kinesis_init fail");
+            const auto compression = options.at("kinesis-compression").as<std::string>();
+            compression_codec codec = compression_codec::none;
+            if (compression == "zstd") {
+                codec = compression_codec::zstd;
+            } else if (compression == "lz4") {
+                codec = compression_codec::lz4;
+            } else {
+                EOS_ASSERT(compression == "none", chain::plugin_config_exception,
+                           "Invalid kinesis-compression: ${c}", ("c", compression));
+            }
+            EOS_ASSERT(kinesis_compressor::supported(codec), chain::plugin_config_exception,
+                       "kinesis_plugin was built without ${c} support", ("c", compression));
+            const auto strategy = options.at("kinesis-partition-strategy").as<std::string>();
+            if (strategy == "block") {
+                my->trace_records.partitioning = partition_strategy::block;
+            } else if (strategy == "transaction") {
+                my->trace_records.partitioning = partition_strategy::transaction;
+            } else if (strategy == "account") {
+                my->trace_records.partitioning = partition_strategy::account;
+            } else if (strategy == "explicit-hash") {
+                my->trace_records.partitioning = partition_strategy::explicit_hash;
             } else {
-                elog("kinesis_init ok");
+                EOS_ASSERT(false, chain::plugin_config_exception,
+                           "Invalid kinesis-partition-strategy: ${s}", ("s", strategy));
+            }
+            const auto shard_refresh = options.at("kinesis-shard-refresh-sec").as<uint32_t>();
+            EOS_ASSERT(shard_refresh > 0 || my->trace_records.partitioning != partition_strategy::explicit_hash,
+                       chain::plugin_config_exception, "explicit-hash partitioning requires kinesis-shard-refresh-sec");
+            EOS_ASSERT(shard_refresh > 0 || !options.at("kinesis-aggregation-enabled").as<bool>(),
+                       chain::plugin_config_exception, "kinesis-aggregation-enabled requires kinesis-shard-refresh-sec");
+
+            // the main producer and each backfill worker's producer are configured alike
+            const auto endpoint = options.at("kinesis-endpoint").as<std::string>();
+            const auto batch_records = options.at("kinesis-batch-max-records").as<uint32_t>();
+            const auto batch_bytes = options.at("kinesis-batch-max-bytes").as<uint32_t>();
+            const auto batch_linger = options.at("kinesis-batch-linger-ms").as<uint32_t>();
+            const auto aggregate = options.at("kinesis-aggregation-enabled").as<bool>();
+            const auto aggregate_bytes = options.at("kinesis-aggregation-max-bytes").as<uint32_t>();
+            const auto compression_level = options.at("kinesis-compression-level").as<int>();
+            const auto compression_dictionary = options.at("kinesis-compression-dictionary").as<std::string>();
+            const bool spread = my->trace_records.partitioning == partition_strategy::explicit_hash;
+            const auto max_in_flight = options.at("kinesis-max-in-flight").as<uint32_t>();
+            const auto retry_max = options.at("kinesis-retry-max").as<uint32_t>();
+            const auto retry_base = options.at("kinesis-retry-base-ms").as<uint32_t>();
+            const auto retry_max_backoff = options.at("kinesis-retry-max-backoff-ms").as<uint32_t>();
+            const auto rate_limit = options.at("kinesis-shard-rate-limit").as<bool>();
+            const auto metrics = my->metrics;
+            my->make_producer = [=](const std::string &stream, kinesis_producer::completion_callback callback) {
+                auto p = std::make_shared<kinesis_producer>();
+                p->kinesis_set_endpoint(endpoint);
+                p->kinesis_set_batch_limits(batch_records, batch_bytes, batch_linger);
+                p->kinesis_set_aggregation(aggregate, aggregate_bytes);
+                p->kinesis_set_compression(codec, compression_level, compression_dictionary);
+                p->kinesis_set_shard_refresh(shard_refresh);
+                p->kinesis_set_explicit_hash_spread(spread);
+                p->kinesis_set_max_in_flight(max_in_flight);
+                p->kinesis_set_retry(retry_max, retry_base, retry_max_backoff);
+                p->kinesis_set_shard_rate_limit(rate_limit);
+                p->kinesis_set_completion_callback(std::move(callback));
+                p->kinesis_set_metrics(metrics);
+                if (0!=p->kinesis_init(stream.empty() ? aws_stream_name : stream, aws_region_name)) {
+                    elog("kinesis_init fail");
+                } else {
+                    elog("kinesis_init ok");
+                }
+                return p;
+            };
+
+            std::set<std::string> events;
+            {
+                std::istringstream in(options.at("kinesis-events").as<std::string>());
+                std::string event;
+                while (std::getline(in, event, ',')) {
+                    boost::algorithm::trim(event);
+                    EOS_ASSERT(event == "applied_transaction" || event == "accepted_transaction" ||
+                               event == "accepted_block" || event == "irreversible_block",
+                               chain::plugin_config_exception, "Invalid kinesis-events entry: ${e}", ("e", event));
+                    events.insert(event);
+                }
+            }
+            // options of an event type use dashes, e.g. kinesis-accepted-block-stream
+            auto event_option = [&options](std::string event, const std::string &suffix) -> const bpo::variable_value & {
+                std::replace(event.begin(), event.end(), '_', '-');
+                return options.at("kinesis-" + event + "-" + suffix);
+            };
+            my->trace_pipeline = events.count("applied_transaction") > 0;
+            my->trace_priority = event_option("applied_transaction", "priority").as<int>();
+
+            auto spill_dir = options.at("kinesis-spill-dir").as<bfs::path>();
+            EOS_ASSERT(spill_dir.empty() || my->trace_pipeline, chain::plugin_config_exception,
+                       "kinesis-spill-dir requires the applied_transaction event");
+            if (!spill_dir.empty()) {
+                if (spill_dir.is_relative()) {
+                    spill_dir = app().data_dir() / spill_dir;
+                }
+                const uint64_t segment_size = uint64_t(options.at("kinesis-spill-segment-mb").as<uint32_t>()) * 1024 * 1024;
+                const uint64_t max_size = uint64_t(options.at("kinesis-spill-max-mb").as<uint32_t>()) * 1024 * 1024;
+                EOS_ASSERT(segment_size >= 2 * 1024 * 1024, chain::plugin_config_exception,
+                           "kinesis-spill-segment-mb must be at least 2");
+                EOS_ASSERT(max_size >= 2 * segment_size, chain::plugin_config_exception,
+                           "kinesis-spill-max-mb must hold at least two segments");
+                my->spill.reset(new spill_log(spill_dir, segment_size, max_size));
+                my->spill_acks.reset(new ack_tracker(my->spill->committed()));
+                my->spill_sync_interval = std::chrono::milliseconds(options.at("kinesis-spill-sync-ms").as<uint32_t>());
+                ilog("kinesis spill log at ${d}, ${n} unacknowledged records to replay",
+                     ("d", spill_dir.generic_string())("n", my->spill->end() - my->spill->committed()));
+            }
+
+            auto actions_dir = options.at("kinesis-actions-dir").as<bfs::path>();
+            my->action_batches_to_stream = options.at("kinesis-actions-stream").as<bool>();
+            if (!actions_dir.empty() || my->action_batches_to_stream) {
+                EOS_ASSERT(my->trace_pipeline, chain::plugin_config_exception,
+                           "kinesis-actions-dir and kinesis-actions-stream require the applied_transaction event");
+                my->action_batch_blocks = options.at("kinesis-actions-batch-blocks").as<uint32_t>();
+                my->action_file_blocks = options.at("kinesis-actions-file-blocks").as<uint32_t>();
+                EOS_ASSERT(my->action_batch_blocks > 0 && my->action_file_blocks % my->action_batch_blocks == 0 &&
+                           my->action_file_blocks > 0, chain::plugin_config_exception,
+                           "kinesis-actions-file-blocks must be a multiple of kinesis-actions-batch-blocks");
+                if (!actions_dir.empty()) {
+                    if (actions_dir.is_relative()) {
+                        actions_dir = app().data_dir() / actions_dir;
+                    }
+                    bfs::create_directories(actions_dir);
+                    my->action_batch_dir = actions_dir;
+                }
+                my->action_batches.reset(new action_batch_writer());
+            }
+
+            // the checkpoint tracks the applied transaction pipeline only
+            auto checkpoint_file = options.at("kinesis-checkpoint-file").as<bfs::path>();
+            if (!checkpoint_file.empty() && my->trace_pipeline) {
+                if (checkpoint_file.is_relative()) {
+                    checkpoint_file = app().data_dir() / checkpoint_file;
+                }
+                my->checkpoint.reset(new delivery_checkpoint(checkpoint_file));
+                my->checkpoint_interval = std::chrono::milliseconds(options.at("kinesis-checkpoint-sync-ms").as<uint32_t>());
+                my->delivered_block = my->checkpoint->block_num();
+                my->marked_block = my->delivered_block;
+                if (!my->spill) {
+                    my->delivery_acks.reset(new ack_tracker());
+                }
+                ilog("kinesis checkpoint at ${f}: blocks up to ${b} were delivered (sequence number ${s})",
+                     ("f", checkpoint_file.generic_string())("b", my->delivered_block)
+                     ("s", my->checkpoint->sequence_number()));
+            }
+
+            auto impl = my.get();
+            if (my->trace_pipeline) {
+                my->producer = my->make_producer(event_option("applied_transaction", "stream").as<std::string>(),
+                                                 [impl](const std::vector<kinesis_ack>& acks) {
+                                                     impl->on_acks(acks);
+                                                 });
             }
             ilog("initializing kinesis_plugin");
             my->configured = true;
 
+            my->queue_size = options.at("kinesis-queue-size").as<uint32_t>();
+            my->queue_max_wait = std::chrono::milliseconds(options.at("kinesis-queue-max-wait-ms").as<uint32_t>());
+            const auto overflow = options.at("kinesis-queue-overflow").as<std::string>();
+            if (overflow == "block") {
+                my->queue_overflow = overflow_policy::block;
+            } else if (overflow == "drop") {
+                my->queue_overflow = overflow_policy::drop;
+            } else if (overflow == "spill") {
+                my->queue_overflow = overflow_policy::spill;
+            } else {
+                EOS_ASSERT(false, chain::plugin_config_exception, "Invalid kinesis-queue-overflow: ${o}", ("o", overflow));
+            }
+
+            auto enable = [&](auto &pipeline, const std::string &event) {
+                if (events.count(event)) {
+                    my->enable_pipeline(pipeline, event, event_option(event, "stream").as<std::string>(),
+                                        event_option(event, "priority").as<int>(),
+                                        [](const std::vector<kinesis_ack> &acks) { log_failed_acks(acks); });
+                }
+            };
+            const auto content = options.at("kinesis-block-content").as<std::string>();
+            if (content == "header") {
+                my->block_records = block_content::header;
+            } else if (content == "full") {
+                my->block_records = block_content::full;
+            } else {
+                EOS_ASSERT(false, chain::plugin_config_exception, "Invalid kinesis-block-content: ${c}", ("c", content));
+            }
+            enable(my->accepted_transaction_pipeline, "accepted_transaction");
+            enable(my->accepted_block_pipeline, "accepted_block");
+            enable(my->irreversible_block_pipeline, "irreversible_block");
+
+            if (options.count("kinesis-route")) {
+                EOS_ASSERT(my->trace_pipeline, chain::plugin_config_exception,
+                           "kinesis-route requires the applied_transaction event");
+                my->route_only = options.at("kinesis-route-only").as<bool>();
+                my->route_budget.reset(new memory_budget(
+                        size_t(options.at("kinesis-route-memory-mb").as<uint32_t>()) * 1024 * 1024));
+                std::map<std::string, kinesis_plugin_impl::route_st *> by_stream;
+                for (const auto &route : options["kinesis-route"].as<vector<string>>()) {
+                    const auto eq = route.find('=');
+                    EOS_ASSERT(eq != std::string::npos && eq > 0, chain::plugin_config_exception,
+                               "Invalid kinesis-route, expected stream=rule: ${r}", ("r", route));
+                    const auto stream = route.substr(0, eq);
+                    auto &r = by_stream[stream];
+                    if (r == nullptr) {
+                        EOS_ASSERT(my->routes.size() < kinesis_plugin_impl::kMAX_ROUTES, chain::plugin_config_exception,
+                                   "kinesis-route supports at most ${n} streams", ("n", uint32_t(kinesis_plugin_impl::kMAX_ROUTES)));
+                        my->routes.emplace_back(new kinesis_plugin_impl::route_st());
+                        r = my->routes.back().get();
+                        r->stream = stream;
+                        auto budget = my->route_budget.get();
+                        my->enable_pipeline(r->pipeline, "route/" + stream, stream, my->trace_priority,
+                                            [budget, r](const std::vector<kinesis_ack> &acks) {
+                                                size_t bytes = 0;
+                                                for (const auto &a : acks) {
+                                                    bytes += a.tag;
+                                                }
+                                                budget->release(r->held, bytes);
+                                                log_failed_acks(acks);
+                                            });
+                    }
+                    try {
+                        r->rules.include(route.substr(eq + 1));
+                    } catch (const std::invalid_argument &e) {
+                        EOS_ASSERT(false, chain::plugin_config_exception, "${e}", ("e", e.what()));
+                    }
+                }
+                my->route_cap = my->routes.size() > 1 ? my->route_budget->limit() / 2 : my->route_budget->limit();
+            }
+
+            my->serialization_threads = options.at("kinesis-serialization-threads").as<uint32_t>();
+            my->irreversible_only = options.at("kinesis-irreversible-only").as<bool>();
+            const auto speculative = options.at("kinesis-speculative-traces").as<std::string>();
+            EOS_ASSERT(speculative == "all" || speculative == "final", chain::plugin_config_exception,
+                       "Invalid kinesis-speculative-traces: ${s}", ("s", speculative));
+            if (speculative == "final" && my->trace_pipeline) {
+                my->speculative_index.reset(
+                        new fingerprint_index(std::max<uint32_t>(1, options.at("kinesis-speculative-capacity").as<uint32_t>())));
+                my->speculative_traces.reserve(my->speculative_index->capacity());
+            }
+            my->metrics_log_interval = std::chrono::seconds(options.at("kinesis-metrics-log-sec").as<uint32_t>());
+
+            try {
+                if (options.count("kinesis-filter-on")) {
+                    for (const auto &rule : options["kinesis-filter-on"].as<vector<string>>()) {
+                        my->filter.include(rule);
+                    }
+                }
+                if (options.count("kinesis-filter-out")) {
+                    for (const auto &rule : options["kinesis-filter-out"].as<vector<string>>()) {
+                        my->filter.exclude(rule);
+                    }
+                }
+                my->trace_records.projection.set_trace_fields(options.at("kinesis-trace-fields").as<std::string>());
+                my->trace_records.projection.set_action_fields(options.at("kinesis-action-fields").as<std::string>());
+                my->trace_records.projection.set_receipt_fields(options.at("kinesis-receipt-fields").as<std::string>());
+            } catch (const std::invalid_argument &e) {
+                EOS_ASSERT(false, chain::plugin_config_exception, "${e}", ("e", e.what()));
+            }
+
+            const auto format = options.at("kinesis-output-format").as<std::string>();
+            if (format == "json") {
+                my->trace_records.format = output_format::json;
+            } else if (format == "binary") {
+                my->trace_records.format = output_format::binary;
+            } else {
+                EOS_ASSERT(false, chain::plugin_config_exception, "Invalid kinesis-output-format: ${f}", ("f", format));
+            }
+
             if ( options.count( "kinesis-block-start" )) {
                 my->start_block_num = options.at( "kinesis-block-start" ).as<uint32_t>();
             }
@@ -478,30 +2453,82 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
                 my->start_block_reached = true;
             }
 
+            if (options.count("kinesis-backfill-range")) {
+                auto blocks_dir = options.count("blocks-dir") ? options.at("blocks-dir").as<bfs::path>()
+                                                              : bfs::path("blocks");
+                if (blocks_dir.is_relative()) {
+                    blocks_dir = app().data_dir() / blocks_dir;
+                }
+                my->block_log.reset(new block_log_reader(blocks_dir));
+                const uint32_t chunk_blocks = std::max<uint32_t>(1, options.at("kinesis-backfill-chunk-blocks").as<uint32_t>());
+                for (const auto &range : options["kinesis-backfill-range"].as<vector<string>>()) {
+                    uint32_t first = 0;
+                    uint32_t last = 0;
+                    char rest;
+                    EOS_ASSERT(sscanf(range.c_str(), "%u-%u%c", &first, &last, &rest) == 2 && first <= last,
+                               chain::plugin_config_exception, "Invalid kinesis-backfill-range: ${r}", ("r", range));
+                    EOS_ASSERT(first >= my->block_log->first_block_num() && last <= my->block_log->last_block_num(),
+                               chain::plugin_config_exception,
+                               "kinesis-backfill-range ${r} is outside of the block log (blocks ${f} to ${l})",
+                               ("r", range)("f", my->block_log->first_block_num())("l", my->block_log->last_block_num()));
+                    // chunks are aligned to multiples of the chunk size so their checkpoints survive overlapping ranges
+                    for (uint64_t chunk_first = first; chunk_first <= last;) {
+                        const uint64_t chunk_last = std::min<uint64_t>(last, (chunk_first / chunk_blocks + 1) * chunk_blocks - 1);
+                        my->backfill_chunks.push_back({static_cast<uint32_t>(chunk_first), static_cast<uint32_t>(chunk_last)});
+                        chunk_first = chunk_last + 1;
+                    }
+                }
+                my->backfill_thread_count = std::max<uint32_t>(1, options.at("kinesis-backfill-threads").as<uint32_t>());
+                my->backfill_checkpoint_dir = options.at("kinesis-backfill-checkpoint-dir").as<bfs::path>();
+                if (my->backfill_checkpoint_dir.is_relative()) {
+                    my->backfill_checkpoint_dir = app().data_dir() / my->backfill_checkpoint_dir;
+                }
+                bfs::create_directories(my->backfill_checkpoint_dir);
+                ilog("kinesis backfill of ${n} chunks from ${d}, checkpoints in ${c}",
+                     ("n", my->backfill_chunks.size())("d", blocks_dir.generic_string())
+                     ("c", my->backfill_checkpoint_dir.generic_string()));
+            }
+
             // hook up to signals on controller
             //chain_plugin* chain_plug = app().find_plugiin<chain_plugin>();
             my->chain_plug = app().find_plugin<chain_plugin>();
             EOS_ASSERT(my->chain_plug, chain::missing_chain_plugin_exception, "");
             auto &chain = my->chain_plug->chain();
             my->chain_id.emplace(chain.get_chain_id());
+            my->abi_serializer_max_time = my->chain_plug->get_abi_serializer_max_time();
+
+            if (options.at("kinesis-abi-decode").as<bool>()) {
+                auto impl = my.get();
+                my->abis.reset(new abi_cache(options.at("kinesis-abi-cache-size").as<uint32_t>(),
+                                             my->abi_serializer_max_time, my->abi_retry_after,
+                                             [impl](const account_name &a) { return impl->load_abi(a); }));
+                my->trace_records.abis = my->abis.get();
+            }
 
-            my->accepted_block_connection.emplace( chain.accepted_block.connect( [&]( const chain::block_state_ptr& bs ) {
-                my->accepted_block(bs);
-            }));
-
-            my->irreversible_block_connection.emplace(
-                    chain.irreversible_block.connect([&](const chain::block_state_ptr &bs) {
-                        my->applied_irreversible_block(bs);
-                    }));
-
-            my->accepted_transaction_connection.emplace(
-                    chain.accepted_transaction.connect([&](const chain::transaction_metadata_ptr &t) {
-                        my->accepted_transaction(t);
-                    }));
-            my->applied_transaction_connection.emplace(
-                    chain.applied_transaction.connect([&](const chain::transaction_trace_ptr &t) {
-                        my->applied_transaction(t);
-                    }));
+            // only the signals some pipeline uses, the others cost the chain thread nothing
+            if (my->trace_pipeline || my->accepted_block_pipeline) {
+                my->accepted_block_connection.emplace( chain.accepted_block.connect( [&]( const chain::block_state_ptr& bs ) {
+                    my->accepted_block(bs);
+                }));
+            }
+            if ((my->trace_pipeline && my->irreversible_only) || my->irreversible_block_pipeline) {
+                my->irreversible_block_connection.emplace(
+                        chain.irreversible_block.connect([&](const chain::block_state_ptr &bs) {
+                            my->applied_irreversible_block(bs);
+                        }));
+            }
+            if (my->accepted_transaction_pipeline) {
+                my->accepted_transaction_connection.emplace(
+                        chain.accepted_transaction.connect([&](const chain::transaction_metadata_ptr &t) {
+                            my->accepted_transaction(t);
+                        }));
+            }
+            if (my->trace_pipeline) {
+                my->applied_transaction_connection.emplace(
+                        chain.applied_transaction.connect([&](const chain::transaction_trace_ptr &t) {
+                            my->applied_transaction(t);
+                        }));
+            }
             my->init();
         }
 
@@ -509,6 +2536,20 @@ using kinesis_producer_ptr = std::shared_ptr<class kinesis_producer>;
     }
 
     void kinesis_plugin::plugin_startup() {
+        // optional, only served when http_plugin is enabled as well
+        auto http = app().find_plugin<http_plugin>();
+        if (http != nullptr && http->get_state() != abstract_plugin::registered) {
+            std::weak_ptr<kinesis_plugin_impl> weak_impl = my;
+            http->add_api({{std::string("/v1/kinesis/metrics"),
+                            [weak_impl](std::string, std::string, url_response_callback cb) {
+                                auto impl = weak_impl.lock();
+                                if (!impl) {
+                                    cb(503, "kinesis_plugin is shutting down\n");
+                                    return;
+                                }
+                                cb(200, impl->prometheus_metrics());
+                            }}});
+        }
     }
 
     void kinesis_plugin::plugin_shutdown() {
@@ -4,9 +4,9 @@ int main(int argc, char **argv)
 {
 	unsigned char buf[512] = "abcdefghijkl";
     eosio::kinesis_producer producer;
-    producer.kinesis_init();
+    producer.kinesis_init(eosio::kSTREAM_NAME, eosio::kREGION_NAME);
 
-    producer.kinesis_sendmsg(1, buf, 12);
+    producer.kinesis_sendmsg(1, "1", buf, 12);
 
     producer.kinesis_destory();
 }
@@ -0,0 +1,178 @@
+// Enqueue latency of the chain-thread hook: the spsc_ring used by kinesis_plugin
+// versus the mutex + condition_variable + deque queue it replaced.
+//
+//   kinesis_queue_bench [entries] [queue_size] [consumer_work_ns]
+#include <eosio/kinesis_plugin/spsc_ring.hpp>
+
+#include <boost/chrono.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace {
+
+using entry = std::shared_ptr<int>;
+using bench_clock = std::chrono::steady_clock;
+
+void busy_wait(uint64_t ns) {
+  const auto until = bench_clock::now() + std::chrono::nanoseconds(ns);
+  while (bench_clock::now() < until) {
+  }
+}
+
+// The queue() helper and consume loop kinesis_plugin used before the ring buffer.
+struct legacy_queue {
+  boost::mutex mtx;
+  boost::condition_variable condition;
+  std::deque<entry> queue;
+  std::deque<entry> process_queue;
+  size_t queue_size;
+  bool done = false;
+
+  explicit legacy_queue(size_t size) : queue_size(size) {}
+
+  void push(const entry& e) {
+    int sleep_time = 100;
+    size_t last_queue_size = 0;
+    boost::mutex::scoped_lock lock(mtx);
+    if (queue.size() > queue_size) {
+      lock.unlock();
+      condition.notify_one();
+      if (last_queue_size < queue.size()) {
+        sleep_time += 100;
+      } else {
+        sleep_time -= 100;
+        if (sleep_time < 0) sleep_time = 100;
+      }
+      last_queue_size = queue.size();
+      boost::this_thread::sleep_for(boost::chrono::milliseconds(sleep_time));
+      lock.lock();
+    }
+    queue.emplace_back(e);
+    lock.unlock();
+    condition.notify_one();
+  }
+
+  void consume(uint64_t work_ns) {
+    while (true) {
+      boost::mutex::scoped_lock lock(mtx);
+      while (queue.empty() && !done) {
+        condition.wait(lock);
+      }
+      process_queue = std::move(queue);
+      queue.clear();
+      const bool finished = done;
+      lock.unlock();
+      for (size_t i = 0; i < process_queue.size(); ++i) {
+        busy_wait(work_ns);
+      }
+      const bool drained = process_queue.empty();
+      process_queue.clear();
+      if (drained && finished) {
+        break;
+      }
+    }
+  }
+
+  void finish() {
+    boost::mutex::scoped_lock lock(mtx);
+    done = true;
+    condition.notify_one();
+  }
+};
+
+// The ring buffer with the same parking scheme kinesis_plugin uses.
+struct ring_queue {
+  eosio::spsc_ring<entry> ring;
+  boost::mutex mtx;
+  boost::condition_variable condition;
+  std::atomic<bool> consumer_waiting{false};
+  std::atomic<bool> done{false};
+
+  explicit ring_queue(size_t size) : ring(size, eosio::overflow_policy::block) {}
+
+  void push(const entry& e) {
+    ring.push(e);
+    if (consumer_waiting.load()) {
+      boost::mutex::scoped_lock lock(mtx);
+      condition.notify_one();
+    }
+  }
+
+  void consume(uint64_t work_ns) {
+    while (true) {
+      {
+        boost::mutex::scoped_lock lock(mtx);
+        consumer_waiting = true;
+        if (ring.empty() && !done) {
+          condition.wait_for(lock, boost::chrono::milliseconds(10));
+        }
+        consumer_waiting = false;
+      }
+      const bool finished = done;
+      const size_t processed = ring.consume_all([work_ns](entry&) { busy_wait(work_ns); });
+      if (processed == 0 && finished) {
+        break;
+      }
+    }
+  }
+
+  void finish() {
+    done = true;
+    boost::mutex::scoped_lock lock(mtx);
+    condition.notify_one();
+  }
+};
+
+template<typename Queue>
+void run(const char *name, size_t entries, size_t queue_size, uint64_t work_ns) {
+  Queue q(queue_size);
+  std::vector<entry> payloads;
+  payloads.reserve(entries);
+  for (size_t i = 0; i < entries; ++i) {
+    payloads.push_back(std::make_shared<int>(static_cast<int>(i)));
+  }
+  std::vector<uint64_t> latencies;
+  latencies.reserve(entries);
+
+  boost::thread consumer([&q, work_ns] { q.consume(work_ns); });
+  const auto begin = bench_clock::now();
+  for (const auto& e : payloads) {
+    const auto start = bench_clock::now();
+    q.push(e);
+    latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count());
+  }
+  const auto elapsed = bench_clock::now() - begin;
+  q.finish();
+  consumer.join();
+
+  std::sort(latencies.begin(), latencies.end());
+  auto pct = [&latencies](double p) { return latencies[std::min(latencies.size() - 1, size_t(p * latencies.size()))]; };
+  const double seconds = std::chrono::duration<double>(elapsed).count();
+  std::printf("%-8s enqueues/s %12.0f  p50 %8llu ns  p99 %8llu ns  p99.9 %10llu ns  max %12llu ns\n", name,
+              entries / seconds, (unsigned long long)pct(0.50), (unsigned long long)pct(0.99),
+              (unsigned long long)pct(0.999), (unsigned long long)latencies.back());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const size_t entries = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+  const size_t queue_size = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 16384;
+  const uint64_t work_ns = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 200;
+
+  std::printf("entries %zu, queue size %zu, consumer work %llu ns/entry\n", entries, queue_size,
+              (unsigned long long)work_ns);
+  run<legacy_queue>("legacy", entries, queue_size, work_ns);
+  run<ring_queue>("ring", entries, queue_size, work_ns);
+  return 0;
+}
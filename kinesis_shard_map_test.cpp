@@ -0,0 +1,135 @@
+// Offline checks of the shard map and hash key helpers, and of the producer's lane
+// assignment, using mock_shard_source in place of ListShards.
+#include "include/eosio/kinesis_plugin/kinesis_producer.hpp"
+#include "include/eosio/kinesis_plugin/kinesis_shard_map.hpp"
+#include "kinesis_test.hpp"
+
+#include <cstdio>
+
+using namespace eosio;
+
+static void check_hash_key_round_trip() {
+  const std::string max = "340282366920938463463374607431768211455";
+  hash_key key = 0;
+  const bool parsed_max = parse_hash_key(max, key);
+  CHECK(parsed_max);
+  CHECK(key == ~hash_key(0));
+  CHECK(format_hash_key(key) == max);
+  const bool parsed_zero = parse_hash_key("0", key);
+  CHECK(parsed_zero);
+  CHECK(key == 0);
+  CHECK(!parse_hash_key("340282366920938463463374607431768211456", key));
+  CHECK(!parse_hash_key("12a", key));
+  CHECK(!parse_hash_key("", key));
+}
+
+static void check_layout(const shard_map& map, size_t count) {
+  const auto shards = map.snapshot();
+  CHECK(shards);
+  CHECK(shards->size() == count);
+  CHECK(shards->front().start == 0);
+  CHECK(shards->back().end == ~hash_key(0));
+  for (size_t i = 0; i < shards->size(); ++i) {
+    const kinesis_shard& s = (*shards)[i];
+    if (i > 0) {
+      CHECK(s.start == (*shards)[i - 1].end + 1);
+    }
+    CHECK(shard_map::shard_for(*shards, s.start) == i);
+    CHECK(shard_map::shard_for(*shards, s.end) == i);
+
+    hash_key target = 0;
+    const bool parsed = parse_hash_key(s.target_key, target);
+    CHECK(parsed);
+    CHECK(target >= s.start && target <= s.end);
+    CHECK(shard_map::shard_for(*shards, target) == i);
+  }
+}
+
+static void check_shard_map() {
+  auto source = std::make_shared<mock_shard_source>(4);
+  shard_map map;
+  CHECK(map.version() == 0);
+  CHECK(!map.snapshot());
+  bool refreshed = map.refresh(*source);
+  CHECK(refreshed);
+  CHECK(map.version() == 1);
+  check_layout(map, 4);
+
+  // Resharding is picked up by the next refresh.
+  source->reshard(8);
+  refreshed = map.refresh(*source);
+  CHECK(refreshed);
+  CHECK(map.version() == 2);
+  check_layout(map, 8);
+}
+
+static const size_t kLANES = 3;
+static const size_t kSHARDS = 8;
+static const int kKEYS = 1000;
+
+// Without a shard map, partition keys are hashed onto the lanes.
+static void check_lanes_without_shards() {
+  kinesis_producer producer;
+  producer.kinesis_set_max_in_flight(kLANES);
+  producer.kinesis_set_shard_refresh(0);
+  producer.kinesis_init("kinesis_shard_map_test", "us-east-1");
+  for (int i = 0; i < kKEYS; ++i) {
+    const std::string key = std::to_string(i);
+    std::string explicit_hash_key;
+    const size_t lane = producer.kinesis_lane(key, explicit_hash_key);
+    CHECK(lane == std::hash<std::string>()(key) % kLANES);
+    CHECK(explicit_hash_key.empty());
+  }
+  producer.kinesis_destory();
+}
+
+// With a shard map, every shard is sent on one lane, so records of a shard stay in order.
+static void check_lanes_by_shard(bool spread) {
+  shard_map expected;
+  mock_shard_source expected_source(kSHARDS);
+  const bool listed = expected.refresh(expected_source);
+  CHECK(listed);
+  const auto shards = expected.snapshot();
+
+  kinesis_producer producer;
+  producer.kinesis_set_max_in_flight(kLANES);
+  producer.kinesis_set_shard_source(std::make_shared<mock_shard_source>(kSHARDS));
+  producer.kinesis_set_explicit_hash_spread(spread);
+  producer.kinesis_init("kinesis_shard_map_test", "us-east-1");
+  std::vector<size_t> keys_per_shard(kSHARDS, 0);
+  for (int i = 0; i < kKEYS; ++i) {
+    const std::string key = std::to_string(i);
+    std::string explicit_hash_key;
+    const size_t lane = producer.kinesis_lane(key, explicit_hash_key);
+    size_t shard;
+    if (spread) {
+      // the key is placed on a shard by its hash and sent with that shard's explicit hash key
+      shard = std::hash<std::string>()(key) % kSHARDS;
+      CHECK(explicit_hash_key == (*shards)[shard].target_key);
+      hash_key target = 0;
+      const bool parsed = parse_hash_key(explicit_hash_key, target);
+      CHECK(parsed);
+      CHECK(shard_map::shard_for(*shards, target) == shard);
+    } else {
+      shard = shard_map::shard_for(*shards, partition_key_hash(key));
+      CHECK(explicit_hash_key.empty());
+    }
+    CHECK(lane == shard % kLANES);
+    ++keys_per_shard[shard];
+  }
+  for (size_t n : keys_per_shard) {
+    CHECK(n > 0);
+  }
+  producer.kinesis_destory();
+}
+
+int main() {
+  check_hash_key_round_trip();
+  check_shard_map();
+  check_lanes_without_shards();
+  check_lanes_by_shard(false);
+  check_lanes_by_shard(true);
+
+  std::printf("kinesis_shard_map_test passed\n");
+  return 0;
+}
@@ -0,0 +1,82 @@
+// Recovery of the spill log after a crash: a torn record in a middle segment ends the log
+// there, so reading and acknowledging never get stuck on a gap.
+#include "include/eosio/kinesis_plugin/spill_log.hpp"
+#include "kinesis_test.hpp"
+
+#include <fstream>
+
+using namespace eosio;
+namespace bfs = boost::filesystem;
+
+static const size_t kSEGMENT_SIZE = 2 * 1024 * 1024;
+// two records per segment
+static const size_t kRECORD_SIZE = 700 * 1024;
+
+static std::string payload(uint64_t offset) {
+  return std::string(kRECORD_SIZE, static_cast<char>('a' + offset % 26));
+}
+
+static bool read_matches(spill_log& log, uint64_t offset) {
+  bool matches = false;
+  const bool found = log.read_one(offset, [&](const spill_log::record_view& r) {
+    const std::string expected = payload(offset);
+    matches = r.offset == offset && r.partition_key == std::to_string(offset) && r.size == expected.size() &&
+              std::memcmp(r.data, expected.data(), r.size) == 0;
+  });
+  return found && matches;
+}
+
+int main() {
+  const bfs::path dir = bfs::temp_directory_path() / bfs::unique_path("kinesis-spill-test-%%%%-%%%%");
+  {
+    spill_log log(dir, kSEGMENT_SIZE, 64 * kSEGMENT_SIZE);
+    for (uint64_t i = 0; i < 6; ++i) {
+      const std::string data = payload(i);
+      const uint64_t offset = log.append(1, std::to_string(i), data.data(), data.size());
+      CHECK(offset == i);
+    }
+  }
+  CHECK(bfs::exists(dir / "00000000000000000002.seg"));
+  CHECK(bfs::exists(dir / "00000000000000000004.seg"));
+
+  // tear record 3, the second one of the middle segment
+  {
+    const size_t record_header = 16;
+    const size_t key_and_type = 1 + 2 + 1;
+    const size_t second = 16 + record_header + key_and_type + kRECORD_SIZE;
+    std::fstream f((dir / "00000000000000000002.seg").string(), std::ios::in | std::ios::out | std::ios::binary);
+    f.seekp(second + record_header + 100);
+    f.put('!');
+  }
+
+  {
+    spill_log log(dir, kSEGMENT_SIZE, 64 * kSEGMENT_SIZE);
+    CHECK(log.committed() == 0);
+    CHECK(log.end() == 3);
+    for (uint64_t i = 0; i < 3; ++i) {
+      CHECK(read_matches(log, i));
+    }
+    bool read = false;
+    CHECK(!log.read_one(3, [&read](const spill_log::record_view&) { read = true; }));
+    CHECK(!read);
+    CHECK(!bfs::exists(dir / "00000000000000000004.seg"));
+
+    // appending continues at the gap, and acknowledging everything gets past it
+    const std::string data = payload(3);
+    const uint64_t offset = log.append(1, "3", data.data(), data.size());
+    CHECK(offset == 3);
+    CHECK(read_matches(log, 3));
+    log.commit(4);
+    CHECK(log.committed() == 4);
+  }
+
+  {
+    spill_log log(dir, kSEGMENT_SIZE, 64 * kSEGMENT_SIZE);
+    CHECK(log.committed() == 4);
+    CHECK(log.end() == 4);
+  }
+
+  bfs::remove_all(dir);
+  std::printf("kinesis_spill_log_test passed\n");
+  return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef KINESIS_TEST_HPP
+#define KINESIS_TEST_HPP
+
+#include <cstdio>
+#include <cstdlib>
+
+// Checks that stay on in release builds, unlike assert(); keep side effects out of the condition.
+#define CHECK(cond)                                                                \
+  do {                                                                             \
+    if (!(cond)) {                                                                 \
+      std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      std::abort();                                                                \
+    }                                                                              \
+  } while (0)
+
+#endif